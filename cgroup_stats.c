@@ -0,0 +1,239 @@
+/*
+ * cgroup_stats.c
+ *
+ * IO latency split by blkio cgroup
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+
+#include "compat.h"
+#include "cgroup_stats.h"
+
+#ifdef CONFIG_BLK_CGROUP
+
+/*
+ * 2.6.32 cannot rmdir a cgroup while its css is referenced, so a slot
+ * only borrows the css there and may be taken over by a new cgroup that
+ * reuses the memory of a removed one.  Later kernels keep a removed css
+ * around until its last reference is gone, a slot pins it.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+#define CG_SLOT_PINS_CSS
+#endif
+
+static void free_slot(struct cg_slot *slot)
+{
+	if (!slot)
+		return;
+#ifdef CG_SLOT_PINS_CSS
+	css_put(slot->css);
+#endif
+	if (slot->lstats)
+		destroy_latency_stats(slot->lstats);
+	kfree(slot);
+}
+
+static int find_slot(struct cg_stats *cs, unsigned long key)
+{
+	int i;
+
+	for (i = 0; i < cs->nr_slots; i++) {
+		if (ACCESS_ONCE(cs->keys[i]) == key)
+			return i;
+	}
+	return -1;
+}
+
+/* free slot, or the one whose cgroup has been idle for the longest */
+static int victim_slot(struct cg_stats *cs)
+{
+	int i, idx = 0;
+
+	for (i = 0; i < cs->nr_slots; i++) {
+		if (!cs->slots[i])
+			return i;
+		if (time_before(cs->slots[i]->last_used,
+				cs->slots[idx]->last_used))
+			idx = i;
+	}
+	return idx;
+}
+
+/* called with cs->lock held and a reference on 'css' */
+static void add_slot(struct cg_stats *cs, struct cgroup_subsys_state *css)
+{
+	struct cg_slot *slot, *old;
+	int idx;
+
+	slot = kzalloc(sizeof(struct cg_slot), GFP_KERNEL);
+	if (!slot)
+		return;
+	slot->lstats = create_latency_stats(cs->soft);
+	if (!slot->lstats) {
+		kfree(slot);
+		return;
+	}
+	slot->css = css;
+	slot->last_used = jiffies;
+	rcu_read_lock();
+	cgroup_path(css->cgroup, slot->name, CG_NAME_LEN);
+	rcu_read_unlock();
+#ifdef CG_SLOT_PINS_CSS
+	css_get(css);
+#endif
+
+	idx = victim_slot(cs);
+	old = cs->slots[idx];
+	if (old) {
+		/* hooks that found the old key are done before it is freed */
+		cs->keys[idx] = 0;
+		rcu_assign_pointer(cs->slots[idx], NULL);
+		compat_synchronize_sched();
+		free_slot(old);
+	}
+	rcu_assign_pointer(cs->slots[idx], slot);
+	smp_wmb();
+	cs->keys[idx] = (unsigned long)css;
+}
+
+static void cg_stats_work_fn(struct work_struct *work)
+{
+	struct cg_stats *cs = container_of(work, struct cg_stats, work);
+	struct cgroup_subsys_state *css;
+
+	css = xchg(&cs->pending, NULL);
+	if (!css)
+		return;
+	mutex_lock(&cs->lock);
+	if (find_slot(cs, (unsigned long)css) < 0)
+		add_slot(cs, css);
+	mutex_unlock(&cs->lock);
+	css_put(css);
+}
+
+struct cg_stats *cg_stats_create(unsigned int nr_slots, int soft)
+{
+	struct cg_stats *cs;
+
+	if (!nr_slots)
+		return NULL;
+	cs = kzalloc(sizeof(struct cg_stats), GFP_KERNEL);
+	if (!cs)
+		return NULL;
+	cs->nr_slots = min_t(unsigned int, nr_slots, CG_SLOTS_MAX);
+	cs->soft = soft;
+	mutex_init(&cs->lock);
+	INIT_WORK(&cs->work, cg_stats_work_fn);
+	return cs;
+}
+
+/* no hook may look 'cs' up any more */
+void cg_stats_destroy(struct cg_stats *cs)
+{
+	int i;
+
+	if (!cs)
+		return;
+	cancel_work_sync(&cs->work);
+	if (cs->pending)
+		css_put(cs->pending);
+	for (i = 0; i < cs->nr_slots; i++)
+		free_slot(cs->slots[i]);
+	kfree(cs);
+}
+
+/*
+ * slot of 'css', -1 if it has none yet.  Called from the hooks, in atomic
+ * context: a new cgroup is only queued here and gets its slot from the
+ * work item.
+ */
+int cg_stats_lookup(struct cg_stats *cs, struct cgroup_subsys_state *css)
+{
+	struct cg_slot *slot;
+	int idx;
+
+	if (!cs || !css)
+		return -1;
+
+	idx = find_slot(cs, (unsigned long)css);
+	if (idx >= 0) {
+		smp_rmb();
+		rcu_read_lock();
+		slot = rcu_dereference(cs->slots[idx]);
+		if (slot && slot->last_used != jiffies)
+			slot->last_used = jiffies;
+		rcu_read_unlock();
+		return idx;
+	}
+
+	/* one cgroup at a time, the next miss retries the others */
+	if (cs->pending || !css_tryget(css))
+		return -1;
+	if (cmpxchg(&cs->pending, NULL, css))
+		css_put(css);
+	else
+		schedule_work(&cs->work);
+	return -1;
+}
+
+/*
+ * counters of slot 'idx', NULL if it was evicted meanwhile.  Like the aux
+ * of a device they stay valid until the hook returns.
+ */
+struct latency_stats __percpu *cg_stats_get(struct cg_stats *cs, int idx)
+{
+	struct latency_stats __percpu *lstats = NULL;
+	struct cg_slot *slot;
+
+	if (!cs || idx < 0 || idx >= cs->nr_slots)
+		return NULL;
+	rcu_read_lock();
+	slot = rcu_dereference(cs->slots[idx]);
+	if (slot)
+		lstats = slot->lstats;
+	rcu_read_unlock();
+	return lstats;
+}
+
+/* call 'fn' with the counters of every slot added up over CPUs */
+int cg_stats_for_each(struct cg_stats *cs,
+		void (*fn)(void *priv, const char *name,
+			struct latency_stats_sum *sum),
+		void *priv)
+{
+	struct latency_stats_sum *sum;
+	int i;
+
+	if (!cs)
+		return 0;
+	sum = create_latency_stats_sum();
+	if (!sum)
+		return -ENOMEM;
+
+	mutex_lock(&cs->lock);
+	for (i = 0; i < cs->nr_slots; i++) {
+		if (!cs->slots[i])
+			continue;
+		memset(sum, 0, sizeof(struct latency_stats_sum));
+		fold_latency_stats(cs->slots[i]->lstats, sum);
+		fn(priv, cs->slots[i]->name, sum);
+	}
+	mutex_unlock(&cs->lock);
+	destroy_latency_stats_sum(sum);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _IO_LATENCY_CGROUP_STATS_H_
+#define _IO_LATENCY_CGROUP_STATS_H_
+
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/cgroup.h>
+
+#include "latency_stats.h"
+
+/*
+ * latency_stats of a device split by blkio cgroup.
+ *
+ * A device has at most 'nr_slots' cgroup slots.  The hooks find the slot
+ * of a cgroup by scanning 'keys', which is short enough to stay in a
+ * couple of cache lines.  A cgroup without a slot is handed to a work
+ * item that allocates one, evicting the least recently used slot when
+ * all are taken; its I/O is only counted in the device total until then.
+ */
+#define CG_SLOTS_MAX		64
+#define CG_NAME_LEN		128
+
+struct cg_slot {
+	struct cgroup_subsys_state *css;
+	unsigned long last_used;	/* jiffies of the last I/O */
+	struct latency_stats __percpu *lstats;
+	char name[CG_NAME_LEN];		/* path when the slot was added */
+};
+
+struct cg_stats {
+	/* css of every slot, 0 if the slot is free */
+	unsigned long keys[CG_SLOTS_MAX];
+	struct cg_slot *slots[CG_SLOTS_MAX];
+	unsigned int nr_slots;
+	/* protects the slots against the work and the readers */
+	struct mutex lock;
+	/* css waiting for a slot, with a reference held */
+	struct cgroup_subsys_state *pending;
+	struct work_struct work;
+	/* whether the slots count soft latency, see create_latency_stats() */
+	int soft;
+};
+
+#ifdef CONFIG_BLK_CGROUP
+struct cg_stats *cg_stats_create(unsigned int nr_slots, int soft);
+void cg_stats_destroy(struct cg_stats *cs);
+
+int cg_stats_lookup(struct cg_stats *cs, struct cgroup_subsys_state *css);
+struct latency_stats __percpu *cg_stats_get(struct cg_stats *cs, int idx);
+
+int cg_stats_for_each(struct cg_stats *cs,
+		void (*fn)(void *priv, const char *name,
+			struct latency_stats_sum *sum),
+		void *priv);
+#else
+static inline struct cg_stats *cg_stats_create(unsigned int nr_slots,
+						int soft)
+{
+	return NULL;
+}
+
+static inline void cg_stats_destroy(struct cg_stats *cs)
+{
+}
+
+static inline int cg_stats_lookup(struct cg_stats *cs,
+				struct cgroup_subsys_state *css)
+{
+	return -1;
+}
+
+static inline struct latency_stats __percpu *cg_stats_get(
+				struct cg_stats *cs, int idx)
+{
+	return NULL;
+}
+
+static inline int cg_stats_for_each(struct cg_stats *cs,
+		void (*fn)(void *priv, const char *name,
+			struct latency_stats_sum *sum),
+		void *priv)
+{
+	return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef _IO_LATENCY_COMPAT_H_
+#define _IO_LATENCY_COMPAT_H_
+
+/*
+ * Differences between the kernel APIs used here on our 2.6.32 hosts and on
+ * the blk-mq kernels (4.19 and later) the tracepoint backend runs on.
+ */
+
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/proc_fs.h>
+#include <linux/genhd.h>
+#include <linux/rculist.h>
+#include <linux/device.h>
+#include <linux/blkdev.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+#include <linux/blk-cgroup.h>
+#endif
+
+#ifndef ACCESS_ONCE
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+#endif
+
+/* 5.9 folded it into READ_ONCE(), only alpha ever needed it */
+#ifndef smp_read_barrier_depends
+#define smp_read_barrier_depends()	do { } while (0)
+#endif
+
+/* 3.9 dropped the separate hlist_node cursor from the iterators */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+#define compat_hlist_for_each_entry_rcu(tpos, pos, head, member)	\
+	hlist_for_each_entry_rcu(tpos, head, member)
+#define compat_hlist_for_each_entry_safe(tpos, pos, n, head, member)	\
+	hlist_for_each_entry_safe(tpos, n, head, member)
+#else
+#define compat_hlist_for_each_entry_rcu(tpos, pos, head, member)	\
+	hlist_for_each_entry_rcu(tpos, pos, head, member)
+#define compat_hlist_for_each_entry_safe(tpos, pos, n, head, member)	\
+	hlist_for_each_entry_safe(tpos, pos, n, head, member)
+#endif
+
+/* data passed to proc_create_data() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define PDE_DATA(inode)		pde_data(inode)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
+static inline void *PDE_DATA(const struct inode *inode)
+{
+	return container_of(inode, struct proc_inode, vfs_inode)->pde->data;
+}
+#endif
+
+/* 5.6 gave proc files their own operations struct */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+typedef struct proc_ops proc_fops_t;
+#define PROC_FOPS_INIT(_open, _read, _write, _llseek, _release, _mmap) { \
+	.proc_open	= _open,					\
+	.proc_read	= _read,					\
+	.proc_write	= _write,					\
+	.proc_lseek	= _llseek,					\
+	.proc_release	= _release,					\
+	.proc_mmap	= _mmap,					\
+}
+#else
+typedef struct file_operations proc_fops_t;
+#define PROC_FOPS_INIT(_open, _read, _write, _llseek, _release, _mmap) { \
+	.owner		= THIS_MODULE,					\
+	.open		= _open,					\
+	.read		= _read,					\
+	.write		= _write,					\
+	.llseek		= _llseek,					\
+	.release	= _release,					\
+	.mmap		= _mmap,					\
+}
+#endif
+
+static inline void *file_pde_data(struct file *file)
+{
+	return PDE_DATA(file->f_path.dentry->d_inode);
+}
+
+static inline void compat_vm_flags_clear(struct vm_area_struct *vma,
+					unsigned long flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, flags);
+#else
+	vma->vm_flags &= ~flags;
+#endif
+}
+
+/* gendisk of a device of the block class, NULL for partitions */
+static inline struct gendisk *compat_dev_to_whole_disk(struct device *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	struct block_device *bdev = dev_to_bdev(dev);
+
+	return bdev_partno(bdev) ? NULL : bdev->bd_disk;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	struct block_device *bdev = dev_to_bdev(dev);
+
+	return bdev->bd_partno ? NULL : bdev->bd_disk;
+#else
+	return dev_to_part(dev)->partno ? NULL : dev_to_disk(dev);
+#endif
+}
+
+/* where a partition of the block class lies on its disk */
+struct compat_part_info {
+	struct gendisk *disk;
+	sector_t start;
+	sector_t nr_sects;
+};
+
+/* partition number of a device of the block class, 0 for a whole disk */
+static inline int compat_dev_to_part(struct device *dev,
+				struct compat_part_info *info)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	struct block_device *bdev = dev_to_bdev(dev);
+
+	info->disk = bdev->bd_disk;
+	info->start = bdev->bd_start_sect;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	info->nr_sects = bdev_nr_sectors(bdev);
+#else
+	info->nr_sects = i_size_read(bdev->bd_inode) >> 9;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	return bdev_partno(bdev);
+#else
+	return bdev->bd_partno;
+#endif
+#else
+	struct hd_struct *part = dev_to_part(dev);
+
+	info->disk = part_to_disk(part);
+	info->start = part->start_sect;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+	info->nr_sects = part_nr_sects_read(part);
+#else
+	info->nr_sects = part->nr_sects;
+#endif
+	return part->partno;
+#endif
+}
+
+/*
+ * cheap ns clock of the current CPU, kept within about a jiffy of the
+ * other CPUs even where their TSCs drift; local_clock() came with 2.6.37
+ */
+static inline u64 compat_local_clock(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	return local_clock();
+#else
+	return cpu_clock(raw_smp_processor_id());
+#endif
+}
+
+/* waits for preempt-disabled sections, RCU does that by itself since 4.20 */
+static inline void compat_synchronize_sched(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	synchronize_rcu();
+#else
+	synchronize_sched();
+#endif
+}
+
+/* 6.4 dropped the class_interface argument of add_dev/remove_dev */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define CLASS_INTF_PARAMS	struct device *dev
+#else
+#define CLASS_INTF_PARAMS	struct device *dev, struct class_interface *intf
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+/* queue of a driver that takes bios directly, without requests */
+static inline int compat_queue_is_bio_based(struct request_queue *q)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	return !queue_is_mq(q);
+#else
+	return !q->mq_ops && !q->request_fn;
+#endif
+}
+
+#ifdef CONFIG_BLK_CGROUP
+/* blkio cgroup a bio is charged to, NULL if none */
+static inline struct cgroup_subsys_state *
+compat_bio_blkcg_css(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	return bio_blkcg_css(bio);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	return bio->bi_blkg ? &bio->bi_blkg->blkcg->css : NULL;
+#else
+	return bio->bi_css;
+#endif
+}
+#endif
+#endif
+
+#endif
@@ -1,136 +1,381 @@
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+
 #include "hash_table.h"
+#include "compat.h"
+
+/* bucket lock shards per possible cpu */
+#define HASH_LOCKS_PER_CPU	4
 
-static int compute_hash(struct hash_table *table, unsigned long key)
+/*
+ * every table takes its nodes from one cache, a cache per table would
+ * make creating the table of every disk slower the more disks there are
+ */
+static struct kmem_cache *hash_node_cache;
+static unsigned int nr_hash_tables;
+static DEFINE_MUTEX(hash_cache_mutex);
+
+static int get_hash_node_cache(void)
 {
-	return (int)(key % table->nr_ent);
+	int res = 0;
+
+	mutex_lock(&hash_cache_mutex);
+	if (!hash_node_cache)
+		hash_node_cache = kmem_cache_create("io-latency-hash-node",
+					sizeof(struct hash_node), 0, 0, NULL);
+	if (hash_node_cache)
+		nr_hash_tables++;
+	else
+		res = -ENOMEM;
+	mutex_unlock(&hash_cache_mutex);
+	return res;
 }
 
-struct hash_node *hash_table_find(struct hash_table *table, unsigned long key)
+static void put_hash_node_cache(void)
 {
-	struct hlist_head *hp;
-	struct hlist_node *hn, *tmp;
+	mutex_lock(&hash_cache_mutex);
+	if (--nr_hash_tables == 0) {
+		/* wait for the nodes and buckets the writers queued */
+		rcu_barrier();
+		kmem_cache_destroy(hash_node_cache);
+		hash_node_cache = NULL;
+	}
+	mutex_unlock(&hash_cache_mutex);
+}
+
+static inline unsigned int compute_hash(struct hash_buckets *b,
+					unsigned long key)
+{
+	return hash_long(key, b->bits);
+}
+
+static inline spinlock_t *bucket_lock(struct hash_table *table,
+					unsigned int hash)
+{
+	return table->locks + (hash & table->lock_mask);
+}
+
+/* must be called with rcu_read_lock() or the bucket lock held */
+static struct hash_node *__hash_table_find(struct hlist_head *hp,
+					unsigned long key)
+{
+	struct hlist_node *hn __maybe_unused;
 	struct hash_node *nd;
 
-	hp = table->tbl + compute_hash(table, key);
-	if (!hp)
-		return NULL;
-	hlist_for_each_entry_safe(nd, hn, tmp, hp, node) {
+	compat_hlist_for_each_entry_rcu(nd, hn, hp, node) {
 		if (nd->key == key)
 			return nd;
 	}
 	return NULL;
 }
 
-struct hash_table *create_hash_table(const char *name, int nr_ent)
+static void free_hash_node_rcu(struct rcu_head *head)
 {
-	struct hash_table *table;
+	kmem_cache_free(hash_node_cache,
+			container_of(head, struct hash_node, rcu));
+}
 
-	table = kzalloc(sizeof(struct hash_table), GFP_KERNEL);
-	if (!table)
-		return NULL;
+/* must be called with the bucket lock held */
+static void __hash_table_del(struct hash_table *table, struct hash_node *nd)
+{
+	/* readers racing with us may still match it and read 'value' */
+	hlist_del_rcu(&nd->node);
+	call_rcu(&nd->rcu, free_hash_node_rcu);
+	if (table->grow)
+		table->nr_nodes--;
+}
 
-	table->tbl = kzalloc(sizeof(struct hlist_head) * nr_ent, GFP_KERNEL);
-	if (!table->tbl) {
-		kfree(table);
+static struct hash_buckets *alloc_hash_buckets(struct hash_table *table,
+					unsigned int bits)
+{
+	struct hash_buckets *b;
+
+	b = kzalloc(sizeof(struct hash_buckets) +
+			sizeof(struct hlist_head) * (1U << bits), GFP_KERNEL);
+	if (!b)
 		return NULL;
+	b->bits = bits;
+	b->nr_ent = 1U << bits;
+	return b;
+}
+
+/* also frees the nodes still in it */
+static void free_hash_buckets(struct hash_buckets *b)
+{
+	struct hlist_head *hp;
+	struct hlist_node *hn __maybe_unused, *tmp;
+	struct hash_node *nd;
+	int i;
+
+	for (i = 0; i < b->nr_ent; i++) {
+		hp = b->tbl + i;
+		compat_hlist_for_each_entry_safe(nd, hn, tmp, hp, node) {
+			hlist_del_init(&nd->node);
+			kmem_cache_free(hash_node_cache, nd);
+		}
+	}
+	kfree(b);
+}
+
+static void free_hash_buckets_rcu(struct rcu_head *head)
+{
+	free_hash_buckets(container_of(head, struct hash_buckets, rcu));
+}
+
+/*
+ * doubles the buckets of a growing table once it holds more nodes than
+ * buckets.  The nodes are copied rather than moved, lookups still
+ * walking the old chains find every one of them until a grace period
+ * has passed; failing to allocate just leaves the chains longer.
+ */
+static void grow_hash_table(struct hash_table *table)
+{
+	struct hash_buckets *old = table->buckets, *b;
+	struct hlist_node *hn __maybe_unused;
+	struct hash_node *nd, *copy;
+	int i;
+
+	if (table->nr_nodes <= old->nr_ent)
+		return;
+	b = alloc_hash_buckets(table, old->bits + 1);
+	if (!b)
+		return;
+	for (i = 0; i < old->nr_ent; i++) {
+		compat_hlist_for_each_entry_rcu(nd, hn, old->tbl + i, node) {
+			copy = kmem_cache_zalloc(hash_node_cache, GFP_KERNEL);
+			if (!copy) {
+				free_hash_buckets(b);
+				return;
+			}
+			copy->key = nd->key;
+			copy->value = nd->value;
+			hlist_add_head_rcu(&copy->node,
+					b->tbl + compute_hash(b, nd->key));
+		}
+	}
+	rcu_assign_pointer(table->buckets, b);
+	call_rcu(&old->rcu, free_hash_buckets_rcu);
+}
+
+int hash_table_find(struct hash_table *table, unsigned long key,
+			unsigned long *value)
+{
+	struct hash_buckets *b;
+	struct hash_node *nd;
+	int res = -ENODEV;
+
+	rcu_read_lock();
+	b = rcu_dereference(table->buckets);
+	nd = __hash_table_find(b->tbl + compute_hash(b, key), key);
+	if (nd) {
+		if (value)
+			*value = ACCESS_ONCE(nd->value);
+		res = 0;
 	}
+	rcu_read_unlock();
+	return res;
+}
+
+static struct hash_table *__create_hash_table(const char *name, int nr_ent,
+					int grow)
+{
+	struct hash_table *table;
+	unsigned int nr_locks;
+	int i;
+
+	if (nr_ent < 2)
+		nr_ent = 2;
 
+	table = kzalloc(sizeof(struct hash_table), GFP_KERNEL);
+	if (!table)
+		return NULL;
+	table->grow = grow;
 	strncpy(table->name, name, MAX_HASH_TABLE_NAME_LEN);
-	table->cache = kmem_cache_create(table->name, sizeof(struct hash_node),
-					0, 0, NULL);
-	if (!table->cache) {
-		kfree(table->tbl);
+	if (get_hash_node_cache()) {
 		kfree(table);
 		return NULL;
 	}
-	table->nr_ent = nr_ent;
+
+	table->buckets = alloc_hash_buckets(table,
+				ilog2(roundup_pow_of_two(nr_ent)));
+	if (!table->buckets)
+		goto err;
+
+	nr_locks = roundup_pow_of_two(num_possible_cpus() * HASH_LOCKS_PER_CPU);
+	if (nr_locks > table->buckets->nr_ent)
+		nr_locks = table->buckets->nr_ent;
+	table->lock_mask = nr_locks - 1;
+	table->locks = kmalloc(sizeof(spinlock_t) * nr_locks, GFP_KERNEL);
+	if (!table->locks)
+		goto err;
+	for (i = 0; i < nr_locks; i++)
+		spin_lock_init(table->locks + i);
 	return table;
+err:
+	destroy_hash_table(table);
+	return NULL;
+}
+
+struct hash_table *create_hash_table(const char *name, int nr_ent)
+{
+	return __create_hash_table(name, nr_ent, 0);
+}
+
+/* 'nr_ent' is where it starts, see struct hash_table */
+struct hash_table *create_growing_hash_table(const char *name, int nr_ent)
+{
+	return __create_hash_table(name, nr_ent, 1);
 }
 
 void destroy_hash_table(struct hash_table *table)
 {
+	/* put_hash_node_cache() waits for the nodes and buckets queued */
+	if (table->buckets)
+		free_hash_buckets(table->buckets);
+	put_hash_node_cache();
+	kfree(table->locks);
+	kfree(table);
+}
+
+static int __hash_table_add(struct hash_table *table, unsigned long key,
+			unsigned long value, int replace, unsigned long *old)
+{
+	struct hash_buckets *b = table->buckets;
 	struct hlist_head *hp;
-	struct hlist_node *hn, *tmp;
 	struct hash_node *nd;
-	int i;
+	spinlock_t *lock;
+	unsigned long flags;
+	unsigned int hash;
+	int res = 0;
 
-	for (i = 0; i < table->nr_ent; i++) {
-		hp = table->tbl + i;
-		hlist_for_each_entry_safe(nd, hn, tmp, hp, node) {
-			hlist_del_init(&nd->node);
-			kmem_cache_free(table->cache, nd);
-			table->nr_node--;
-		}
+	hash = compute_hash(b, key);
+	hp = b->tbl + hash;
+	lock = bucket_lock(table, hash);
+
+	spin_lock_irqsave(lock, flags);
+	nd = __hash_table_find(hp, key);
+	if (nd) {
+		if (old)
+			*old = nd->value;
+		if (replace)
+			nd->value = value;
+		else
+			res = -EEXIST;
+		goto out;
 	}
-	if (table->cache)
-		kmem_cache_destroy(table->cache);
-	kfree(table->tbl);
-	kfree(table);
+
+	nd = kmem_cache_zalloc(hash_node_cache, GFP_NOWAIT);
+	if (!nd) {
+		res = -ENOMEM;
+		goto out;
+	}
+	nd->key = key;
+	nd->value = value;
+	hlist_add_head_rcu(&nd->node, hp);
+	if (table->grow)
+		table->nr_nodes++;
+	res = 1;
+out:
+	spin_unlock_irqrestore(lock, flags);
+	return res;
 }
 
 int hash_table_insert(struct hash_table *table, unsigned long key,
 			unsigned long value)
 {
-	struct hlist_head *hp;
-	struct hash_node *nd;
-	nd = hash_table_find(table, key);
+	int res;
 
-	if (nd)
-		return -EEXIST;
+	res = __hash_table_add(table, key, value, 0, NULL);
+	if (res > 0 && table->grow)
+		grow_hash_table(table);
+	return res < 0 ? res : 0;
+}
 
-	nd = kmem_cache_zalloc(table->cache, GFP_NOWAIT);
-	if (!nd)
-		return -ENOMEM;
+/* insert 'key' or overwrite the value of an existing node */
+int hash_table_set(struct hash_table *table, unsigned long key,
+			unsigned long value)
+{
+	int res;
 
-	hp = table->tbl + compute_hash(table, key);
-	nd->key = key;
-	nd->value = value;
-	hlist_add_head(&nd->node, hp);
-	table->nr_node++;
-	return 0;
+	res = __hash_table_add(table, key, value, 1, NULL);
+	if (res > 0 && table->grow)
+		grow_hash_table(table);
+	return res < 0 ? res : 0;
 }
 
-int hash_table_remove(struct hash_table *table, unsigned long key)
+/* replace the value of an existing node, returning the previous one */
+int hash_table_exchange(struct hash_table *table, unsigned long key,
+			unsigned long value, unsigned long *old)
 {
+	struct hash_buckets *b = table->buckets;
 	struct hash_node *nd;
-	nd = hash_table_find(table, key);
+	spinlock_t *lock;
+	unsigned long flags;
+	unsigned int hash;
+	int res = -ENODEV;
+
+	hash = compute_hash(b, key);
+	lock = bucket_lock(table, hash);
+
+	spin_lock_irqsave(lock, flags);
+	nd = __hash_table_find(b->tbl + hash, key);
+	if (nd) {
+		if (old)
+			*old = nd->value;
+		nd->value = value;
+		res = 0;
+	}
+	spin_unlock_irqrestore(lock, flags);
+	return res;
+}
 
-	if (!nd)
-		return -ENODEV;
-	hlist_del_init(&nd->node);
-	kmem_cache_free(table->cache, nd);
-	return 0;
+int hash_table_remove(struct hash_table *table, unsigned long key)
+{
+	return hash_table_find_and_remove(table, key, NULL);
 }
 
 int hash_table_find_and_remove(struct hash_table *table, unsigned long key,
 				unsigned long *value)
 {
+	struct hash_buckets *b = table->buckets;
 	struct hash_node *nd;
-	nd = hash_table_find(table, key);
-	if (!nd)
-		return -ENODEV;
-	if (value)
-		*value = nd->value;
-	hlist_del_init(&nd->node);
-	kmem_cache_free(table->cache, nd);
-	table->nr_node--;
-	return 0;
+	spinlock_t *lock;
+	unsigned long flags;
+	unsigned int hash;
+	int res = -ENODEV;
+
+	hash = compute_hash(b, key);
+	lock = bucket_lock(table, hash);
+
+	spin_lock_irqsave(lock, flags);
+	nd = __hash_table_find(b->tbl + hash, key);
+	if (nd) {
+		if (value)
+			*value = nd->value;
+		__hash_table_del(table, nd);
+		res = 0;
+	}
+	spin_unlock_irqrestore(lock, flags);
+	return res;
 }
 
+/* caller must make sure nobody inserts or removes nodes concurrently */
 void call_for_each_hash_node(struct hash_table *table,
 			int(*func)(struct hash_node *nd))
 {
+	struct hash_buckets *b = table->buckets;
 	struct hlist_head *hp;
-	struct hlist_node *hn, *tmp;
+	struct hlist_node *hn __maybe_unused, *tmp;
 	struct hash_node *nd;
 	int i;
 
-	for (i = 0; i < table->nr_ent; i++) {
-		hp = table->tbl + i;
-		hlist_for_each_entry_safe(nd, hn, tmp, hp, node) {
+	for (i = 0; i < b->nr_ent; i++) {
+		hp = b->tbl + i;
+		compat_hlist_for_each_entry_safe(nd, hn, tmp, hp, node) {
 			if (func(nd))
 				break;
 		}
 	}
 }
-
@@ -2,31 +2,61 @@
 #define _IO_LATENCY_HASH_TABLE_H_
 
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 
 #define MAX_HASH_TABLE_NAME_LEN		64
 
+/* a bucket array, replaced as a whole when a growing table grows */
+struct hash_buckets {
+	struct rcu_head rcu;
+	unsigned int bits;
+	unsigned int nr_ent;
+	struct hlist_head tbl[0];
+};
+
+/*
+ * Concurrent hash table: the bucket array is always a power of two and
+ * indexed by a multiplicative hash, lookups walk the chains under RCU and
+ * writers serialize on a small array of striped bucket locks, so
+ * hooks running on different CPUs only contend when they hit the same
+ * lock shard.
+ *
+ * A growing table doubles its buckets once it holds more nodes than
+ * buckets, lookups never wait for that.  Its writers must be serialized
+ * by the caller and may sleep.
+ */
 struct hash_table {
-	struct hlist_head *tbl;
-	struct kmem_cache *cache;
+	struct hash_buckets *buckets;
+	spinlock_t *locks;
 	char name[MAX_HASH_TABLE_NAME_LEN];
-	int nr_ent;
-	int nr_node;
+	unsigned int lock_mask;
+	int grow;
+	/* nodes of a growing table */
+	unsigned int nr_nodes;
 };
 
 struct hash_node {
 	struct hlist_node node;
+	struct rcu_head rcu;
 	unsigned long key;
 	unsigned long value;
 };
 
 struct hash_table *create_hash_table(const char *name, int nr_ent);
+struct hash_table *create_growing_hash_table(const char *name, int nr_ent);
 void destroy_hash_table(struct hash_table *table);
 
 int hash_table_insert(struct hash_table *table, unsigned long key,
 			unsigned long value);
+int hash_table_set(struct hash_table *table, unsigned long key,
+			unsigned long value);
+int hash_table_exchange(struct hash_table *table, unsigned long key,
+			unsigned long value, unsigned long *old);
 int hash_table_remove(struct hash_table *table, unsigned long key);
 
-struct hash_node *hash_table_find(struct hash_table *table, unsigned long key);
+int hash_table_find(struct hash_table *table, unsigned long key,
+			unsigned long *value);
 int hash_table_find_and_remove(struct hash_table *table, unsigned long key,
 				unsigned long *value);
 
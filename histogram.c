@@ -0,0 +1,110 @@
+/*
+ * histogram.c
+ *
+ * log-linear histogram for IO latency
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+
+#include "histogram.h"
+
+u64 lat_hist_bucket_low(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < LAT_HIST_SUB_NR)
+		return (u64)idx << LAT_HIST_UNIT_SHIFT;
+
+	shift = (idx >> (LAT_HIST_SUB_BITS - 1)) - 1;
+	idx -= shift << (LAT_HIST_SUB_BITS - 1);
+	return (u64)idx << (shift + LAT_HIST_UNIT_SHIFT);
+}
+
+u64 lat_hist_bucket_high(unsigned int idx)
+{
+	return lat_hist_bucket_low(idx + 1) - 1;
+}
+
+void lat_hist_fold(struct lat_hist_sum *sum, const struct lat_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < LAT_HIST_NR; i++)
+		sum->buckets[i] += hist->buckets[i];
+	sum->sum += hist->sum;
+	if (hist->max > sum->max)
+		sum->max = hist->max;
+}
+
+/*
+ * take 'base', an earlier fold of the same counters, out of 'sum'.  The
+ * max cannot be subtracted, bound it by the slowest bucket left instead.
+ */
+void lat_hist_sub(struct lat_hist_sum *sum, const struct lat_hist_sum *base)
+{
+	int i, top = -1;
+
+	for (i = 0; i < LAT_HIST_NR; i++) {
+		sum->buckets[i] -= base->buckets[i];
+		if (sum->buckets[i])
+			top = i;
+	}
+	sum->sum -= base->sum;
+	if (top < 0)
+		sum->max = 0;
+	else
+		sum->max = min_t(u64, sum->max, lat_hist_bucket_high(top));
+}
+
+u64 lat_hist_count(struct lat_hist_sum * const *hists, int nr_hists)
+{
+	u64 count = 0;
+	int i, h;
+
+	for (h = 0; h < nr_hists; h++)
+		for (i = 0; i < LAT_HIST_NR; i++)
+			count += hists[h]->buckets[i];
+	return count;
+}
+
+/*
+ * Walk the buckets of 'hists' (added together) once and find, for every
+ * entry of the ascending 'per100k' array, the latency in ns below which
+ * per100k/100000 of the samples fall.  The upper bound of the bucket is
+ * reported, clamped to the largest latency really seen.
+ */
+void lat_hist_percentiles(struct lat_hist_sum * const *hists, int nr_hists,
+			const unsigned int *per100k, u64 *values, int nr)
+{
+	u64 count, rank, seen = 0, max = 0;
+	int i, h, n = 0;
+
+	for (h = 0; h < nr_hists; h++)
+		if (hists[h]->max > max)
+			max = hists[h]->max;
+
+	count = lat_hist_count(hists, nr_hists);
+	for (i = 0; i < LAT_HIST_NR && n < nr; i++) {
+		for (h = 0; h < nr_hists; h++)
+			seen += hists[h]->buckets[i];
+		while (n < nr) {
+			rank = div_u64(count * per100k[n] + 99999, 100000);
+			if (!count || seen < rank)
+				break;
+			values[n++] = min_t(u64, lat_hist_bucket_high(i), max);
+		}
+	}
+	while (n < nr)
+		values[n++] = count ? max : 0;
+}
@@ -0,0 +1,94 @@
+#ifndef _IO_LATENCY_HISTOGRAM_H_
+#define _IO_LATENCY_HISTOGRAM_H_
+
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/bitops.h>
+
+#include "config.h"
+
+/*
+ * Log-linear (HDR style) latency histogram.
+ *
+ * Values are kept in units of 2^LAT_HIST_UNIT_SHIFT ns (128ns).  The first
+ * LAT_HIST_SUB_NR buckets are linear, after that every power of two is
+ * split into LAT_HIST_SUB_NR/2 linear sub-buckets, so the relative error
+ * of a bucket never exceeds 2/LAT_HIST_SUB_NR.  Bucket index only needs a
+ * fls64() and two shifts, no division.
+ *
+ * LAT_HIST_DIGITS selects the precision at build time ('make HIST_DIGITS=2'):
+ *	1: 16 sub-buckets, <= 12.5% error, 240 buckets for 128ns - 300s
+ *	2: 128 sub-buckets, <= 1.6% error, 1728 buckets for 128ns - 300s
+ */
+#ifndef LAT_HIST_DIGITS
+#define LAT_HIST_DIGITS		1
+#endif
+
+#if LAT_HIST_DIGITS >= 2
+#define LAT_HIST_SUB_BITS	7
+#else
+#define LAT_HIST_SUB_BITS	4
+#endif
+
+#define LAT_HIST_SUB_NR		(1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_UNIT_SHIFT	7
+/* 300s is max disk I/O latency which application may accept, < 2^32 units */
+#define LAT_HIST_MAX_BITS	32
+#define LAT_HIST_MAX_SHIFT	(LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS)
+#define LAT_HIST_NR		((LAT_HIST_MAX_SHIFT + 2) << (LAT_HIST_SUB_BITS - 1))
+
+/* per-cpu buckets are 32 bit, see struct latency_stats */
+struct lat_hist {
+	u32 buckets[LAT_HIST_NR];
+	/* total and largest latency (ns) seen, for mean and max */
+	u64 sum;
+	u64 max;
+};
+
+/* lat_hist of every CPU added up */
+struct lat_hist_sum {
+	u64 buckets[LAT_HIST_NR];
+	u64 sum;
+	u64 max;
+};
+
+static inline unsigned int lat_hist_index(u64 ns)
+{
+	u64 v = ns >> LAT_HIST_UNIT_SHIFT;
+	int shift = fls64(v) - LAT_HIST_SUB_BITS;
+
+	if (shift <= 0)
+		return (unsigned int)v;
+	/* slower than ~550s, account into the last bucket */
+	if (unlikely(shift > LAT_HIST_MAX_SHIFT))
+		return LAT_HIST_NR - 1;
+	return (shift << (LAT_HIST_SUB_BITS - 1)) + (unsigned int)(v >> shift);
+}
+
+/*
+ * Coarse log2 buckets for the latencies of the two dimensional histograms:
+ * bucket 0 counts latencies below 2^LAT_LOG2_UNIT_SHIFT ns (~1us), bucket
+ * i > 0 the ones of [2^(i-1), 2^i) units and the last one also everything
+ * slower (~4s).
+ */
+#define LAT_LOG2_NR		24
+#define LAT_LOG2_UNIT_SHIFT	10
+
+static inline unsigned int lat_log2_index(u64 ns)
+{
+	unsigned int idx = fls64(ns >> LAT_LOG2_UNIT_SHIFT);
+
+	return idx < LAT_LOG2_NR ? idx : LAT_LOG2_NR - 1;
+}
+
+/* smallest and largest latency (ns) accounted into bucket 'idx' */
+u64 lat_hist_bucket_low(unsigned int idx);
+u64 lat_hist_bucket_high(unsigned int idx);
+
+void lat_hist_fold(struct lat_hist_sum *sum, const struct lat_hist *hist);
+void lat_hist_sub(struct lat_hist_sum *sum, const struct lat_hist_sum *base);
+u64 lat_hist_count(struct lat_hist_sum * const *hists, int nr_hists);
+void lat_hist_percentiles(struct lat_hist_sum * const *hists, int nr_hists,
+			const unsigned int *per100k, u64 *values, int nr);
+
+#endif
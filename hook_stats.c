@@ -0,0 +1,63 @@
+/*
+ * hook_stats.c
+ *
+ * cost of the hooks of io-latency itself
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "hook_stats.h"
+
+struct hook_stats *hook_stats_create(unsigned int nr_hooks)
+{
+	struct hook_stats *hs;
+
+	hs = kzalloc(sizeof(struct hook_stats), GFP_KERNEL);
+	if (!hs)
+		return NULL;
+	hs->counters = __alloc_percpu(sizeof(struct hook_counters) * nr_hooks,
+				__alignof__(struct hook_counters));
+	if (!hs->counters) {
+		kfree(hs);
+		return NULL;
+	}
+	hs->nr = nr_hooks;
+	return hs;
+}
+
+void hook_stats_destroy(struct hook_stats *hs)
+{
+	if (!hs)
+		return;
+	free_percpu(hs->counters);
+	kfree(hs);
+}
+
+/* add up the counters of 'hook' over all CPUs */
+void hook_stats_fold(struct hook_stats *hs, int hook,
+			struct hook_counters *sum)
+{
+	struct hook_counters *hc;
+	int i, cpu;
+
+	memset(sum, 0, sizeof(struct hook_counters));
+	for_each_possible_cpu(cpu) {
+		hc = per_cpu_ptr(hs->counters, cpu) + hook;
+		for (i = 0; i < HOOK_COUNT_NR; i++)
+			sum->count[i] += hc->count[i];
+		sum->ns += hc->ns;
+		for (i = 0; i < HOOK_HIST_NR; i++)
+			sum->hist[i] += hc->hist[i];
+	}
+}
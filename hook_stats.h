@@ -0,0 +1,74 @@
+#ifndef _IO_LATENCY_HOOK_STATS_H_
+#define _IO_LATENCY_HOOK_STATS_H_
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+
+/*
+ * What the hooks cost themselves, for every hook and CPU: how often it
+ * ran, how often a lookup of it found nothing (a disk that is not
+ * watched, a request or bio without a stamp), how often it had to drop
+ * an I/O (table or memory full) and a log2 histogram of the ns it spent
+ * outside of the function it hooks.  Hooks run with preemption off.
+ */
+enum {
+	HOOK_CALLS,
+	/* calls that were timed, 'ns' and 'hist' only count those */
+	HOOK_TIMED,
+	HOOK_MISSES,
+	HOOK_DROPS,
+	HOOK_COUNT_NR,
+};
+
+/* bucket 0 counts below 16ns, bucket i [2^(i+3), 2^(i+4)), the last more */
+#define HOOK_HIST_NR		16
+#define HOOK_HIST_SHIFT		4
+
+struct hook_counters {
+	u64 count[HOOK_COUNT_NR];
+	u64 ns;
+	u64 hist[HOOK_HIST_NR];
+};
+
+struct hook_stats {
+	/* 'nr' hook_counters per CPU */
+	struct hook_counters __percpu *counters;
+	unsigned int nr;
+};
+
+static inline struct hook_counters *hook_counters(struct hook_stats *hs,
+						int hook)
+{
+	return per_cpu_ptr(hs->counters, smp_processor_id()) + hook;
+}
+
+static inline unsigned int hook_hist_index(u64 ns)
+{
+	int idx = fls64(ns >> HOOK_HIST_SHIFT);
+
+	return idx < HOOK_HIST_NR ? idx : HOOK_HIST_NR - 1;
+}
+
+static inline void hook_stats_inc(struct hook_stats *hs, int hook, int what)
+{
+	hook_counters(hs, hook)->count[what]++;
+}
+
+/* a call of 'hook' that took 'ns' */
+static inline void hook_stats_add(struct hook_stats *hs, int hook, u64 ns)
+{
+	struct hook_counters *hc = hook_counters(hs, hook);
+
+	hc->count[HOOK_CALLS]++;
+	hc->count[HOOK_TIMED]++;
+	hc->ns += ns;
+	hc->hist[hook_hist_index(ns)]++;
+}
+
+struct hook_stats *hook_stats_create(unsigned int nr_hooks);
+void hook_stats_destroy(struct hook_stats *hs);
+void hook_stats_fold(struct hook_stats *hs, int hook,
+			struct hook_counters *sum);
+
+#endif
@@ -10,12 +10,18 @@
 #include <linux/mutex.h>
 
 #include "config.h"
+#include "compat.h"
 #include "hotfixes.h"
 
 #define PROC_ENTRY_NAME "hotfixes"
 
 #define RELATIVEJUMP_OPCODE 0xe9
 
+/*
+ * io-latency built with USE_TRACEPOINT only needs the symbol lookup, the
+ * text patching below is specific to the 2.6.32 kernels
+ */
+#ifndef USE_TRACEPOINT
 static void *(*my_text_poke_smp)(void *addr, const void *opcode, size_t len);
 static struct mutex *my_text_mutex;
 static void *(*my_module_alloc)(unsigned long size);
@@ -93,6 +99,7 @@ void *__kprobes text_poke_smp(void *addr, const void *opcode, size_t len)
 #define my_list_add_tail(new, head) list_add_tail(new, head)
 #define my_list_del(entry) list_del(entry)
 #endif
+#endif /* USE_TRACEPOINT */
 
 void *ali_get_symbol_address(const char *name)
 {
@@ -141,6 +148,7 @@ int ali_get_symbol_address_list(struct ali_sym_addr *list, int *failed)
 }
 EXPORT_SYMBOL(ali_get_symbol_address_list);
 
+#ifndef USE_TRACEPOINT
 static void try_to_create_orig_stub(struct ali_hotfix *h)
 {
 	unsigned char *addr = h->addr;
@@ -277,10 +285,12 @@ static int init_hotfix(void)
 
 	return 0;
 }
+#endif /* USE_TRACEPOINT */
 
 static LIST_HEAD(hotfix_desc_head);
 static DEFINE_MUTEX(hotfix_lock);
 
+#ifndef USE_TRACEPOINT
 static int is_dup(struct ali_hotfix_desc *n)
 {
 	struct list_head *pos;
@@ -364,6 +374,7 @@ void ali_hotfix_unregister_list(struct ali_hotfix_desc *desc_list)
 		ali_hotfix_unregister(&desc_list[i]);
 }
 EXPORT_SYMBOL(ali_hotfix_unregister_list);
+#endif /* USE_TRACEPOINT */
 
 static int hotfix_info_show(struct seq_file *m, void *v)
 {
@@ -397,21 +408,20 @@ static int hotfix_info_open(struct inode *inode, struct file *filp)
 	return single_open(filp, hotfix_info_show, NULL);
 }
 
-static const struct file_operations hotfix_info_fops = {
-	.open		=	hotfix_info_open,
-	.read		=	seq_read,
-	.llseek		=	seq_lseek,
-	.release	=	single_release,
-};
+static const proc_fops_t hotfix_info_fops =
+	PROC_FOPS_INIT(hotfix_info_open, seq_read, NULL,
+			seq_lseek, single_release, NULL);
 
 static int __init hf_init(void)
 {
 	struct proc_dir_entry *pe;
+#ifndef USE_TRACEPOINT
 	int ret;
 
 	ret = init_hotfix();
 	if (ret)
 		return ret;
+#endif
 
 	pe = proc_create(PROC_ENTRY_NAME, 0444, NULL, &hotfix_info_fops);
 	if (!pe)
@@ -6,45 +6,224 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/time.h>
-#include <linux/async.h>
-#include <scsi/scsi_device.h>
-#include <scsi/scsi_cmnd.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/ctype.h>
+#include <linux/device.h>
 
 #include "hotfixes.h"
 #include "hash_table.h"
 #include "latency_stats.h"
+#include "snapshot.h"
+#include "latency_window.h"
+#include "cgroup_stats.h"
+#include "top_n.h"
+#include "lba_heatmap.h"
+#include "outlier_ring.h"
+#include "size_latency.h"
+#include "hook_stats.h"
+#include "compat.h"
 #include "config.h"
 
+#ifdef USE_TRACEPOINT
+#include <linux/tracepoint.h>
+#endif
+
 #define IO_LATENCY_VERSION	"1.1.3"
 
 #define HOTFIX_GET_REQUEST	0
-#define HOTFIX_SCSI_DISPATCH	1
+#define HOTFIX_START_REQUEST	1
 #define HOTFIX_FINISH_REQUEST	2
-#define HOTFIX_SD_PROBE_ASYNC	3
 
-#define MAX_REQUEST_QUEUE	97
-#define MAX_REQUESTS		9973
+/* request_queue_table starts with this many buckets, grows with disks */
+#define NR_REQUEST_QUEUE	128
+#define MAX_REQUESTS		8192
 
 #ifdef USE_HASH_TABLE
 #define this_cpu_ptr(ptr) per_cpu_ptr(ptr, smp_processor_id())
 #endif
 
+#if defined(USE_TRACEPOINT) && defined(USE_HASH_TABLE)
+#error "USE_TRACEPOINT keeps no per-request table, drop USE_HASH_TABLE"
+#endif
+
+/* request_queue has no 'pad' for us outside of our 2.6.32 kernels */
+#if defined(USE_HASH_TABLE) || defined(USE_TRACEPOINT)
+#define AUX_IN_TABLE
+#endif
+
 static struct proc_dir_entry *proc_io_latency;
-static struct class *sd_disk_class;
+/* block_class, every whole disk on it gets a directory */
+static struct class *disk_class;
+/* aux of every queue, written by the block class interface only */
 static struct hash_table *request_queue_table;
-
-struct proc_entry_name {
-	struct proc_dir_entry *entry;
+/* tgid of the submitter of every request in flight, for top_offenders */
+static struct hash_table *submitter_table;
+/* cost of the hooks themselves, /proc/io-latency/overhead */
+static struct hook_stats *hook_stats;
+
+/* disks whose name starts with one of these are not watched */
+static char *skip_disks = "ram,loop";
+module_param(skip_disks, charp, 0444);
+MODULE_PARM_DESC(skip_disks,
+		"comma separated prefixes of disk names to ignore");
+
+static unsigned int max_cgroups = 8;
+module_param(max_cgroups, uint, 0444);
+MODULE_PARM_DESC(max_cgroups,
+		"blkio cgroups counted separately per disk, 0 to disable");
+
+static unsigned int soft_latency = 1;
+module_param(soft_latency, uint, 0444);
+MODULE_PARM_DESC(soft_latency,
+		"keep soft latency histograms, 0 leaves them out of memory");
+
+static unsigned int top_n = 10;
+module_param(top_n, uint, 0444);
+MODULE_PARM_DESC(top_n,
+		"slowest processes listed per disk, 0 to disable");
+
+static unsigned int heatmap_zone_mb;
+module_param(heatmap_zone_mb, uint, 0444);
+MODULE_PARM_DESC(heatmap_zone_mb,
+		"LBA zone size (MiB) of heatmap.bin, 0 to disable");
+
+static unsigned int outlier_ring_size = 256;
+module_param(outlier_ring_size, uint, 0444);
+MODULE_PARM_DESC(outlier_ring_size,
+		"slow I/Os kept per CPU and disk, 0 to disable");
+
+#define OUTLIER_THRESHOLD_US	10000
+
+static unsigned int size_latency;
+module_param(size_latency, uint, 0444);
+MODULE_PARM_DESC(size_latency,
+		"count latency by I/O size in size_latency.bin, 0 to disable");
+
+static unsigned int sample_rate = 1;
+module_param(sample_rate, uint, 0444);
+MODULE_PARM_DESC(sample_rate,
+		"count one I/O in this many on every disk at first, 1 for all");
+
+static unsigned int aggregates = 1;
+module_param(aggregates, uint, 0444);
+MODULE_PARM_DESC(aggregates,
+		"keep the all/ and host<N>/ disk aggregates, 0 to disable");
+
+static unsigned int partitions = 1;
+module_param(partitions, uint, 0444);
+MODULE_PARM_DESC(partitions,
+		"keep stats of every partition in its disk's dir, 0 to disable");
+
+static unsigned int hook_timing = 1;
+module_param(hook_timing, uint, 0644);
+MODULE_PARM_DESC(hook_timing,
+		"time the hooks for /proc/io-latency/overhead, 0 to disable");
+
+#define LSTATS_DIR_NAME_LEN	32
+
+/* latency_stats counted besides the ones of a disk, with a proc dir */
+struct lstats_dir {
+	char name[LSTATS_DIR_NAME_LEN];
+	struct latency_stats __percpu *lstats;
+	/* <parent>/<name>, 'nr_proc' files of a node list in it */
 	struct proc_dir_entry *parent;
-	char name[64];
+	struct proc_dir_entry *proc_dir;
+	int nr_proc;
+	/* TIME_UNIT_* of its summary files, its own or the one of its disk */
+	int latency_unit;
+	int *unit;
 };
 
-static struct proc_entry_name *dir_proc_list;
-static int nr_dir_proc;
+/*
+ * latency_stats of several disks together: all/ of every disk, host<N>/
+ * of the disks behind Scsi_Host N.  The hooks count every I/O of a disk
+ * into its aggregates as well, so reading one folds a single set of
+ * per-cpu counters however many disks it has.
+ */
+#define AGG_ALL			-1
+
+struct agg_stats {
+	struct lstats_dir dir;
+	struct list_head list;
+	/* Scsi_Host number, AGG_ALL for all/ */
+	int host;
+	/* disks counted into it, protected by agg_mutex */
+	unsigned int nr_disks;
+};
+
+/* a partition, its sectors are [start, end) of the disk */
+struct part_stats {
+	struct lstats_dir dir;
+	int partno;
+	sector_t start;
+	sector_t end;
+};
+
+/*
+ * the partitions of a disk sorted by start sector, for the hooks to
+ * bisect.  A new table replaces it when a partition comes, one going is
+ * taken out in place.
+ */
+struct part_table {
+	struct rcu_head rcu;
+	int nr;
+	struct part_stats *parts[0];
+};
 
 /* every request_queue has an instance of this struct */
 struct request_queue_aux {
 	struct latency_stats __percpu *lstats;
+	struct gendisk *disk;
+	struct list_head list;
+	/* created on first open of stats.mmap, refreshed by fold_work */
+	struct shared_stats *shared;
+	/* created on first open of a window file, rotated by window_work */
+	struct lat_windows *windows;
+	/* serializes resets, protects the baselines of the cursors */
+	struct mutex base_lock;
+	/* named readers, protected by cursor_mutex */
+	struct list_head cursors;
+	struct proc_dir_entry *cursor_dir;
+	/* per blkio cgroup stats, NULL if disabled */
+	struct cg_stats *cgroups;
+	/* aggregate of the Scsi_Host of the disk, NULL if none */
+	struct agg_stats *host_agg;
+	/*
+	 * partitions, NULL if none.  RCU for the hooks, only changed by the
+	 * block class interface, which serializes its calls.
+	 */
+	struct part_table *parts;
+	/* slowest submitters, NULL if disabled */
+	struct top_n *top;
+	/* latency by LBA zone, NULL if disabled */
+	struct lba_heatmap *heatmap;
+	/* latency by I/O size, NULL if disabled */
+	struct size_lat *size_lat;
+	/*
+	 * I/Os slower than 'outlier_ns', created on first open of an
+	 * outliers file and then only read by the hooks
+	 */
+	struct outlier_ring *outliers;
+	u64 outlier_ns;
+	/* about one I/O in 'sample_rate' is counted, 1 for all */
+	unsigned int sample_rate;
+	/* TIME_UNIT_* the summary text files show latencies in */
+	int latency_unit;
+	/* requests issued to the driver and not completed yet */
+	atomic_t inflight;
+#ifdef USE_TRACEPOINT
+	/* requests issued before this were not counted in 'inflight' */
+	u64 start_ns;
+	/* counted in nr_bio_based */
+	int bio_based;
+#endif
+	/* /proc/io-latency/<disk>, 'nr_proc' files of proc_node_list in it */
+	struct proc_dir_entry *proc_dir;
+	int nr_proc;
 #ifdef USE_HASH_TABLE
 	struct hash_table *hash_table;
 #endif
@@ -53,335 +232,1321 @@ struct request_queue_aux {
 };
 static struct kmem_cache *request_table_aux_cache;
 
+/* all request_queue_aux, protected by aux_mutex */
+static LIST_HEAD(aux_list);
+static DEFINE_MUTEX(aux_mutex);
+
+#define FOLD_INTERVAL_MIN_MS	10
+static unsigned int fold_interval_ms = 100;
+module_param(fold_interval_ms, uint, 0644);
+MODULE_PARM_DESC(fold_interval_ms,
+		"how often (ms) the stats.mmap regions are refreshed");
+
+static void fold_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fold_work, fold_work_fn);
+
+/* NULL if disabled, the host<N>/ ones are on agg_list */
+static struct agg_stats *all_agg;
+static LIST_HEAD(agg_list);
+static DEFINE_MUTEX(agg_mutex);
+
+#define MAX_CURSORS		16
+#define CURSOR_NAME_LEN		32
+
+/*
+ * a named reader of a device, reading cursor/<name> returns the stats
+ * counted since its previous read without touching anybody else's view
+ */
+struct io_cursor {
+	struct list_head list;
+	char name[CURSOR_NAME_LEN];
+	struct request_queue_aux *aux;
+	struct latency_stats_sum *base;
+};
+static DEFINE_MUTEX(cursor_mutex);
+
+static void window_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(window_work, window_work_fn);
+
+#ifndef USE_TRACEPOINT
 static struct request* (*p_get_request_wait)(struct request_queue *q,
 		int rw_flags, struct bio *bio);
-static struct request* (*p_scsi_dispatch_cmd)(struct request_queue *q);
+static void (*p_blk_start_request)(struct request *req);
 static void (*p_blk_finish_request)(struct request *req, int error);
+#else
+/* not exported, NULL if kallsyms does not have it either */
+static void (*p_blk_stat_enable_accounting)(struct request_queue *q);
+#endif
 
-struct scsi_disk {
-	struct scsi_driver *driver;	/* always &sd_template */
-	struct scsi_device *device;
-	struct device	dev;
-	struct gendisk	*disk;
-	atomic_t	openers;
-	sector_t	capacity;	/* size in 512-byte sectors */
-	u32		max_ws_blocks;
-	u32		max_unmap_blocks;
-	u32		unmap_granularity;
-	u32		unmap_alignment;
-	u32		index;
-	unsigned int	physical_block_size;
-	unsigned int	max_medium_access_timeouts;
-	unsigned int	medium_access_timed_out;
-	u8		media_present;
-	u8		write_prot;
-	u8		protection_type;/* Data Integrity Field */
-	u8		provisioning_mode;
-	unsigned	ATO : 1;	/* state of disk ATO bit */
-	unsigned	cache_override : 1; /* temp override of WCE,RCD */
-	unsigned	WCE : 1;	/* state of disk WCE bit */
-	unsigned	RCD : 1;	/* state of disk RCD bit, unused */
-	unsigned	DPOFUA : 1;	/* state of disk DPOFUA bit */
-	unsigned	first_scan : 1;
-	unsigned	lbpme : 1;
-	unsigned	lbprz : 1;
-	unsigned	lbpu : 1;
-	unsigned	lbpws : 1;
-	unsigned	lbpws10 : 1;
-	unsigned	lbpvpd : 1;
-	unsigned	ws10 : 1;
-	unsigned	ws16 : 1;
-};
+static inline struct request_queue_aux *get_aux(void *request_queue)
+{
+	struct request_queue_aux *aux = NULL;
 
-static struct request_queue_aux *insert_aux(struct scsi_disk *sd);
-static int insert_procfs(struct scsi_disk *sd);
+#ifdef AUX_IN_TABLE
+	unsigned long value;
 
-static struct ali_sym_addr io_latency_sym_addr_list[] = {
-	ALI_DEFINE_SYM_ADDR(get_request_wait),
-	ALI_DEFINE_SYM_ADDR(scsi_dispatch_cmd),
-	ALI_DEFINE_SYM_ADDR(blk_finish_request),
-	{},
-};
-static struct request *overwrite_get_request_wait(struct request_queue *q,
-		int rw_flags, struct bio *bio);
-static int overwrite_scsi_dispatch_cmd(struct scsi_cmnd *cmd);
-static void overwrite_blk_finish_request(struct request *req, int error);
-static void overwrite_sd_probe_async(void *data, async_cookie_t cookie);
+	if (!request_queue)
+		return NULL;
+	if (hash_table_find(request_queue_table, (unsigned long)request_queue,
+				&value))
+		return NULL;
+	aux = (struct request_queue_aux *)value;
+#else
+	aux = (struct request_queue_aux *)
+		((struct request_queue *)request_queue)->pad;
+#endif
+	return aux;
+}
 
-static struct ali_hotfix_desc io_latency_hotfix_list[] = {
+/* xorshift state of every CPU, seeded by the first draw */
+static DEFINE_PER_CPU(u32, sample_seed);
 
-	[HOTFIX_GET_REQUEST] = ALI_DEFINE_HOTFIX( \
-			"block: get_request_wait", \
-			"get_request_wait", \
-			overwrite_get_request_wait),
+/*
+ * whether to count an I/O, one in 'sample_rate' on average.  A draw does
+ * not depend on the sector or the request, hot sectors and recycled
+ * requests would be over or under sampled.  Races with preemption only
+ * reuse a value.
+ */
+static inline int sample_io(struct request_queue_aux *aux)
+{
+	unsigned int rate = ACCESS_ONCE(aux->sample_rate);
+	u32 *seed, x;
+
+	if (likely(rate <= 1))
+		return 1;
+	seed = &per_cpu(sample_seed, raw_smp_processor_id());
+	x = *seed ? *seed : 2463534242U + raw_smp_processor_id();
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x % rate == 0;
+}
 
-	[HOTFIX_SCSI_DISPATCH] = ALI_DEFINE_HOTFIX( \
-			"block: scsi_dispatch_cmd", \
-			"scsi_dispatch_cmd", \
-			overwrite_scsi_dispatch_cmd),
+/* clock at the start of a hook, 0 if the hooks are not timed */
+static inline u64 hook_start(void)
+{
+	return ACCESS_ONCE(hook_timing) ? compat_local_clock() : 0;
+}
 
-	[HOTFIX_FINISH_REQUEST] = ALI_DEFINE_HOTFIX( \
-			"block: blk_finish_request", \
-			"blk_finish_request", \
-			overwrite_blk_finish_request),
+/* 'hook' is done, it started at 'start' */
+static inline void hook_end(int hook, u64 start)
+{
+	u64 now;
 
-	[HOTFIX_SD_PROBE_ASYNC] = ALI_DEFINE_HOTFIX( \
-			"scsi: sd_probe_async", \
-			"sd_probe_async", \
-			overwrite_sd_probe_async),
-	{},
-};
+	if (!start) {
+		hook_stats_inc(hook_stats, hook, HOOK_CALLS);
+		return;
+	}
+	now = compat_local_clock();
+	hook_stats_add(hook_stats, hook, now > start ? now - start : 0);
+}
 
-static void (*orig_sd_probe_async)(void *data, async_cookie_t cookie);
-static void overwrite_sd_probe_async(void *data, async_cookie_t cookie)
+/* a lookup of 'hook' found nothing */
+static inline void hook_miss(int hook)
 {
-	struct scsi_disk *sdkp = data;
-	struct hash_node *queue_nd;
+	hook_stats_inc(hook_stats, hook, HOOK_MISSES);
+}
 
-	queue_nd = hash_table_find(request_queue_table,
-			(unsigned long)sdkp->device->request_queue);
-	if (!queue_nd) {
-		insert_procfs(sdkp);
-		insert_aux(sdkp);
-	}
-	orig_sd_probe_async = ali_hotfix_orig_func(
-			&io_latency_hotfix_list[HOTFIX_GET_REQUEST]);
-	orig_sd_probe_async(data, cookie);
+/* 'hook' could not keep track of an I/O */
+static inline void hook_drop(int hook)
+{
+	hook_stats_inc(hook_stats, hook, HOOK_DROPS);
 }
 
-static struct request *(*orig_get_request_wait)(struct request_queue *q,
-		int rw_flags, struct bio *bio);
-static struct request *overwrite_get_request_wait(struct request_queue *q,
-		int rw_flags, struct bio *bio)
+/* 'inflight' of a sampled backend only counts the sampled I/Os */
+static inline unsigned int sampled_depth(struct request_queue_aux *aux,
+					unsigned int depth)
 {
-	struct request *req;
-	struct request_queue_aux *aux;
-	unsigned long now;
-#ifdef USE_HASH_TABLE
-	struct hash_node *queue_nd, *req_nd;
-#endif
+	return depth * max(ACCESS_ONCE(aux->sample_rate), 1U);
+}
 
-	orig_get_request_wait = ali_hotfix_orig_func(
-			&io_latency_hotfix_list[HOTFIX_GET_REQUEST]);
-	req = orig_get_request_wait(q, rw_flags, bio);
-	if (!req || !req->q)
-		goto out;
+/*
+ * Accounting shared by both backends, the hooks only differ in how they
+ * know when a request was queued and issued, and to which cgroup slot
+ * 'cg' (-1 for none) it belongs.
+ */
+
+/*
+ * partition of 'aux' holding 'sector', NULL if none.  It stays until
+ * wait_for_hooks() returns.
+ */
+static struct part_stats *find_part(struct request_queue_aux *aux,
+				sector_t sector)
+{
+	struct part_table *table;
+	struct part_stats *part;
+	int lo = 0, hi, mid;
+
+	rcu_read_lock();
+	table = rcu_dereference(aux->parts);
+	for (hi = table ? ACCESS_ONCE(table->nr) : 0; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		part = ACCESS_ONCE(table->parts[mid]);
+		if (sector < part->start)
+			hi = mid;
+		else if (sector >= part->end)
+			lo = mid + 1;
+		else
+			goto out;
+	}
+	part = NULL;
+out:
+	rcu_read_unlock();
+	return part;
+}
 
-#ifdef USE_HASH_TABLE
-	queue_nd = hash_table_find(request_queue_table, (unsigned long)req->q);
-	if (!queue_nd)
-		goto out;
-	aux = (struct request_queue_aux *)(queue_nd->value);
-	if (!aux->hash_table)
-		goto out;
-#else
-	aux = (struct request_queue_aux *)q->pad;
-#endif
-	if (!aux || !aux->lstats)
-		goto out;
+/*
+ * counters of this CPU to update for an I/O at 'sector': the device, the
+ * cgroup slot, the partition and the aggregates
+ */
+#define NR_LSTATS	5
 
-	if (!aux->enable_latency && !aux->enable_soft_latency)
-		goto out;
+static int get_lstats(struct request_queue_aux *aux, int cg,
+			sector_t sector, struct latency_stats **lstats)
+{
+	struct latency_stats __percpu *cg_lstats;
+	struct part_stats *part;
+	int i, nr = 0;
+
+	lstats[nr++] = this_cpu_ptr(aux->lstats);
+	cg_lstats = cg_stats_get(aux->cgroups, cg);
+	if (cg_lstats)
+		lstats[nr++] = this_cpu_ptr(cg_lstats);
+	part = find_part(aux, sector);
+	if (part)
+		lstats[nr++] = this_cpu_ptr(part->dir.lstats);
+	if (aux->host_agg)
+		lstats[nr++] = this_cpu_ptr(aux->host_agg->dir.lstats);
+	if (all_agg)
+		lstats[nr++] = this_cpu_ptr(all_agg->dir.lstats);
+	for (i = 0; i < nr; i++)
+		sync_latency_stats(lstats[i]);
+	return nr;
+}
 
-	/* put time into 'pad' now */
-#ifdef USE_US
-	now = ktime_to_us(ktime_get());
+/* LAT_OP_* bits of a request or bio with these cmd_flags / bi_opf */
+static unsigned int op_classes(unsigned long flags)
+{
+	unsigned int ops = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	switch (flags & REQ_OP_MASK) {
+	case REQ_OP_FLUSH:
+		return 1 << LAT_OP_FLUSH;
+	case REQ_OP_DISCARD:
+	case REQ_OP_SECURE_ERASE:
+		return 1 << LAT_OP_DISCARD;
+	}
+	if (flags & REQ_FUA)
+		return 1 << LAT_OP_FUA;
+	if (flags & REQ_SYNC)
+		ops |= 1 << LAT_OP_SYNC;
+	if (flags & REQ_META)
+		ops |= 1 << LAT_OP_META;
 #else
-	now = jiffies;
+	/* a barrier is a flush, possibly with data in between */
+	if (flags & REQ_HARDBARRIER)
+		return 1 << LAT_OP_FLUSH;
+	if (flags & REQ_DISCARD)
+		return 1 << LAT_OP_DISCARD;
+	if (flags & REQ_FUA)
+		return 1 << LAT_OP_FUA;
+	if (flags & REQ_RW_SYNC)
+		ops |= 1 << LAT_OP_SYNC;
+	if (flags & REQ_RW_META)
+		ops |= 1 << LAT_OP_META;
 #endif
+	return ops;
+}
 
-#ifdef USE_HASH_TABLE
-	req_nd = hash_table_find(aux->hash_table, (unsigned long)req);
-	if (req_nd)
-		req_nd->value = now;
-	else
-		hash_table_insert(aux->hash_table, (unsigned long)req, now);
-#else
-	req->pad = (void *)now;
-#endif
-out:
-	return req;
+/* hardware latency of an I/O of kind 'ops' in direction 'rw' */
+static void add_hw_latency(struct latency_stats *lstats, u64 ns,
+			unsigned int ops, int rw)
+{
+	if (!(ops & LAT_OP_EXCLUSIVE))
+		add_latency_stats(lstats, ns, 0, rw);
+	add_op_latency_stats(lstats, ns, ops);
 }
 
-static int (*orig_scsi_dispatch_cmd)(struct scsi_cmnd *cmd);
-static int overwrite_scsi_dispatch_cmd(struct scsi_cmnd *cmd)
+/* 'req' was handed to the driver 'queued_ns' after it was queued */
+static void account_rq_issue(struct request_queue_aux *aux,
+			struct request *req, u64 queued_ns, int cg)
 {
-	struct request *req;
-	struct request_queue_aux *aux;
-	unsigned long stime, now;
-	int bytes;
-#ifdef USE_HASH_TABLE
-	struct hash_node *req_nd, *queue_nd;
-#endif
+	struct latency_stats *lstats[NR_LSTATS];
+	int i, nr, rw = rq_data_dir(req);
+
+	nr = get_lstats(aux, cg, blk_rq_pos(req), lstats);
+	for (i = 0; i < nr; i++) {
+		if (aux->enable_soft_latency && queued_ns)
+			add_latency_stats(lstats[i], queued_ns, 1, rw);
+		if (aux->enable_latency)
+			update_io_size_stats(lstats[i], blk_rq_bytes(req), rw);
+	}
+}
 
-	orig_scsi_dispatch_cmd = ali_hotfix_orig_func(
-			&io_latency_hotfix_list[HOTFIX_SCSI_DISPATCH]);
-	req = cmd->request;
-	if (!req || !req->q)
-		goto out;
+/*
+ * the device completed 'req' 'ns' after it was issued at queue depth
+ * bucket 'qd' with a size of bucket 'size', -1 if unknown
+ */
+static void account_rq_complete(struct request_queue_aux *aux,
+			struct request *req, u64 ns, int cg, int qd, int size)
+{
+	struct latency_stats *lstats[NR_LSTATS];
+	unsigned int ops;
+	int i, nr;
+
+	if (!aux->enable_latency || !ns)
+		return;
+	ops = op_classes(req->cmd_flags);
+	nr = get_lstats(aux, cg, blk_rq_pos(req), lstats);
+	for (i = 0; i < nr; i++) {
+		add_hw_latency(lstats[i], ns, ops, rq_data_dir(req));
+		if (qd >= 0)
+			add_qd_latency_stats(lstats[i], qd, ns);
+	}
+	/* the request only moves on when it is completed in parts */
+	lba_heatmap_add(aux->heatmap, blk_rq_pos(req), ns);
+	if (size >= 0)
+		size_lat_add(aux->size_lat, rq_data_dir(req), size, ns);
+}
 
-#ifdef USE_HASH_TABLE
-	queue_nd = hash_table_find(request_queue_table, (unsigned long)req->q);
-	if (!queue_nd)
-		goto out;
+/* remember who submitted the request 'key' stands for */
+static void note_submitter(struct request_queue_aux *aux, void *key)
+{
+	if (aux->top || ACCESS_ONCE(aux->outliers))
+		hash_table_set(submitter_table, (unsigned long)key,
+				current->tgid);
+}
 
-	aux = (struct request_queue_aux *)(queue_nd->value);
-	if (!aux->hash_table)
-		goto out;
-#else
-	if (!req->pad)
-		goto out;
+/*
+ * tgid noted under 'key' when the I/O was submitted, 0 if unknown.  It
+ * is taken off even if top and outliers were turned off since it was
+ * noted; a key without a note is told without taking the lock.
+ */
+static pid_t take_submitter(struct request_queue_aux *aux, void *key)
+{
+	unsigned long pid;
+
+	if (hash_table_find(submitter_table, (unsigned long)key, &pid))
+		return 0;
+	if (hash_table_find_and_remove(submitter_table, (unsigned long)key,
+				&pid))
+		return 0;
+	return pid;
+}
+
+/* ring to log an I/O that took 'ns' into, NULL if it was fast enough */
+static inline struct outlier_ring *get_outliers(
+		struct request_queue_aux *aux, u64 ns)
+{
+	struct outlier_ring *ring;
+
+	if (ns < aux->outlier_ns)
+		return NULL;
+	ring = ACCESS_ONCE(aux->outliers);
+	smp_read_barrier_depends();
+	return ring;
+}
+
+/* complete the record of an outlier that finished at 'now' after 'ns' */
+static void log_outlier(struct outlier_ring *ring,
+			struct io_latency_outlier *rec, u64 now, u64 ns)
+{
+	rec->dispatch_ns = now - ns;
+	rec->complete_ns = now;
+	rec->latency_ns = ns;
+	rec->cpu = smp_processor_id();
+	outlier_ring_add(ring, rec);
+}
+
+/* 'bytes' of 'req' were completed at 'now', 'ns' after it was issued */
+static void log_rq_outlier(struct request_queue_aux *aux,
+			struct request *req, unsigned int bytes, pid_t pid,
+			u64 queue_ns, u64 now, u64 ns)
+{
+	struct io_latency_outlier rec;
+	struct outlier_ring *ring;
+
+	ring = get_outliers(aux, ns);
+	if (!ring)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.sector = blk_rq_pos(req);
+	rec.queue_ns = queue_ns;
+	rec.bytes = bytes;
+	rec.cmd_flags = req->cmd_flags;
+	rec.pid = pid;
+	rec.rw = rq_data_dir(req);
+	log_outlier(ring, &rec, now, ns);
+}
 
-	aux = (struct request_queue_aux *)req->q->pad;
+#ifdef USE_TRACEPOINT
+/*
+ * blk-mq stamps every request with the time it was allocated
+ * (start_time_ns) and, while QUEUE_FLAG_STATS is set on the queue, the
+ * time it was issued (io_start_time_ns).  Reading those two in the
+ * block_rq_issue and block_rq_complete tracepoints needs no table of
+ * in-flight requests, the only lookup per event is queue -> aux.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+#error "USE_TRACEPOINT needs rq->start_time_ns, Linux 4.19 or later"
 #endif
-	if (!aux || !aux->lstats)
-		goto out;
 
-	bytes = blk_rq_bytes(req);
-	if (bytes <= 0) {
-#ifdef USE_HASH_TABLE
-		hash_table_remove(aux->hash_table, (unsigned long)req);
+/* the probes, in io_latency_tracepoints[] and hook_stats */
+enum {
+	HOOK_RQ_ISSUE,
+	HOOK_RQ_COMPLETE,
+	HOOK_RQ_REQUEUE,
+	HOOK_BIO_QUEUE,
+	HOOK_BIO_COMPLETE,
+	HOOK_GETRQ,
+	NR_HOOKS,
+};
+
+/* the blkio cgroup of a request is the one of its bios */
+static int bio_cg(struct request_queue_aux *aux, struct bio *bio)
+{
+#ifdef CONFIG_BLK_CGROUP
+	if (bio)
+		return cg_stats_lookup(aux->cgroups,
+				compat_bio_blkcg_css(bio));
 #endif
-		goto out;
+	return -1;
+}
+
+/*
+ * 'inflight' counts the requests blk-mq stamps with io_start_time_ns,
+ * which it does right after block_rq_issue while QUEUE_FLAG_STATS is
+ * set.  Completion and requeue undo the issue their stamp tells of, so
+ * both sides have to agree on which requests count; passthrough requests
+ * are not stamped by every version and never do.
+ */
+static int rq_issue_counted(struct request *rq)
+{
+	return blk_rq_bytes(rq) && !blk_rq_is_passthrough(rq) &&
+		test_bit(QUEUE_FLAG_STATS, &rq->q->queue_flags);
+}
+
+static int rq_counted(struct request_queue_aux *aux, struct request *rq)
+{
+	return blk_rq_bytes(rq) && !blk_rq_is_passthrough(rq) &&
+		rq->io_start_time_ns >= aux->start_ns;
+}
+
+/*
+ * the submitter of 'rq' is noted under the bio it was allocated for,
+ * which a front merge puts behind others and another request merged in
+ * brings along.  Take it off whichever of the bios ending with the first
+ * 'bytes' completed carries it, none may be left behind.
+ */
+static pid_t take_rq_submitter(struct request_queue_aux *aux,
+			struct request *rq, unsigned int bytes)
+{
+	struct bio *bio;
+	pid_t pid;
+
+	for (bio = rq->bio; bio && bio->bi_iter.bi_size <= bytes;
+			bio = bio->bi_next) {
+		bytes -= bio->bi_iter.bi_size;
+		pid = take_submitter(aux, bio);
+		if (pid)
+			return pid;
 	}
+	return 0;
+}
 
-#ifdef USE_US
-	now = ktime_to_us(ktime_get());
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void probe_rq_issue(void *ignore, struct request *rq)
 #else
-	now = jiffies;
+static void probe_rq_issue(void *ignore, struct request_queue *q,
+			struct request *rq)
 #endif
+{
+	struct request_queue_aux *aux;
+	u64 now, start = hook_start();
 
-#ifdef USE_HASH_TABLE
-	/* find request in request hash table */
-	req_nd = hash_table_find(aux->hash_table, (unsigned long)req);
-	if (!req_nd)
+	aux = get_aux(rq->q);
+	if (!aux) {
+		hook_miss(HOOK_RQ_ISSUE);
 		goto out;
-
-	stime = req_nd->value;
-	req_nd->value = now;
-	if (aux->enable_soft_latency)
-		update_latency_stats(this_cpu_ptr(aux->lstats),
-				stime, now, 1, rq_data_dir(req));
-	if (aux->enable_latency)
-		update_io_size_stats(this_cpu_ptr(aux->lstats),
-				blk_rq_bytes(req), rq_data_dir(req));
-
-#else
-	if (aux->enable_soft_latency) {
-		stime = (unsigned long)req->pad;
-		update_latency_stats(this_cpu_ptr(aux->lstats),
-				stime, now, 1, rq_data_dir(req));
-	}
-	if (aux->enable_latency) {
-		req->pad = (void *)now;
-		update_io_size_stats(this_cpu_ptr(aux->lstats),
-					bytes, rq_data_dir(req));
 	}
-#endif
+	if (!aux->lstats || !blk_rq_bytes(rq))
+		goto out;
+
+	if (rq_issue_counted(rq))
+		atomic_inc(&aux->inflight);
+	if (!sample_io(aux))
+		goto out;
+	/* 0 if the request was never stamped, its soft latency is unknown */
+	now = ktime_get_ns();
+	account_rq_issue(aux, rq, rq->start_time_ns &&
+			now > rq->start_time_ns ? now - rq->start_time_ns : 0,
+			bio_cg(aux, rq->bio));
 out:
-	return orig_scsi_dispatch_cmd(cmd);
+	hook_end(HOOK_RQ_ISSUE, start);
 }
 
-static void (*orig_blk_finish_request)(struct request *req, int error);
-static void overwrite_blk_finish_request(struct request *req, int error)
+/* 'error' is an int or a blk_status_t depending on the version, unused */
+static void probe_rq_complete(void *ignore, struct request *rq, int error,
+			unsigned int nr_bytes)
 {
 	struct request_queue_aux *aux;
-	unsigned long stime, now;
-#ifdef USE_HASH_TABLE
-	struct hash_node *queue_nd, *req_nd;
-#endif
+	u64 now, ns, start = hook_start();
+	pid_t pid;
+	int depth;
 
-	orig_blk_finish_request = ali_hotfix_orig_func(
-			&io_latency_hotfix_list[HOTFIX_FINISH_REQUEST]);
-	if (!req || !req->q)
+	aux = get_aux(rq->q);
+	if (!aux) {
+		hook_miss(HOOK_RQ_COMPLETE);
 		goto out;
-
-#ifdef USE_HASH_TABLE
-	queue_nd = hash_table_find(request_queue_table,
-				(unsigned long)(req->q));
-	if (!queue_nd)
+	}
+	/* partial completions fire too, only count the last one */
+	if (nr_bytes < blk_rq_bytes(rq)) {
+		take_rq_submitter(aux, rq, nr_bytes);
 		goto out;
-
-	aux = (struct request_queue_aux *)(queue_nd->value);
-	if (!aux->hash_table)
+	}
+	if (!aux->lstats)
 		goto out;
-#else
-	if (!req->pad)
+
+	/*
+	 * the depth at issue is not kept anywhere, take the one this request
+	 * was served at.  Requests issued before the disk was watched were
+	 * never counted, they would leave it too low.
+	 */
+	depth = atomic_read(&aux->inflight);
+	if (rq_counted(aux, rq))
+		atomic_add_unless(&aux->inflight, -1, 0);
+	if (!rq->io_start_time_ns || !sample_io(aux)) {
+		take_rq_submitter(aux, rq, nr_bytes);
 		goto out;
+	}
+
+	now = ktime_get_ns();
+	ns = now > rq->io_start_time_ns ? now - rq->io_start_time_ns : 0;
+	account_rq_complete(aux, rq, ns, bio_cg(aux, rq->bio),
+			qd_hist_index(depth), size_log2_index(nr_bytes));
+	pid = take_rq_submitter(aux, rq, nr_bytes);
+	top_n_add(aux->top, pid, ns);
+	log_rq_outlier(aux, rq, nr_bytes, pid, rq->start_time_ns, now, ns);
+out:
+	hook_end(HOOK_RQ_COMPLETE, start);
+}
 
-	aux = (struct request_queue_aux *)req->q->pad;
+/* a request taken back from the driver is issued once more later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void probe_rq_requeue(void *ignore, struct request *rq)
+#else
+static void probe_rq_requeue(void *ignore, struct request_queue *q,
+			struct request *rq)
 #endif
-	if (!aux || !aux->lstats)
-		goto out;
+{
+	struct request_queue_aux *aux;
+	u64 start = hook_start();
 
-	if (!aux->enable_latency)
+	/* one that never reached the driver was not issued */
+	if (!blk_mq_request_started(rq))
 		goto out;
+	aux = get_aux(rq->q);
+	if (!aux) {
+		hook_miss(HOOK_RQ_REQUEUE);
+		goto out;
+	}
+	if (aux->lstats && rq_counted(aux, rq))
+		atomic_add_unless(&aux->inflight, -1, 0);
+out:
+	hook_end(HOOK_RQ_REQUEUE, start);
+}
 
-#ifdef USE_US
-	now = ktime_to_us(ktime_get());
+/* runs in the submitter's context when a request is allocated for 'bio' */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void probe_getrq(void *ignore, struct bio *bio)
+{
+	struct request_queue *q = bio->bi_bdev->bd_disk->queue;
 #else
-	now = jiffies;
+static void probe_getrq(void *ignore, struct request_queue *q,
+			struct bio *bio, int rw)
+{
 #endif
+	struct request_queue_aux *aux;
+	u64 start = hook_start();
 
-#ifdef USE_HASH_TABLE
-	/* find request in request hash table and update it's value */
-	req_nd = hash_table_find(aux->hash_table, (unsigned long)req);
-	if (!req_nd)
+	if (!bio)
 		goto out;
+	aux = get_aux(q);
+	if (aux)
+		note_submitter(aux, bio);
+	else
+		hook_miss(HOOK_GETRQ);
+out:
+	hook_end(HOOK_GETRQ, start);
+}
 
-	stime = req_nd->value;
-	update_latency_stats(this_cpu_ptr(aux->lstats),
-				stime, now, 0, rq_data_dir(req));
+/*
+ * bio based drivers (md, dm linear/stripe ...) never allocate requests,
+ * their latency is the time from block_bio_queue to block_bio_complete.
+ * bios carry no timestamp, so every bio queued to such a disk gets a
+ * record in bio_table until it completes.  It is keyed by the bio alone:
+ * md and dm may remap a bio in place, it then completes on the queue of
+ * the lower device.
+ */
+struct bio_record {
+	struct request_queue *q;
+	u64 start_ns;
+	sector_t sector;
+	unsigned int bytes;
+	unsigned int depth;
+	pid_t pid;
+};
+static struct kmem_cache *bio_record_cache;
+static struct hash_table *bio_table;
+/* watched disks that were bio based when found, bio_table needs one */
+static atomic_t nr_bio_based = ATOMIC_INIT(0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+static void probe_bio_queue(void *ignore, struct bio *bio)
+{
+	struct request_queue *q = bio->bi_bdev->bd_disk->queue;
 #else
-	stime = (unsigned long)req->pad;
-	req->pad = NULL;
-	update_latency_stats(this_cpu_ptr(aux->lstats),
-				stime, now, 0, rq_data_dir(req));
+static void probe_bio_queue(void *ignore, struct request_queue *q,
+			struct bio *bio)
+{
 #endif
+	struct request_queue_aux *aux;
+	struct bio_record *rec;
+	unsigned long old;
+	u64 start = hook_start();
+
+	/* requests of blk-mq disks are seen by the block_rq_* probes */
+	if (!compat_queue_is_bio_based(q) || !bio->bi_iter.bi_size)
+		goto out;
+	aux = get_aux(q);
+	if (!aux) {
+		hook_miss(HOOK_BIO_QUEUE);
+		goto out;
+	}
+	if (!aux->lstats || !aux->enable_latency || !sample_io(aux))
+		goto out;
+
+	rec = kmem_cache_alloc(bio_record_cache, GFP_ATOMIC);
+	if (!rec) {
+		hook_drop(HOOK_BIO_QUEUE);
+		goto out;
+	}
+	rec->q = q;
+	rec->sector = bio->bi_iter.bi_sector;
+	rec->bytes = bio->bi_iter.bi_size;
+	rec->pid = current->tgid;
+	rec->depth = sampled_depth(aux, atomic_inc_return(&aux->inflight));
+	rec->start_ns = ktime_get_ns();
+	if (!hash_table_insert(bio_table, (unsigned long)bio,
+				(unsigned long)rec))
+		goto out;
+	/*
+	 * a record left by a bio whose completion we missed, it will never
+	 * leave 'inflight' either
+	 */
+	atomic_dec(&aux->inflight);
+	hook_drop(HOOK_BIO_QUEUE);
+	if (!hash_table_exchange(bio_table, (unsigned long)bio,
+				(unsigned long)rec, &old))
+		kmem_cache_free(bio_record_cache, (void *)old);
+	else
+		kmem_cache_free(bio_record_cache, rec);
 out:
-	orig_blk_finish_request(req, error);
+	hook_end(HOOK_BIO_QUEUE, start);
 }
 
-inline struct request_queue_aux *get_aux(void *request_queue)
+/* older kernels pass the error too, it is not needed */
+static void probe_bio_complete(void *ignore, struct request_queue *q,
+			struct bio *bio)
 {
-	struct request_queue_aux *aux = NULL;
+	struct request_queue_aux *aux;
+	struct latency_stats *lstats[NR_LSTATS];
+	struct bio_record *rec;
+	struct outlier_ring *ring;
+	struct io_latency_outlier orec;
+	unsigned long value;
+	unsigned int ops;
+	u64 now, ns, start = hook_start();
+	int i, nr;
+
+	/*
+	 * every bio completes here, also the ones of blk-mq disks: most have
+	 * no record, find that out without the bucket lock
+	 */
+	if (!atomic_read(&nr_bio_based))
+		goto out;
+	if (hash_table_find(bio_table, (unsigned long)bio, NULL) ||
+			hash_table_find_and_remove(bio_table,
+				(unsigned long)bio, &value))
+		goto out;
+	rec = (struct bio_record *)value;
 
-#ifdef USE_HASH_TABLE
-	struct hash_node *nd;
+	/* the disk may be gone or the queue reused since it was queued */
+	aux = get_aux(rec->q);
+	if (aux)
+		atomic_add_unless(&aux->inflight, -1, 0);
+	else
+		hook_drop(HOOK_BIO_COMPLETE);
+	if (aux && aux->lstats && aux->enable_latency) {
+		nr = get_lstats(aux, bio_cg(aux, bio), rec->sector, lstats);
+		ops = op_classes(bio->bi_opf);
+		now = ktime_get_ns();
+		ns = now > rec->start_ns ? now - rec->start_ns : 0;
+		for (i = 0; i < nr; i++) {
+			if (ns) {
+				add_hw_latency(lstats[i], ns, ops,
+						bio_data_dir(bio));
+				add_qd_latency_stats(lstats[i],
+						qd_hist_index(rec->depth), ns);
+			}
+			update_io_size_stats(lstats[i], rec->bytes,
+					bio_data_dir(bio));
+		}
+		if (ns) {
+			lba_heatmap_add(aux->heatmap, rec->sector, ns);
+			size_lat_add(aux->size_lat, bio_data_dir(bio),
+					size_log2_index(rec->bytes), ns);
+		}
+		top_n_add(aux->top, rec->pid, ns);
+
+		ring = get_outliers(aux, ns);
+		if (ring) {
+			/* bio based disks have no queue, issued at once */
+			memset(&orec, 0, sizeof(orec));
+			orec.sector = rec->sector;
+			orec.queue_ns = rec->start_ns;
+			orec.bytes = rec->bytes;
+			orec.cmd_flags = bio->bi_opf;
+			orec.pid = rec->pid;
+			orec.rw = bio_data_dir(bio);
+			log_outlier(ring, &orec, now, ns);
+		}
+	}
+	kmem_cache_free(bio_record_cache, rec);
+out:
+	hook_end(HOOK_BIO_COMPLETE, start);
+}
 
-	if (!request_queue)
-		return NULL;
-	nd = hash_table_find(request_queue_table, (unsigned long)request_queue);
-	if (!nd)
-		return NULL;
-	aux = (struct request_queue_aux *)nd->value;
-#else
-	aux = (struct request_queue_aux *)
-		((struct request_queue *)request_queue)->pad;
-#endif
-	return aux;
+static int free_bio_record(struct hash_node *nd)
+{
+	kmem_cache_free(bio_record_cache, (void *)nd->value);
+	return 0;
 }
 
-#define PROC_SHOW(_name, _unit, _nr, _grain, _member)			\
+static void destroy_bio_table(void)
+{
+	if (bio_table) {
+		call_for_each_hash_node(bio_table, free_bio_record);
+		destroy_hash_table(bio_table);
+		bio_table = NULL;
+	}
+	if (bio_record_cache) {
+		kmem_cache_destroy(bio_record_cache);
+		bio_record_cache = NULL;
+	}
+}
+
+static int create_bio_table(void)
+{
+	bio_record_cache = kmem_cache_create("io-latency-bio",
+					sizeof(struct bio_record), 0, 0, NULL);
+	bio_table = create_hash_table("bio-table", MAX_REQUESTS);
+	if (!bio_record_cache || !bio_table) {
+		destroy_bio_table();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static struct io_latency_tracepoint {
+	const char *name;
+	void *probe;
+	struct tracepoint *tp;
+} io_latency_tracepoints[] = {
+	[HOOK_RQ_ISSUE] = { "block_rq_issue", probe_rq_issue },
+	[HOOK_RQ_COMPLETE] = { "block_rq_complete", probe_rq_complete },
+	[HOOK_RQ_REQUEUE] = { "block_rq_requeue", probe_rq_requeue },
+	[HOOK_BIO_QUEUE] = { "block_bio_queue", probe_bio_queue },
+	[HOOK_BIO_COMPLETE] = { "block_bio_complete", probe_bio_complete },
+	[HOOK_GETRQ] = { "block_getrq", probe_getrq },
+	{},
+};
+
+static const char *hook_name(int hook)
+{
+	return io_latency_tracepoints[hook].name;
+}
+
+static void find_tracepoint(struct tracepoint *tp, void *priv)
+{
+	struct io_latency_tracepoint *t;
+
+	for (t = io_latency_tracepoints; t->name; t++) {
+		if (!strcmp(tp->name, t->name))
+			t->tp = tp;
+	}
+}
+
+static void unregister_tracepoints(void)
+{
+	struct io_latency_tracepoint *t;
+
+	for (t = io_latency_tracepoints; t->name; t++) {
+		if (t->tp)
+			tracepoint_probe_unregister(t->tp, t->probe, NULL);
+	}
+	/* no probe may still be running when aux is freed */
+	tracepoint_synchronize_unregister();
+	destroy_bio_table();
+}
+
+static int register_tracepoints(void)
+{
+	struct io_latency_tracepoint *t;
+	int res;
+
+	res = create_bio_table();
+	if (res)
+		return res;
+
+	/* the block tracepoints are not exported, look them up by name */
+	for_each_kernel_tracepoint(find_tracepoint, NULL);
+	for (t = io_latency_tracepoints; t->name; t++) {
+		if (!t->tp) {
+			printk(KERN_ERR "Can't find tracepoint %s\n", t->name);
+			res = -ENODEV;
+			goto err;
+		}
+		res = tracepoint_probe_register(t->tp, t->probe, NULL);
+		if (res) {
+			t->tp = NULL;
+			goto err;
+		}
+	}
+	return 0;
+err:
+	unregister_tracepoints();
+	return res;
+}
+
+#else /* !USE_TRACEPOINT */
+
+/* the hooks in hook_stats are the HOTFIX_* ones */
+#define NR_HOOKS		(HOTFIX_FINISH_REQUEST + 1)
+
+static struct ali_sym_addr io_latency_sym_addr_list[] = {
+	[HOTFIX_GET_REQUEST] = ALI_DEFINE_SYM_ADDR(get_request_wait),
+	[HOTFIX_START_REQUEST] = ALI_DEFINE_SYM_ADDR(blk_start_request),
+	[HOTFIX_FINISH_REQUEST] = ALI_DEFINE_SYM_ADDR(blk_finish_request),
+	{},
+};
+
+static const char *hook_name(int hook)
+{
+	return io_latency_sym_addr_list[hook].name;
+}
+
+static struct request *overwrite_get_request_wait(struct request_queue *q,
+		int rw_flags, struct bio *bio);
+static void overwrite_blk_start_request(struct request *req);
+static void overwrite_blk_finish_request(struct request *req, int error);
+
+static struct ali_hotfix_desc io_latency_hotfix_list[] = {
+
+	[HOTFIX_GET_REQUEST] = ALI_DEFINE_HOTFIX( \
+			"block: get_request_wait", \
+			"get_request_wait", \
+			overwrite_get_request_wait),
+
+	[HOTFIX_START_REQUEST] = ALI_DEFINE_HOTFIX( \
+			"block: blk_start_request", \
+			"blk_start_request", \
+			overwrite_blk_start_request),
+
+	[HOTFIX_FINISH_REQUEST] = ALI_DEFINE_HOTFIX( \
+			"block: blk_finish_request", \
+			"blk_finish_request", \
+			overwrite_blk_finish_request),
+	{},
+};
+
+/*
+ * The stamp kept in req->pad (or the request hash table) is the time the
+ * request was queued, then issued, in ns of compat_local_clock(): its low
+ * 48 bits, which wrap after three days.  On 64 bit its top byte holds 1 +
+ * the cgroup slot of the request, which is only known while the submitter
+ * is running: the stamp has to carry it to blk_finish_request().  The
+ * nibble below holds 1 + the queue depth bucket once the request is issued
+ * and counted in 'inflight', the one above it the size bucket then: the
+ * size is gone by the time the request is finished.  The lowest time bit
+ * is set once the request is issued, in every mode, so that a requeued
+ * request coming through blk_start_request() again is told apart.
+ */
+#define STAMP_ISSUED		1UL
+
+#if BITS_PER_LONG == 64
+#define STAMP_CG_SHIFT		56
+#define STAMP_SIZE_SHIFT	52
+#define STAMP_QD_SHIFT		48
+#define STAMP_MASK		((1UL << STAMP_QD_SHIFT) - 1)
+#define STAMP_TIME_SHIFT	0
+
+static inline unsigned long make_stamp(unsigned long now, int cg)
+{
+	return (now & STAMP_MASK & ~STAMP_ISSUED) |
+		((unsigned long)(cg + 1) << STAMP_CG_SHIFT);
+}
+
+static inline int stamp_cg(unsigned long stamp)
+{
+	return (int)(stamp >> STAMP_CG_SHIFT) - 1;
+}
+
+/*
+ * stamp of a request of size bucket 'size' issued at 'now', which then
+ * counts as in flight
+ */
+static inline unsigned long issue_stamp(struct request_queue_aux *aux,
+				unsigned long now, int cg, unsigned int size)
+{
+	unsigned int qd = qd_hist_index(sampled_depth(aux,
+				atomic_inc_return(&aux->inflight)));
+
+	return make_stamp(now, cg) | STAMP_ISSUED |
+		((unsigned long)size << STAMP_SIZE_SHIFT) |
+		((unsigned long)(qd + 1) << STAMP_QD_SHIFT);
+}
+
+static inline int stamp_qd(unsigned long stamp)
+{
+	return (int)((stamp >> STAMP_QD_SHIFT) & 0xf) - 1;
+}
+
+/*
+ * 'stamp' of a requeued request issued again at 'now': it keeps its
+ * depth and size and is still counted in 'inflight' once
+ */
+static inline unsigned long reissue_stamp(unsigned long stamp,
+				unsigned long now)
+{
+	return (stamp & ~STAMP_MASK) | (now & STAMP_MASK) | STAMP_ISSUED;
+}
+
+/* only known once the request is issued */
+static inline int stamp_size(unsigned long stamp)
+{
+	if (stamp_qd(stamp) < 0)
+		return -1;
+	return (stamp >> STAMP_SIZE_SHIFT) & 0xf;
+}
+#else
+#define STAMP_MASK		(~0UL)
+/* 1024ns units, 32 bit of ns would wrap after 4s */
+#define STAMP_TIME_SHIFT	10
+#define make_stamp(now, cg)	((now) & ~STAMP_ISSUED)
+#define stamp_cg(stamp)		(-1)
+#define issue_stamp(aux, now, cg, size)	((now) | STAMP_ISSUED)
+#define reissue_stamp(stamp, now)	((now) | STAMP_ISSUED)
+#define stamp_qd(stamp)		(-1)
+#define stamp_size(stamp)	(-1)
+#endif
+
+static inline int stamp_issued(unsigned long stamp)
+{
+	return !!(stamp & STAMP_ISSUED);
+}
+
+static inline unsigned long stamp_clock(void)
+{
+	return (unsigned long)(compat_local_clock() >> STAMP_TIME_SHIFT);
+}
+
+/*
+ * ns between the times of two stamps, modulo the bits a stamp keeps.  The
+ * clock of the CPU finishing a request may be a little behind the one of
+ * the CPU that issued it, such a request is ignored like an unstamped one.
+ */
+static inline u64 stamp_delta_ns(unsigned long stime, unsigned long now)
+{
+	unsigned long delta = (now - stime) & STAMP_MASK;
+
+	if (delta > STAMP_MASK >> 1)
+		return 0;
+	return (u64)delta << STAMP_TIME_SHIFT;
+}
+
+/* the request of 'stamp' is no longer in flight */
+static inline void stamp_done(struct request_queue_aux *aux,
+				unsigned long stamp)
+{
+	if (stamp_qd(stamp) >= 0)
+		atomic_dec(&aux->inflight);
+}
+
+/* slot of the blkio cgroup of the current task */
+static int current_cg(struct request_queue_aux *aux)
+{
+	int cg = -1;
+
+#if defined(CONFIG_BLK_CGROUP) && BITS_PER_LONG == 64
+	if (!aux->cgroups)
+		return -1;
+	rcu_read_lock();
+	cg = cg_stats_lookup(aux->cgroups,
+			task_subsys_state(current, blkio_subsys_id));
+	rcu_read_unlock();
+#endif
+	return cg;
+}
+
+static struct request *(*orig_get_request_wait)(struct request_queue *q,
+		int rw_flags, struct bio *bio);
+static struct request *overwrite_get_request_wait(struct request_queue *q,
+		int rw_flags, struct bio *bio)
+{
+	struct request *req;
+	struct request_queue_aux *aux;
+	unsigned long now;
+	u64 start;
+
+	orig_get_request_wait = ali_hotfix_orig_func(
+			&io_latency_hotfix_list[HOTFIX_GET_REQUEST]);
+	req = orig_get_request_wait(q, rw_flags, bio);
+	start = hook_start();
+	if (!req || !req->q)
+		goto out;
+
+	aux = get_aux(req->q);
+	if (!aux) {
+		hook_miss(HOTFIX_GET_REQUEST);
+		goto out;
+	}
+	if (!aux->lstats)
+		goto out;
+#ifdef USE_HASH_TABLE
+	if (!aux->hash_table)
+		goto out;
+#endif
+
+	if (!aux->enable_latency && !aux->enable_soft_latency)
+		goto out;
+	/*
+	 * the other hooks skip requests without a stamp, drop the one a
+	 * request merged away before it was issued may have left behind
+	 */
+	if (!sample_io(aux)) {
+#ifdef USE_HASH_TABLE
+		hash_table_remove(aux->hash_table, (unsigned long)req);
+#else
+		req->pad = NULL;
+#endif
+		goto out;
+	}
+
+	/* put time into 'pad' now */
+	now = stamp_clock();
+
+	now = make_stamp(now, current_cg(aux));
+	note_submitter(aux, req);
+#ifdef USE_HASH_TABLE
+	if (hash_table_set(aux->hash_table, (unsigned long)req, now))
+		hook_drop(HOTFIX_GET_REQUEST);
+#else
+	req->pad = (void *)now;
+#endif
+out:
+	hook_end(HOTFIX_GET_REQUEST, start);
+	return req;
+}
+
+/*
+ * every request based driver (sd, virtio_blk, xen-blkfront, dm-multipath
+ * ...) takes its requests off the queue with blk_start_request()
+ */
+static void (*orig_blk_start_request)(struct request *req);
+static void overwrite_blk_start_request(struct request *req)
+{
+	struct request_queue_aux *aux;
+	unsigned long stime, now;
+	int bytes, cg, requeued;
+	u64 start = hook_start();
+
+	orig_blk_start_request = ali_hotfix_orig_func(
+			&io_latency_hotfix_list[HOTFIX_START_REQUEST]);
+	if (!req || !req->q)
+		goto out;
+
+#ifdef USE_HASH_TABLE
+	aux = get_aux(req->q);
+	if (!aux) {
+		hook_miss(HOTFIX_START_REQUEST);
+		goto out;
+	}
+	if (!aux->hash_table)
+		goto out;
+#else
+	if (!req->pad) {
+		hook_miss(HOTFIX_START_REQUEST);
+		goto out;
+	}
+
+	aux = get_aux(req->q);
+#endif
+	if (!aux || !aux->lstats)
+		goto out;
+
+	bytes = blk_rq_bytes(req);
+	if (bytes <= 0) {
+#ifdef USE_HASH_TABLE
+		hash_table_remove(aux->hash_table, (unsigned long)req);
+#endif
+		goto out;
+	}
+
+	now = stamp_clock();
+
+#ifdef USE_HASH_TABLE
+	/* find request in request hash table and swap in dispatch time */
+	if (hash_table_find(aux->hash_table, (unsigned long)req, &stime)) {
+		hook_miss(HOTFIX_START_REQUEST);
+		goto out;
+	}
+	cg = stamp_cg(stime);
+	/* a requeued request comes through here again, issued already */
+	requeued = stamp_issued(stime);
+	if (requeued)
+		now = reissue_stamp(stime, now);
+	else
+		now = issue_stamp(aux, now, cg, size_log2_index(bytes));
+	if (hash_table_exchange(aux->hash_table, (unsigned long)req, now,
+				NULL)) {
+		stamp_done(aux, now);
+		hook_drop(HOTFIX_START_REQUEST);
+		goto out;
+	}
+#else
+	stime = (unsigned long)req->pad;
+	cg = stamp_cg(stime);
+	/* a requeued request comes through here again, issued already */
+	requeued = stamp_issued(stime);
+	if (requeued)
+		req->pad = (void *)reissue_stamp(stime, now);
+	else if (aux->enable_latency)
+		req->pad = (void *)issue_stamp(aux, now, cg,
+					size_log2_index(bytes));
+	else
+		req->pad = (void *)(stime | STAMP_ISSUED);
+#endif
+	/* its soft latency ended with the first issue */
+	if (!requeued)
+		account_rq_issue(aux, req, stamp_delta_ns(stime, now), cg);
+out:
+	hook_end(HOTFIX_START_REQUEST, start);
+	orig_blk_start_request(req);
+}
+
+static void (*orig_blk_finish_request)(struct request *req, int error);
+static void overwrite_blk_finish_request(struct request *req, int error)
+{
+	struct request_queue_aux *aux;
+	unsigned long stime, now;
+	u64 ns, start = hook_start();
+	pid_t pid;
+
+	orig_blk_finish_request = ali_hotfix_orig_func(
+			&io_latency_hotfix_list[HOTFIX_FINISH_REQUEST]);
+	if (!req || !req->q)
+		goto out;
+
+#ifdef USE_HASH_TABLE
+	aux = get_aux(req->q);
+	if (!aux) {
+		hook_miss(HOTFIX_FINISH_REQUEST);
+		goto out;
+	}
+	if (!aux->hash_table)
+		goto out;
+#else
+	if (!req->pad) {
+		hook_miss(HOTFIX_FINISH_REQUEST);
+		goto out;
+	}
+
+	aux = get_aux(req->q);
+#endif
+	if (!aux || !aux->lstats)
+		goto out;
+
+	now = stamp_clock();
+
+#ifdef USE_HASH_TABLE
+	/* request is done, take it out of request hash table */
+	if (hash_table_find_and_remove(aux->hash_table, (unsigned long)req,
+				&stime)) {
+		hook_miss(HOTFIX_FINISH_REQUEST);
+		goto out;
+	}
+#else
+	stime = (unsigned long)req->pad;
+	req->pad = NULL;
+#endif
+	stamp_done(aux, stime);
+	if (!aux->enable_latency)
+		goto out;
+
+	ns = stamp_delta_ns(stime, now);
+	account_rq_complete(aux, req, ns, stamp_cg(stime), stamp_qd(stime),
+			stamp_size(stime));
+	pid = take_submitter(aux, req);
+	top_n_add(aux->top, pid, ns);
+	/*
+	 * the request is completed already, its size is gone.  Its times
+	 * are of the clock it was stamped with, or dispatch_ns would be off.
+	 */
+	if (get_outliers(aux, ns))
+		log_rq_outlier(aux, req, 0, pid, 0, compat_local_clock(), ns);
+out:
+	hook_end(HOTFIX_FINISH_REQUEST, start);
+	orig_blk_finish_request(req, error);
+}
+#endif /* USE_TRACEPOINT */
+
+/*
+ * A cursor remembers a fold of everything ever counted as its baseline
+ * and shows the difference.  Folding again right away for the baseline
+ * would lose what is counted in between, so the delta and the new
+ * baseline come from the same fold and every I/O is reported by exactly
+ * one read of the cursor.
+ *
+ * must be called with aux->base_lock held
+ */
+static int advance_baseline(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum **base,
+			struct latency_stats_sum *delta)
+{
+	struct latency_stats_sum *cur;
+
+	cur = create_latency_stats_sum();
+	if (!cur)
+		return -ENOMEM;
+	fold_latency_stats(lstats, cur);
+	if (delta) {
+		memcpy(delta, cur, sizeof(struct latency_stats_sum));
+		if (*base)
+			sub_latency_stats(delta, *base);
+	}
+	destroy_latency_stats_sum(*base);
+	*base = cur;
+	return 0;
+}
+
+/* stats of 'aux' since its last reset, NULL if out of memory */
+static struct latency_stats_sum *get_aux_stats(struct request_queue_aux *aux)
+{
+	struct latency_stats_sum *sum;
+
+	sum = create_latency_stats_sum();
+	if (!sum)
+		return NULL;
+	fold_latency_stats_current(aux->lstats, sum);
+	return sum;
+}
+
+/*
+ * A reset only bumps the generation of the counters, every CPU clears
+ * its own at its next update.  What was counted before a reset does not
+ * change until the next one, so two such folds around the reset tell
+ * exactly what was counted in between, even with I/O running.
+ *
+ * must be called with aux->base_lock held
+ */
+static int reset_aux_stats(struct request_queue_aux *aux,
+			struct latency_stats_sum *delta)
+{
+	struct latency_stats_sum *prev;
+
+	if (!delta) {
+		reset_latency_stats(aux->lstats);
+		return 0;
+	}
+	prev = create_latency_stats_sum();
+	if (!prev)
+		return -ENOMEM;
+	fold_latency_stats_base(aux->lstats, prev);
+	reset_latency_stats(aux->lstats);
+	fold_latency_stats_base(aux->lstats, delta);
+	sub_latency_stats(delta, prev);
+	destroy_latency_stats_sum(prev);
+	return 0;
+}
+
+/*
+ * the legacy *_us, *_ms and *_s files each show the histogram buckets of
+ * one tier, the bucket holding a tier boundary goes to the slower tier
+ */
+enum {
+	LAT_TIER_US,
+	LAT_TIER_MS,
+	LAT_TIER_S,
+};
+
+static const struct {
+	const char *unit;
+	u32 unit_ns;
+} lat_tiers[] = {
+	[LAT_TIER_US] = { "us", NSEC_PER_USEC },
+	[LAT_TIER_MS] = { "ms", NSEC_PER_MSEC },
+	[LAT_TIER_S] = { "s", NSEC_PER_SEC },
+};
+
+static void lat_tier_range(int tier, unsigned int *first, unsigned int *last)
+{
+	if (tier == LAT_TIER_US)
+		*first = 0;
+	else
+		*first = lat_hist_index(lat_tiers[tier].unit_ns);
+
+	if (tier == LAT_TIER_S)
+		*last = LAT_HIST_NR - 1;
+	else
+		*last = lat_hist_index(lat_tiers[tier + 1].unit_ns) - 1;
+}
+
+/* print bucket bounds in the unit of its tier, with three decimals */
+static void lat_bucket_show(struct seq_file *seq, int tier, unsigned int idx,
+				u64 sum)
+{
+	u32 milli = lat_tiers[tier].unit_ns / 1000;
+	u64 lo, hi;
+	u32 lo_rem, hi_rem;
+
+	lo = div_u64_rem(div_u64(lat_hist_bucket_low(idx), milli), 1000,
+			&lo_rem);
+	hi = div_u64_rem(div_u64(lat_hist_bucket_high(idx), milli), 1000,
+			&hi_rem);
+	seq_printf(seq, "%llu.%03u-%llu.%03u(%s):%llu\n",
+			(unsigned long long)lo, lo_rem,
+			(unsigned long long)hi, hi_rem,
+			lat_tiers[tier].unit, (unsigned long long)sum);
+}
+
+#define PROC_SHOW(_name, _tier, _member, _rd, _wr)			\
 static void _name##_show(struct seq_file *seq,				\
-				struct latency_stats __percpu *lstats)	\
+			struct latency_stats_sum *stats, int unit)	\
 {									\
-	int slot_base = 0;						\
-	int i, cpu;							\
-	unsigned long sum;						\
+	unsigned int i, first, last;					\
+	u64 sum;							\
 									\
-	for (i = 0; i < _nr; i++) {					\
+	lat_tier_range(_tier, &first, &last);				\
+	for (i = first; i <= last; i++) {				\
 		sum = 0;						\
-		for_each_possible_cpu(cpu)				\
-			sum += per_cpu_ptr(lstats, cpu)->_member[i];	\
-									\
-		seq_printf(seq,						\
-			"%d-%d(%s):%lu\n",				\
-			slot_base,					\
-			slot_base + _grain - 1,				\
-			_unit,						\
-			sum);						\
-		slot_base += _grain;					\
+		if (_rd)						\
+			sum += stats->_member##_read.buckets[i];	\
+		if (_wr)						\
+			sum += stats->_member##_write.buckets[i];	\
+		lat_bucket_show(seq, _tier, i, sum);			\
 	}								\
 }
 
@@ -390,12 +1555,17 @@ static int _name##_seq_show(struct seq_file *seq, void *v)		\
 {									\
 	struct request_queue *q = seq->private;				\
 	struct request_queue_aux *aux;					\
+	struct latency_stats_sum *stats;				\
 									\
 	if (!q)								\
 		seq_puts(seq, "none");					\
 	else {								\
 		aux = get_aux(q);					\
-		_name##_show(seq, aux->lstats);				\
+		stats = get_aux_stats(aux);				\
+		if (!stats)						\
+			return -ENOMEM;					\
+		_name##_show(seq, stats, aux->latency_unit);		\
+		destroy_latency_stats_sum(stats);			\
 	}								\
 	return 0;							\
 }									\
@@ -418,169 +1588,825 @@ static int proc_##_name##_open(struct inode *inode, struct file *file)	\
 	return res;							\
 }									\
 									\
-static const struct file_operations proc_##_name##_fops = {		\
-	.owner		= THIS_MODULE,					\
-	.open		= proc_##_name##_open,				\
-	.read		= seq_read,					\
-	.llseek		= seq_lseek,					\
-	.release	= seq_release,					\
+static const proc_fops_t proc_##_name##_fops =			\
+	PROC_FOPS_INIT(proc_##_name##_open, seq_read, NULL,		\
+			seq_lseek, seq_release, NULL)
+
+static void *io_latency_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	return *pos ? NULL : SEQ_START_TOKEN;
+}
+
+static void *io_latency_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	return NULL;
+}
+
+static void io_latency_seq_stop(struct seq_file *seq, void *v)
+{
+}
+
+#define KB (1024)
+static void io_size_show(struct seq_file *seq,
+				struct latency_stats_sum *stats, int unit)
+{
+	int slot_base = 0;
+	int i;
+
+	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
+		seq_printf(seq,
+			"%d-%d(KB):%llu\n",
+			(slot_base / KB),
+			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
+			(unsigned long long)stats->io_size_stats[i]);
+		slot_base += IO_SIZE_STATS_GRAINSIZE;
+	}
+}
+
+static void io_read_size_show(struct seq_file *seq,
+				struct latency_stats_sum *stats, int unit)
+{
+	int slot_base = 0;
+	int i;
+
+	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
+		seq_printf(seq,
+			"%d-%d(KB):%llu\n",
+			(slot_base / KB),
+			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
+			(unsigned long long)stats->io_read_size_stats[i]);
+		slot_base += IO_SIZE_STATS_GRAINSIZE;
+	}
+}
+
+static void io_write_size_show(struct seq_file *seq,
+				struct latency_stats_sum *stats, int unit)
+{
+	int slot_base = 0;
+	int i;
+
+	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
+		seq_printf(seq,
+			"%d-%d(KB):%llu\n",
+			(slot_base / KB),
+			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
+			(unsigned long long)stats->io_write_size_stats[i]);
+		slot_base += IO_SIZE_STATS_GRAINSIZE;
+	}
+}
+
+PROC_SHOW(soft_io_latency_us, LAT_TIER_US, soft_latency, 1, 1);
+PROC_SHOW(soft_io_latency_ms, LAT_TIER_MS, soft_latency, 1, 1);
+PROC_SHOW(soft_io_latency_s, LAT_TIER_S, soft_latency, 1, 1);
+
+PROC_SHOW(soft_read_io_latency_us, LAT_TIER_US, soft_latency, 1, 0);
+PROC_SHOW(soft_read_io_latency_ms, LAT_TIER_MS, soft_latency, 1, 0);
+PROC_SHOW(soft_read_io_latency_s, LAT_TIER_S, soft_latency, 1, 0);
+
+PROC_SHOW(soft_write_io_latency_us, LAT_TIER_US, soft_latency, 0, 1);
+PROC_SHOW(soft_write_io_latency_ms, LAT_TIER_MS, soft_latency, 0, 1);
+PROC_SHOW(soft_write_io_latency_s, LAT_TIER_S, soft_latency, 0, 1);
+
+PROC_SHOW(io_latency_us, LAT_TIER_US, latency, 1, 1);
+PROC_SHOW(io_latency_ms, LAT_TIER_MS, latency, 1, 1);
+PROC_SHOW(io_latency_s, LAT_TIER_S, latency, 1, 1);
+
+PROC_SHOW(read_io_latency_us, LAT_TIER_US, latency, 1, 0);
+PROC_SHOW(read_io_latency_ms, LAT_TIER_MS, latency, 1, 0);
+PROC_SHOW(read_io_latency_s, LAT_TIER_S, latency, 1, 0);
+
+PROC_SHOW(write_io_latency_us, LAT_TIER_US, latency, 0, 1);
+PROC_SHOW(write_io_latency_ms, LAT_TIER_MS, latency, 0, 1);
+PROC_SHOW(write_io_latency_s, LAT_TIER_S, latency, 0, 1);
+
+/*
+ * units of the latencies in percentiles, qd_latency and the other summary
+ * files, set per disk through 'latency_unit'
+ */
+enum {
+	TIME_UNIT_NS,
+	TIME_UNIT_US,
+	TIME_UNIT_MS,
+	TIME_UNIT_NR,
+};
+
+static const struct {
+	const char *name;
+	u32 ns;
+} time_units[] = {
+	[TIME_UNIT_NS] = { "ns", 1 },
+	[TIME_UNIT_US] = { "us", NSEC_PER_USEC },
+	[TIME_UNIT_MS] = { "ms", NSEC_PER_MSEC },
+};
+
+static const unsigned int percentile_ranks[] = {
+	50000, 90000, 99000, 99900,
+};
+
+/* print a latency in ns in 'unit', with three decimals above ns */
+static void seq_put_time(struct seq_file *seq, u64 ns, int unit)
+{
+	u32 rem;
+	u64 val;
+
+	if (unit == TIME_UNIT_NS) {
+		seq_printf(seq, " %llu", (unsigned long long)ns);
+		return;
+	}
+	val = div_u64_rem(ns, time_units[unit].ns, &rem);
+	seq_printf(seq, " %llu.%03u", (unsigned long long)val,
+			rem / (time_units[unit].ns / 1000));
+}
+
+/* a header: the 'fixed' columns, then the 'nr' latency ones in 'unit' */
+static void seq_put_header(struct seq_file *seq, const char *fixed,
+			const char * const *cols, int nr, int unit)
+{
+	int i;
+
+	seq_puts(seq, fixed);
+	for (i = 0; i < nr; i++)
+		seq_printf(seq, " %s(%s)", cols[i], time_units[unit].name);
+	seq_putc(seq, '\n');
+}
+
+static const char * const percentile_cols[] = {
+	"mean", "p50", "p90", "p99", "p99.9", "max",
+};
+
+static void percentiles_show_one(struct seq_file *seq, const char *name,
+			struct lat_hist_sum *read, struct lat_hist_sum *write,
+			int unit)
+{
+	struct lat_hist_sum *hists[2];
+	u64 values[ARRAY_SIZE(percentile_ranks)];
+	u64 count, sum = 0, max = 0;
+	int i, nr = 0;
+
+	if (read)
+		hists[nr++] = read;
+	if (write)
+		hists[nr++] = write;
+	for (i = 0; i < nr; i++) {
+		sum += hists[i]->sum;
+		max = max_t(u64, max, hists[i]->max);
+	}
+	count = lat_hist_count(hists, nr);
+	lat_hist_percentiles(hists, nr, percentile_ranks, values,
+			ARRAY_SIZE(percentile_ranks));
+
+	seq_printf(seq, "%s %llu", name, (unsigned long long)count);
+	seq_put_time(seq, count ? div64_u64(sum, count) : 0, unit);
+	for (i = 0; i < ARRAY_SIZE(percentile_ranks); i++)
+		seq_put_time(seq, values[i], unit);
+	seq_put_time(seq, max, unit);
+	seq_putc(seq, '\n');
+}
+
+/* one small file instead of rebuilding percentiles from every bucket */
+static void percentiles_show(struct seq_file *seq,
+				struct latency_stats_sum *sum, int unit)
+{
+	char name[32];
+	int i;
+
+	seq_put_header(seq, "name count", percentile_cols,
+			ARRAY_SIZE(percentile_cols), unit);
+	percentiles_show_one(seq, "io_latency",
+			&sum->latency_read, &sum->latency_write, unit);
+	percentiles_show_one(seq, "read_io_latency",
+			&sum->latency_read, NULL, unit);
+	percentiles_show_one(seq, "write_io_latency",
+			NULL, &sum->latency_write, unit);
+	percentiles_show_one(seq, "soft_io_latency",
+			&sum->soft_latency_read, &sum->soft_latency_write,
+			unit);
+	percentiles_show_one(seq, "soft_read_io_latency",
+			&sum->soft_latency_read, NULL, unit);
+	percentiles_show_one(seq, "soft_write_io_latency",
+			NULL, &sum->soft_latency_write, unit);
+	for (i = 0; i < LAT_OP_NR; i++) {
+		snprintf(name, sizeof(name), "%s_io_latency", lat_op_names[i]);
+		percentiles_show_one(seq, name, &sum->op_latency[i], NULL,
+				unit);
+	}
+}
+
+/* upper bound (ns) of the log2 bucket holding the 'per100k' rank */
+static u64 lat_log2_percentile(const u64 *buckets, u64 count,
+			unsigned int per100k)
+{
+	u64 rank, seen = 0;
+	int i;
+
+	rank = div_u64(count * per100k + 99999, 100000);
+	for (i = 0; i < LAT_LOG2_NR - 1; i++) {
+		seen += buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	return (1ULL << i) << LAT_LOG2_UNIT_SHIFT;
+}
+
+/* hardware latency by the number of requests in flight at issue */
+static void qd_latency_show(struct seq_file *seq,
+			struct latency_stats_sum *sum, int unit)
+{
+	static const char * const cols[] = { "mean", "p50", "p99" };
+	u64 count;
+	int i, j;
+
+	seq_put_header(seq, "depth count", cols, ARRAY_SIZE(cols), unit);
+	for (i = 0; i < QD_HIST_NR; i++) {
+		count = 0;
+		for (j = 0; j < LAT_LOG2_NR; j++)
+			count += sum->qd_latency[i][j];
+		if (!count)
+			continue;
+		if (i < QD_HIST_NR - 1)
+			seq_printf(seq, "%u-%u", 1U << i, (2U << i) - 1);
+		else
+			seq_printf(seq, "%u+", 1U << i);
+		seq_printf(seq, " %llu", (unsigned long long)count);
+		seq_put_time(seq, div64_u64(sum->qd_latency_sum[i], count),
+				unit);
+		seq_put_time(seq, lat_log2_percentile(sum->qd_latency[i],
+					count, 50000), unit);
+		seq_put_time(seq, lat_log2_percentile(sum->qd_latency[i],
+					count, 99000), unit);
+		seq_putc(seq, '\n');
+	}
+}
+
+PROC_FOPS(percentiles);
+PROC_FOPS(qd_latency);
+PROC_FOPS(io_size);
+PROC_FOPS(io_read_size);
+PROC_FOPS(io_write_size);
+
+PROC_FOPS(soft_io_latency_us);
+PROC_FOPS(soft_io_latency_ms);
+PROC_FOPS(soft_io_latency_s);
+PROC_FOPS(soft_read_io_latency_us);
+PROC_FOPS(soft_read_io_latency_ms);
+PROC_FOPS(soft_read_io_latency_s);
+PROC_FOPS(soft_write_io_latency_us);
+PROC_FOPS(soft_write_io_latency_ms);
+PROC_FOPS(soft_write_io_latency_s);
+
+PROC_FOPS(io_latency_us);
+PROC_FOPS(io_latency_ms);
+PROC_FOPS(io_latency_s);
+PROC_FOPS(read_io_latency_us);
+PROC_FOPS(read_io_latency_ms);
+PROC_FOPS(read_io_latency_s);
+PROC_FOPS(write_io_latency_us);
+PROC_FOPS(write_io_latency_ms);
+PROC_FOPS(write_io_latency_s);
+
+/* snapshot of 'aux' marked with its sample rate */
+static struct snapshot_buf *aux_snapshot_create(struct request_queue_aux *aux,
+						size_t size)
+{
+	struct snapshot_buf *sb;
+
+	sb = snapshot_create(size, aux->disk);
+	if (sb)
+		snapshot_set_sample_rate(sb, aux->sample_rate);
+	return sb;
+}
+
+/* stats.bin: the whole latency_stats of a device in one binary read */
+static int proc_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct request_queue_aux *aux;
+	struct latency_stats_sum *sum;
+	struct snapshot_buf *sb;
+
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+
+	sum = get_aux_stats(aux);
+	if (!sum)
+		return -ENOMEM;
+	sb = aux_snapshot_create(aux, latency_stats_snapshot_size());
+	if (!sb) {
+		destroy_latency_stats_sum(sum);
+		return -ENOMEM;
+	}
+	snapshot_add_latency_stats(sb, sum);
+	destroy_latency_stats_sum(sum);
+
+	file->private_data = sb;
+	return 0;
+}
+
+static ssize_t proc_snapshot_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct snapshot_buf *sb = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, sb->data, sb->len);
+}
+
+static int proc_snapshot_release(struct inode *inode, struct file *file)
+{
+	snapshot_destroy(file->private_data);
+	return 0;
+}
+
+static const proc_fops_t proc_stats_bin_fops =
+	PROC_FOPS_INIT(proc_stats_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+/*
+ * build a stats.bin of what was counted since '*base' and advance it, or
+ * since the last reset of 'aux' and reset it if 'base' is NULL
+ */
+static int read_and_clear_open(struct file *file,
+			struct request_queue_aux *aux,
+			struct latency_stats_sum **base)
+{
+	struct latency_stats_sum *delta;
+	struct snapshot_buf *sb;
+	int res;
+
+	delta = create_latency_stats_sum();
+	if (!delta)
+		return -ENOMEM;
+	sb = aux_snapshot_create(aux, latency_stats_snapshot_size());
+	if (!sb) {
+		destroy_latency_stats_sum(delta);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&aux->base_lock);
+	if (base)
+		res = advance_baseline(aux->lstats, base, delta);
+	else
+		res = reset_aux_stats(aux, delta);
+	mutex_unlock(&aux->base_lock);
+
+	if (res)
+		snapshot_destroy(sb);
+	else {
+		snapshot_add_latency_stats(sb, delta);
+		file->private_data = sb;
+	}
+	destroy_latency_stats_sum(delta);
+	return res;
+}
+
+/* stats_reset.bin: stats.bin and io_stats_reset in one atomic step */
+static int proc_stats_reset_bin_open(struct inode *inode, struct file *file)
+{
+	struct request_queue_aux *aux;
+
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	return read_and_clear_open(file, aux, NULL);
 }
 
-static void *PDE_DATA(const struct inode *inode)
-{
-	return container_of(inode, struct proc_inode, vfs_inode)->pde->data;
+static const proc_fops_t proc_stats_reset_bin_fops =
+	PROC_FOPS_INIT(proc_stats_reset_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+/* cursor/<name>: stats.bin of what was counted since the last read */
+static int proc_cursor_open(struct inode *inode, struct file *file)
+{
+	struct io_cursor *cursor = PDE_DATA(inode);
+
+	return read_and_clear_open(file, cursor->aux, &cursor->base);
+}
+
+static const proc_fops_t proc_cursor_fops =
+	PROC_FOPS_INIT(proc_cursor_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+static unsigned int get_fold_interval(void)
+{
+	return max_t(unsigned int, ACCESS_ONCE(fold_interval_ms),
+			FOLD_INTERVAL_MIN_MS);
+}
+
+/* copy the per-cpu counters into every region mapped by userspace */
+static void fold_work_fn(struct work_struct *work)
+{
+	struct request_queue_aux *aux;
+	unsigned int interval = get_fold_interval();
+
+	mutex_lock(&aux_mutex);
+	list_for_each_entry(aux, &aux_list, list) {
+		if (!aux->shared)
+			continue;
+		shared_stats_update(aux->shared, aux->lstats, interval,
+				aux->sample_rate);
+	}
+	mutex_unlock(&aux_mutex);
+	schedule_delayed_work(&fold_work, msecs_to_jiffies(interval));
+}
+
+/* stats.mmap: stats.bin kept up to date in memory shared with userspace */
+static int proc_stats_mmap_open(struct inode *inode, struct file *file)
+{
+	struct request_queue_aux *aux;
+	struct shared_stats *ss;
+	int res = 0;
+
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+
+	mutex_lock(&aux_mutex);
+	if (!aux->shared) {
+		ss = shared_stats_create(aux->disk);
+		if (ss) {
+			shared_stats_update(ss, aux->lstats,
+					get_fold_interval(), aux->sample_rate);
+			aux->shared = ss;
+		} else
+			res = -ENOMEM;
+	}
+	mutex_unlock(&aux_mutex);
+
+	file->private_data = aux;
+	return res;
+}
+
+static int proc_stats_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct request_queue_aux *aux = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	compat_vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, aux->shared->region, vma->vm_pgoff);
+}
+
+static const proc_fops_t proc_stats_mmap_fops =
+	PROC_FOPS_INIT(proc_stats_mmap_open, NULL, NULL,
+			NULL, NULL, proc_stats_mmap);
+
+/* move every started latency window forward by one second */
+static void window_work_fn(struct work_struct *work)
+{
+	struct request_queue_aux *aux;
+
+	mutex_lock(&aux_mutex);
+	list_for_each_entry(aux, &aux_list, list) {
+		if (aux->windows)
+			lat_windows_tick(aux->windows, aux->lstats);
+	}
+	mutex_unlock(&aux_mutex);
+	schedule_delayed_work(&window_work, HZ);
+}
+
+/* windows only start to fill once somebody looks at them */
+static struct lat_windows *get_windows(struct request_queue_aux *aux)
+{
+	mutex_lock(&aux_mutex);
+	if (!aux->windows)
+		aux->windows = lat_windows_create(aux->lstats);
+	mutex_unlock(&aux_mutex);
+	return aux->windows;
+}
+
+static int window_percentiles_seq_show(struct seq_file *seq, void *v)
+{
+	struct request_queue_aux *aux;
+	struct lat_windows *win;
+	struct lat_hist_sum *latency, *soft_latency;
+	char name[32];
+	int i;
+
+	aux = get_aux(seq->private);
+	if (!aux || !aux->lstats)
+		return 0;
+	win = get_windows(aux);
+	if (!win)
+		return -ENOMEM;
+
+	latency = vmalloc(sizeof(struct lat_hist_sum) * 2);
+	if (!latency)
+		return -ENOMEM;
+	soft_latency = latency + 1;
+
+	seq_put_header(seq, "name count", percentile_cols,
+			ARRAY_SIZE(percentile_cols), aux->latency_unit);
+	for (i = 0; i < LAT_WINDOW_NR; i++) {
+		lat_windows_sum(win, i, latency, soft_latency);
+		snprintf(name, sizeof(name), "io_latency_%us",
+				lat_window_seconds[i]);
+		percentiles_show_one(seq, name, latency, NULL,
+				aux->latency_unit);
+		snprintf(name, sizeof(name), "soft_io_latency_%us",
+				lat_window_seconds[i]);
+		percentiles_show_one(seq, name, soft_latency, NULL,
+				aux->latency_unit);
+	}
+	vfree(latency);
+	return 0;
+}
+
+static int proc_window_percentiles_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, window_percentiles_seq_show, PDE_DATA(inode));
+}
+
+static const proc_fops_t proc_window_percentiles_fops =
+	PROC_FOPS_INIT(proc_window_percentiles_open, seq_read, NULL,
+			seq_lseek, single_release, NULL);
+
+/* cgroups: 'percentiles' of every blkio cgroup holding a slot */
+struct cgroups_show {
+	struct seq_file *seq;
+	int unit;
+};
+
+static void cgroup_percentiles_show(void *priv, const char *name,
+				struct latency_stats_sum *sum)
+{
+	struct cgroups_show *cs = priv;
+
+	seq_printf(cs->seq, "cgroup %s\n", name);
+	percentiles_show(cs->seq, sum, cs->unit);
+	seq_putc(cs->seq, '\n');
+}
+
+static int cgroups_seq_show(struct seq_file *seq, void *v)
+{
+	struct request_queue_aux *aux;
+	struct cgroups_show cs;
+
+	aux = get_aux(seq->private);
+	if (!aux || !aux->lstats)
+		return 0;
+	cs.seq = seq;
+	cs.unit = aux->latency_unit;
+	return cg_stats_for_each(aux->cgroups, cgroup_percentiles_show, &cs);
 }
 
-static void *io_latency_seq_start(struct seq_file *seq, loff_t *pos)
+static int proc_cgroups_open(struct inode *inode, struct file *file)
 {
-	return *pos ? NULL : SEQ_START_TOKEN;
+	return single_open(file, cgroups_seq_show, PDE_DATA(inode));
 }
 
-static void *io_latency_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+static const proc_fops_t proc_cgroups_fops =
+	PROC_FOPS_INIT(proc_cgroups_open, seq_read, NULL,
+			seq_lseek, single_release, NULL);
+
+/* windows.bin: the histograms behind window_percentiles */
+static int proc_windows_bin_open(struct inode *inode, struct file *file)
 {
-	return NULL;
+	struct request_queue_aux *aux;
+	struct lat_windows *win;
+	struct lat_hist_sum *latency, *soft_latency;
+	struct snapshot_buf *sb;
+	int i;
+
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	win = get_windows(aux);
+	if (!win)
+		return -ENOMEM;
+
+	latency = vmalloc(sizeof(struct lat_hist_sum) * 2);
+	if (!latency)
+		return -ENOMEM;
+	soft_latency = latency + 1;
+	sb = aux_snapshot_create(aux,
+			sizeof(struct io_latency_snapshot_header) +
+			2 * LAT_WINDOW_NR * SNAPSHOT_LAT_HIST_SIZE);
+	if (!sb) {
+		vfree(latency);
+		return -ENOMEM;
+	}
+	for (i = 0; i < LAT_WINDOW_NR; i++) {
+		lat_windows_sum(win, i, latency, soft_latency);
+		snapshot_add_lat_hist(sb, IO_LATENCY_SECT_WINDOW_LATENCY,
+				lat_window_seconds[i], latency);
+		snapshot_add_lat_hist(sb, IO_LATENCY_SECT_WINDOW_SOFT_LATENCY,
+				lat_window_seconds[i], soft_latency);
+	}
+	vfree(latency);
+
+	file->private_data = sb;
+	return 0;
 }
 
-static void io_latency_seq_stop(struct seq_file *seq, void *v)
+static const proc_fops_t proc_windows_bin_fops =
+	PROC_FOPS_INIT(proc_windows_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+/* heatmap.bin: latency by LBA zone, empty if heatmap_zone_mb is 0 */
+static int proc_heatmap_bin_open(struct inode *inode, struct file *file)
 {
+	struct request_queue_aux *aux;
+	struct lba_heatmap *hm;
+	struct snapshot_buf *sb;
+	unsigned int nr;
+	u64 *val;
+
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	hm = aux->heatmap;
+	nr = hm ? hm->nr_zones * LAT_LOG2_NR : 0;
+
+	sb = aux_snapshot_create(aux,
+			sizeof(struct io_latency_snapshot_header) +
+			SNAPSHOT_SECTION_SIZE(4) + SNAPSHOT_SECTION_SIZE(nr));
+	if (!sb)
+		return -ENOMEM;
+	if (hm) {
+		val = snapshot_add_section(sb, IO_LATENCY_SECT_HEATMAP_LAYOUT,
+				0, 4);
+		val[0] = 1ULL << hm->zone_shift;
+		val[1] = hm->nr_zones;
+		val[2] = LAT_LOG2_NR;
+		val[3] = LAT_LOG2_UNIT_SHIFT;
+		val = snapshot_add_section(sb, IO_LATENCY_SECT_HEATMAP, 0, nr);
+		lba_heatmap_fold(hm, val);
+	}
+
+	file->private_data = sb;
+	return 0;
 }
 
-#define KB (1024)
-static void io_size_show(struct seq_file *seq,
-				struct latency_stats __percpu *lstats)
-{
-	int slot_base = 0;
-	int i, cpu;
-	unsigned long sum;
+static const proc_fops_t proc_heatmap_bin_fops =
+	PROC_FOPS_INIT(proc_heatmap_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
 
-	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
-		sum = 0;
-		for_each_possible_cpu(cpu)
-			sum += per_cpu_ptr(lstats, cpu)->io_size_stats[i];
+/* size_latency.bin: latency by I/O size, empty if size_latency is off */
+static int proc_size_latency_bin_open(struct inode *inode, struct file *file)
+{
+	struct request_queue_aux *aux;
+	struct size_lat *sl;
+	struct snapshot_buf *sb;
+	u64 (*counts)[LAT_LOG2_NR];
+	u64 *val;
+	int rw, i;
 
-		seq_printf(seq,
-			"%d-%d(KB):%lu\n",
-			(slot_base / KB),
-			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
-			sum);
-		slot_base += IO_SIZE_STATS_GRAINSIZE;
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	sl = aux->size_lat;
+
+	counts = vmalloc(sizeof(u64) * SIZE_LOG2_NR * LAT_LOG2_NR);
+	if (!counts)
+		return -ENOMEM;
+	sb = aux_snapshot_create(aux,
+			sizeof(struct io_latency_snapshot_header) +
+			(sl ? 2 * SIZE_LOG2_NR : 0) *
+			SNAPSHOT_SECTION_SIZE(LAT_LOG2_NR));
+	if (!sb) {
+		vfree(counts);
+		return -ENOMEM;
+	}
+	for (rw = 0; sl && rw < 2; rw++) {
+		size_lat_fold(sl, rw, counts);
+		for (i = 0; i < SIZE_LOG2_NR; i++) {
+			val = snapshot_add_section(sb, rw ?
+					IO_LATENCY_SECT_SIZE_LATENCY_WRITE :
+					IO_LATENCY_SECT_SIZE_LATENCY_READ,
+					i, LAT_LOG2_NR);
+			memcpy(val, counts[i], sizeof(u64) * LAT_LOG2_NR);
+		}
 	}
+	vfree(counts);
+
+	file->private_data = sb;
+	return 0;
 }
 
-static void io_read_size_show(struct seq_file *seq,
-				struct latency_stats __percpu *lstats)
+static const proc_fops_t proc_size_latency_bin_fops =
+	PROC_FOPS_INIT(proc_size_latency_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+/* rings only take memory once somebody reads them */
+static struct outlier_ring *get_outlier_ring(struct request_queue_aux *aux)
 {
-	int slot_base = 0;
-	int i, cpu;
-	unsigned long sum;
+	struct outlier_ring *ring;
+
+	mutex_lock(&aux_mutex);
+	if (!aux->outliers) {
+		ring = outlier_ring_create(outlier_ring_size);
+		/* the hooks see the ring only once it is set up */
+		smp_wmb();
+		aux->outliers = ring;
+	}
+	mutex_unlock(&aux_mutex);
+	return aux->outliers;
+}
 
-	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
-		sum = 0;
-		for_each_possible_cpu(cpu)
-			sum += per_cpu_ptr(lstats, cpu)->io_read_size_stats[i];
+/* outliers.bin: the slow I/Os logged since the previous read */
+static int proc_outliers_bin_open(struct inode *inode, struct file *file)
+{
+	struct request_queue_aux *aux;
+	struct outlier_ring *ring;
+	struct io_latency_outlier *out;
+	struct snapshot_buf *sb;
+	u64 dropped = 0, *val;
+	int nr;
 
-		seq_printf(seq,
-			"%d-%d(KB):%lu\n",
-			(slot_base / KB),
-			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
-			sum);
-		slot_base += IO_SIZE_STATS_GRAINSIZE;
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	ring = get_outlier_ring(aux);
+	if (!ring)
+		return outlier_ring_size ? -ENOMEM : -ENODEV;
+
+	out = vmalloc(sizeof(struct io_latency_outlier) * ring->ring_size *
+			nr_cpu_ids);
+	if (!out)
+		return -ENOMEM;
+	nr = outlier_ring_consume(ring, out, &dropped);
+	sb = aux_snapshot_create(aux,
+			sizeof(struct io_latency_snapshot_header) +
+			SNAPSHOT_SECTION_SIZE(1) +
+			sizeof(struct io_latency_section) +
+			sizeof(struct io_latency_outlier) * nr);
+	if (!sb) {
+		vfree(out);
+		return -ENOMEM;
 	}
+	val = snapshot_add_section(sb, IO_LATENCY_SECT_OUTLIERS_DROPPED, 0, 1);
+	val[0] = dropped;
+	val = snapshot_add_section(sb, IO_LATENCY_SECT_OUTLIERS, 0,
+			nr * sizeof(struct io_latency_outlier) / sizeof(u64));
+	memcpy(val, out, sizeof(struct io_latency_outlier) * nr);
+	vfree(out);
+
+	file->private_data = sb;
+	return 0;
 }
 
-static void io_write_size_show(struct seq_file *seq,
-				struct latency_stats __percpu *lstats)
+static const proc_fops_t proc_outliers_bin_fops =
+	PROC_FOPS_INIT(proc_outliers_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
+
+/* outliers.mmap: the rings themselves, readers keep their own tails */
+static int proc_outliers_mmap_open(struct inode *inode, struct file *file)
 {
-	int slot_base = 0;
-	int i, cpu;
-	unsigned long sum;
+	struct request_queue_aux *aux;
 
-	for (i = 0; i < IO_SIZE_STATS_NR; i++) {
-		sum = 0;
-		for_each_possible_cpu(cpu)
-			sum += per_cpu_ptr(lstats, cpu)->io_write_size_stats[i];
+	aux = get_aux(PDE_DATA(inode));
+	if (!aux || !aux->lstats)
+		return -ENODEV;
+	if (!get_outlier_ring(aux))
+		return outlier_ring_size ? -ENOMEM : -ENODEV;
 
-		seq_printf(seq,
-			"%d-%d(KB):%lu\n",
-			(slot_base / KB),
-			(slot_base + IO_SIZE_STATS_GRAINSIZE - 1) / KB,
-			sum);
-		slot_base += IO_SIZE_STATS_GRAINSIZE;
-	}
+	file->private_data = aux;
+	return 0;
 }
 
-PROC_SHOW(soft_io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, soft_latency_stats_us);
-PROC_SHOW(soft_io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, soft_latency_stats_ms);
-PROC_SHOW(soft_io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, soft_latency_stats_s);
-
-PROC_SHOW(soft_read_io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, soft_latency_read_stats_us);
-PROC_SHOW(soft_read_io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, soft_latency_read_stats_ms);
-PROC_SHOW(soft_read_io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, soft_latency_read_stats_s);
-
-PROC_SHOW(soft_write_io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, soft_latency_write_stats_us);
-PROC_SHOW(soft_write_io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, soft_latency_write_stats_ms);
-PROC_SHOW(soft_write_io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, soft_latency_write_stats_s);
-
-PROC_SHOW(io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, latency_stats_us);
-PROC_SHOW(io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, latency_stats_ms);
-PROC_SHOW(io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, latency_stats_s);
-
-PROC_SHOW(read_io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, latency_read_stats_us);
-PROC_SHOW(read_io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, latency_read_stats_ms);
-PROC_SHOW(read_io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, latency_read_stats_s);
-
-PROC_SHOW(write_io_latency_us, "us", IO_LATENCY_STATS_US_NR,
-		IO_LATENCY_STATS_US_GRAINSIZE, latency_write_stats_us);
-PROC_SHOW(write_io_latency_ms, "ms", IO_LATENCY_STATS_MS_NR,
-		IO_LATENCY_STATS_MS_GRAINSIZE, latency_write_stats_ms);
-PROC_SHOW(write_io_latency_s, "s", IO_LATENCY_STATS_S_NR,
-		IO_LATENCY_STATS_S_GRAINSIZE, latency_write_stats_s);
+static int proc_outliers_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct request_queue_aux *aux = file->private_data;
 
-PROC_FOPS(io_size);
-PROC_FOPS(io_read_size);
-PROC_FOPS(io_write_size);
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	compat_vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, aux->outliers->region, vma->vm_pgoff);
+}
 
-PROC_FOPS(soft_io_latency_us);
-PROC_FOPS(soft_io_latency_ms);
-PROC_FOPS(soft_io_latency_s);
-PROC_FOPS(soft_read_io_latency_us);
-PROC_FOPS(soft_read_io_latency_ms);
-PROC_FOPS(soft_read_io_latency_s);
-PROC_FOPS(soft_write_io_latency_us);
-PROC_FOPS(soft_write_io_latency_ms);
-PROC_FOPS(soft_write_io_latency_s);
+static const proc_fops_t proc_outliers_mmap_fops =
+	PROC_FOPS_INIT(proc_outliers_mmap_open, NULL, NULL,
+			NULL, NULL, proc_outliers_mmap);
 
-PROC_FOPS(io_latency_us);
-PROC_FOPS(io_latency_ms);
-PROC_FOPS(io_latency_s);
-PROC_FOPS(read_io_latency_us);
-PROC_FOPS(read_io_latency_ms);
-PROC_FOPS(read_io_latency_s);
-PROC_FOPS(write_io_latency_us);
-PROC_FOPS(write_io_latency_ms);
-PROC_FOPS(write_io_latency_s);
+/*
+ * small control files: show_<name>() prints the current value and
+ * store_<name>() handles a write, both get the data of the proc entry
+ */
+#define PROC_ATTR(_name)						\
+static int _name##_attr_show(struct seq_file *seq, void *v)		\
+{									\
+	return show_##_name(seq, seq->private);				\
+}									\
+									\
+static int proc_##_name##_open(struct inode *inode, struct file *file)	\
+{									\
+	return single_open(file, _name##_attr_show, PDE_DATA(inode));	\
+}									\
+									\
+static ssize_t proc_##_name##_write(struct file *file,			\
+		const char __user *buffer, size_t count, loff_t *ppos)	\
+{									\
+	return store_##_name(file, buffer, count, file_pde_data(file));	\
+}									\
+									\
+static const proc_fops_t proc_##_name##_fops =				\
+	PROC_FOPS_INIT(proc_##_name##_open, seq_read,			\
+			proc_##_name##_write, seq_lseek,		\
+			single_release, NULL)
 
 #define ENABLE_ATTR(_name)						\
-static int show_##_name(char *page, char **start, off_t offset,		\
-					int count, int *eof, void *data)\
+static int show_##_name(struct seq_file *seq, void *data)		\
 {									\
 	struct request_queue_aux *aux;					\
-	int res = 0;							\
 									\
 	if (!data)							\
 		goto out;						\
@@ -588,15 +2414,15 @@ static int show_##_name(char *page, char **start, off_t offset,		\
 	if (!aux)							\
 		goto out;						\
 	if (aux->_name)							\
-		res = snprintf(page, count, "1\n");			\
+		seq_puts(seq, "1\n");					\
 	else								\
-		res = snprintf(page, count, "0\n");			\
+		seq_puts(seq, "0\n");					\
 out:									\
-	return res;							\
+	return 0;							\
 }									\
 									\
-static int store_##_name(struct file *file, const char __user *buffer,	\
-					unsigned long count, void *data)\
+static ssize_t store_##_name(struct file *file,				\
+		const char __user *buffer, size_t count, void *data)	\
 {									\
 	struct request_queue_aux *aux;					\
 	char *page = NULL;						\
@@ -621,141 +2447,973 @@ out:									\
 	if (page)							\
 		free_page((unsigned long)page);				\
 	return count;							\
+}									\
+PROC_ATTR(_name)
+
+ENABLE_ATTR(enable_latency);
+ENABLE_ATTR(enable_soft_latency);
+
+static int show_io_stats_reset(struct seq_file *seq, void *data)
+{
+	seq_puts(seq, "0\n");
+	return 0;
+}
+
+static ssize_t store_io_stats_reset(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+
+	if (count <= 0)
+		goto out;
+
+	aux = get_aux(data);
+	if (!aux)
+		goto out;
+
+	mutex_lock(&aux->base_lock);
+	reset_aux_stats(aux, NULL);
+	mutex_unlock(&aux->base_lock);
+
+out:
+	return count;
+}
+PROC_ATTR(io_stats_reset);
+
+/* top_offenders: processes with the largest latency sum, any write clears */
+static int show_top_offenders(struct seq_file *seq, void *data)
+{
+	static const char * const cols[] = { "sum", "mean", "max" };
+	struct request_queue_aux *aux;
+	struct top_entry *top;
+	int i, nr;
+
+	aux = get_aux(data);
+	if (!aux || !aux->top)
+		return 0;
+	top = kmalloc(sizeof(struct top_entry) * aux->top->n, GFP_KERNEL);
+	if (!top)
+		return -ENOMEM;
+	nr = top_n_read(aux->top, top);
+
+	seq_put_header(seq, "pid comm count", cols, ARRAY_SIZE(cols),
+			aux->latency_unit);
+	for (i = 0; i < nr; i++) {
+		seq_printf(seq, "%d %s %llu", top[i].pid, top[i].comm,
+				(unsigned long long)top[i].count);
+		seq_put_time(seq, top[i].sum, aux->latency_unit);
+		seq_put_time(seq, div64_u64(top[i].sum, top[i].count),
+				aux->latency_unit);
+		seq_put_time(seq, top[i].max, aux->latency_unit);
+		seq_putc(seq, '\n');
+	}
+	kfree(top);
+	return nr < 0 ? nr : 0;
+}
+
+static ssize_t store_top_offenders(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+
+	aux = get_aux(data);
+	if (aux)
+		top_n_clear(aux->top);
+	return count;
+}
+PROC_ATTR(top_offenders);
+
+/* outlier_threshold_us: I/Os at least this slow go to the outlier rings */
+static int show_outlier_threshold_us(struct seq_file *seq, void *data)
+{
+	struct request_queue_aux *aux;
+
+	aux = get_aux(data);
+	if (aux)
+		seq_printf(seq, "%llu\n", (unsigned long long)
+				div_u64(aux->outlier_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static ssize_t store_outlier_threshold_us(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+	char buf[24];
+	unsigned long us;
+
+	if (count <= 0 || count >= sizeof(buf))
+		return -EINVAL;
+	aux = get_aux(data);
+	if (!aux)
+		return -ENODEV;
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%lu", &us) != 1)
+		return -EINVAL;
+	aux->outlier_ns = (u64)us * NSEC_PER_USEC;
+	return count;
+}
+PROC_ATTR(outlier_threshold_us);
+
+/* sample_rate: about one I/O in this many is counted, 1 for all */
+static int show_sample_rate(struct seq_file *seq, void *data)
+{
+	struct request_queue_aux *aux;
+
+	aux = get_aux(data);
+	if (aux)
+		seq_printf(seq, "%u\n", aux->sample_rate);
+	return 0;
+}
+
+static ssize_t store_sample_rate(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+	char buf[16];
+	unsigned int rate;
+
+	if (count <= 0 || count >= sizeof(buf))
+		return -EINVAL;
+	aux = get_aux(data);
+	if (!aux)
+		return -ENODEV;
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%u", &rate) != 1 || !rate)
+		return -EINVAL;
+	aux->sample_rate = rate;
+	return count;
+}
+PROC_ATTR(sample_rate);
+
+/* TIME_UNIT_* named by what was written to a latency_unit file */
+static int parse_latency_unit(const char __user *buffer, size_t count)
+{
+	char buf[8], name[4];
+	int unit;
+
+	if (count <= 0 || count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%3s", name) != 1)
+		return -EINVAL;
+	for (unit = 0; unit < TIME_UNIT_NR; unit++) {
+		if (!strcmp(name, time_units[unit].name))
+			return unit;
+	}
+	return -EINVAL;
+}
+
+/* latency_unit: ns, us or ms, the unit of the summary files */
+static int show_latency_unit(struct seq_file *seq, void *data)
+{
+	struct request_queue_aux *aux;
+
+	aux = get_aux(data);
+	if (aux)
+		seq_printf(seq, "%s\n", time_units[aux->latency_unit].name);
+	return 0;
+}
+
+static ssize_t store_latency_unit(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+	int unit;
+
+	aux = get_aux(data);
+	if (!aux)
+		return -ENODEV;
+	unit = parse_latency_unit(buffer, count);
+	if (unit < 0)
+		return unit;
+	aux->latency_unit = unit;
+	return count;
+}
+PROC_ATTR(latency_unit);
+
+/* only names that are safe as a proc file name */
+static int cursor_name_valid(const char *name)
+{
+	if (!*name)
+		return 0;
+	for (; *name; name++) {
+		if (!isalnum(*name) && *name != '_' && *name != '-')
+			return 0;
+	}
+	return 1;
+}
+
+static struct io_cursor *find_cursor(struct request_queue_aux *aux,
+				const char *name)
+{
+	struct io_cursor *cursor;
+
+	list_for_each_entry(cursor, &aux->cursors, list) {
+		if (!strcmp(cursor->name, name))
+			return cursor;
+	}
+	return NULL;
+}
+
+static void free_cursor(struct io_cursor *cursor)
+{
+	destroy_latency_stats_sum(cursor->base);
+	kfree(cursor);
+}
+
+static int add_cursor(struct request_queue_aux *aux, const char *name)
+{
+	struct io_cursor *cursor, *pos;
+	int nr = 0, res = 0;
+
+	if (!cursor_name_valid(name))
+		return -EINVAL;
+	cursor = kzalloc(sizeof(struct io_cursor), GFP_KERNEL);
+	if (!cursor)
+		return -ENOMEM;
+	strncpy(cursor->name, name, CURSOR_NAME_LEN - 1);
+	cursor->aux = aux;
+
+	mutex_lock(&cursor_mutex);
+	list_for_each_entry(pos, &aux->cursors, list) {
+		if (!strcmp(pos->name, name))
+			res = -EEXIST;
+		nr++;
+	}
+	if (!res && nr >= MAX_CURSORS)
+		res = -ENOSPC;
+	if (res)
+		goto out;
+
+	/* the first read of a new cursor covers the time since it was added */
+	mutex_lock(&aux->base_lock);
+	res = advance_baseline(aux->lstats, &cursor->base, NULL);
+	mutex_unlock(&aux->base_lock);
+	if (res)
+		goto out;
+
+	if (!proc_create_data(cursor->name, S_IFREG, aux->cursor_dir,
+				&proc_cursor_fops, cursor)) {
+		res = -ENOMEM;
+		goto out;
+	}
+	list_add_tail(&cursor->list, &aux->cursors);
+out:
+	mutex_unlock(&cursor_mutex);
+	if (res)
+		free_cursor(cursor);
+	return res;
+}
+
+/* must be called with cursor_mutex held */
+static void __del_cursor(struct io_cursor *cursor)
+{
+	list_del(&cursor->list);
+	/* waits for readers still in proc_cursor_open() */
+	remove_proc_entry(cursor->name, cursor->aux->cursor_dir);
+	free_cursor(cursor);
+}
+
+static int del_cursor(struct request_queue_aux *aux, const char *name)
+{
+	struct io_cursor *cursor;
+	int res = 0;
+
+	mutex_lock(&cursor_mutex);
+	cursor = find_cursor(aux, name);
+	if (cursor)
+		__del_cursor(cursor);
+	else
+		res = -ENOENT;
+	mutex_unlock(&cursor_mutex);
+	return res;
+}
+
+static void del_all_cursors(struct request_queue_aux *aux)
+{
+	struct io_cursor *cursor, *tmp;
+
+	mutex_lock(&cursor_mutex);
+	list_for_each_entry_safe(cursor, tmp, &aux->cursors, list)
+		__del_cursor(cursor);
+	mutex_unlock(&cursor_mutex);
+}
+
+/* 'cursors' lives in the cursor/ directory, whose data is the queue */
+static int show_cursors(struct seq_file *seq, void *data)
+{
+	struct request_queue_aux *aux;
+	struct io_cursor *cursor;
+
+	aux = get_aux(data);
+	if (!aux)
+		return 0;
+	mutex_lock(&cursor_mutex);
+	list_for_each_entry(cursor, &aux->cursors, list)
+		seq_printf(seq, "%s\n", cursor->name);
+	mutex_unlock(&cursor_mutex);
+	return 0;
+}
+
+/* "add <name>" creates cursor/<name>, "del <name>" removes it */
+static ssize_t store_cursors(struct file *file, const char __user *buffer,
+				size_t count, void *data)
+{
+	struct request_queue_aux *aux;
+	char cmd[CURSOR_NAME_LEN + 8], name[CURSOR_NAME_LEN];
+	int res;
+
+	if (count <= 0 || count >= sizeof(cmd))
+		return -EINVAL;
+	aux = get_aux(data);
+	if (!aux || !aux->cursor_dir)
+		return -ENODEV;
+	if (copy_from_user(cmd, buffer, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	/* 31 is CURSOR_NAME_LEN - 1 */
+	if (sscanf(cmd, "add %31s", name) == 1)
+		res = add_cursor(aux, name);
+	else if (sscanf(cmd, "del %31s", name) == 1)
+		res = del_cursor(aux, name);
+	else
+		res = -EINVAL;
+	return res ? res : count;
+}
+PROC_ATTR(cursors);
+
+/* the files of an aggregate or a partition get its lstats_dir as data */
+static struct latency_stats_sum *get_dir_stats(struct lstats_dir *dir)
+{
+	struct latency_stats_sum *sum;
+
+	sum = create_latency_stats_sum();
+	if (sum)
+		fold_latency_stats_current(dir->lstats, sum);
+	return sum;
+}
+
+#define DIR_FOPS(_name)							\
+static int dir_##_name##_seq_show(struct seq_file *seq, void *v)	\
+{									\
+	struct lstats_dir *dir = seq->private;				\
+	struct latency_stats_sum *stats;				\
+									\
+	stats = get_dir_stats(dir);					\
+	if (!stats)							\
+		return -ENOMEM;						\
+	_name##_show(seq, stats, ACCESS_ONCE(*dir->unit));		\
+	destroy_latency_stats_sum(stats);				\
+	return 0;							\
+}									\
+									\
+static int proc_dir_##_name##_open(struct inode *inode,		\
+				struct file *file)			\
+{									\
+	return single_open(file, dir_##_name##_seq_show,		\
+			PDE_DATA(inode));				\
+}									\
+									\
+static const proc_fops_t proc_dir_##_name##_fops =			\
+	PROC_FOPS_INIT(proc_dir_##_name##_open, seq_read, NULL,	\
+			seq_lseek, single_release, NULL)
+
+DIR_FOPS(percentiles);
+DIR_FOPS(qd_latency);
+DIR_FOPS(io_size);
+DIR_FOPS(io_read_size);
+DIR_FOPS(io_write_size);
+
+static int proc_dir_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct lstats_dir *dir = PDE_DATA(inode);
+	struct latency_stats_sum *sum;
+	struct snapshot_buf *sb;
+
+	sum = get_dir_stats(dir);
+	if (!sum)
+		return -ENOMEM;
+	sb = snapshot_create(latency_stats_snapshot_size(), NULL);
+	if (!sb) {
+		destroy_latency_stats_sum(sum);
+		return -ENOMEM;
+	}
+	snapshot_set_name(sb, dir->name);
+	snapshot_add_latency_stats(sb, sum);
+	destroy_latency_stats_sum(sum);
+	file->private_data = sb;
+	return 0;
 }
 
-ENABLE_ATTR(enable_latency);
-ENABLE_ATTR(enable_soft_latency);
+static const proc_fops_t proc_dir_stats_bin_fops =
+	PROC_FOPS_INIT(proc_dir_stats_bin_open, proc_snapshot_read, NULL,
+			default_llseek, proc_snapshot_release, NULL);
 
-static int show_io_stats_reset(char *page, char **start, off_t offset,
-					int count, int *eof, void *data)
+static int show_dir_io_stats_reset(struct seq_file *seq, void *data)
 {
-	return snprintf(page, count, "0\n");
+	seq_puts(seq, "0\n");
+	return 0;
 }
 
-static int store_io_stats_reset(struct file *file, const char __user *buffer,
-					unsigned long count, void *data)
+/* resets the aggregate or partition only, not its disks */
+static ssize_t store_dir_io_stats_reset(struct file *file,
+		const char __user *buffer, size_t count, void *data)
 {
-	struct request_queue_aux *aux;
+	struct lstats_dir *dir = data;
 
-	if (count <= 0)
-		goto out;
+	if (count > 0)
+		reset_latency_stats(dir->lstats);
+	return count;
+}
+PROC_ATTR(dir_io_stats_reset);
 
-	aux = get_aux(data);
-	if (!aux)
-		goto out;
+static int show_dir_latency_unit(struct seq_file *seq, void *data)
+{
+	struct lstats_dir *dir = data;
 
-	reset_latency_stats(aux->lstats);
+	seq_printf(seq, "%s\n", time_units[*dir->unit].name);
+	return 0;
+}
 
-out:
+static ssize_t store_dir_latency_unit(struct file *file,
+		const char __user *buffer, size_t count, void *data)
+{
+	struct lstats_dir *dir = data;
+	int unit;
+
+	unit = parse_latency_unit(buffer, count);
+	if (unit < 0)
+		return unit;
+	*dir->unit = unit;
 	return count;
 }
+PROC_ATTR(dir_latency_unit);
+
+/* disks: the disks counted into the aggregate */
+static int agg_disks_seq_show(struct seq_file *seq, void *v)
+{
+	struct lstats_dir *dir = seq->private;
+	struct agg_stats *agg = container_of(dir, struct agg_stats, dir);
+	struct request_queue_aux *aux;
+
+	mutex_lock(&aux_mutex);
+	list_for_each_entry(aux, &aux_list, list) {
+		if (agg == all_agg || agg == aux->host_agg)
+			seq_printf(seq, "%s\n", aux->disk->disk_name);
+	}
+	mutex_unlock(&aux_mutex);
+	return 0;
+}
+
+static int proc_agg_disks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, agg_disks_seq_show, PDE_DATA(inode));
+}
+
+static const proc_fops_t proc_agg_disks_fops =
+	PROC_FOPS_INIT(proc_agg_disks_open, seq_read, NULL,
+			seq_lseek, single_release, NULL);
+
+/* overhead: what every hook costs, over all disks and CPUs */
+static int overhead_seq_show(struct seq_file *seq, void *v)
+{
+	struct hook_counters sum;
+	u64 timed;
+	int hook, i;
+
+	seq_puts(seq, "hook calls misses drops timed mean(ns)\n");
+	for (hook = 0; hook < NR_HOOKS; hook++) {
+		hook_stats_fold(hook_stats, hook, &sum);
+		timed = sum.count[HOOK_TIMED];
+		seq_printf(seq, "%s %llu %llu %llu %llu", hook_name(hook),
+				(unsigned long long)sum.count[HOOK_CALLS],
+				(unsigned long long)sum.count[HOOK_MISSES],
+				(unsigned long long)sum.count[HOOK_DROPS],
+				(unsigned long long)timed);
+		seq_printf(seq, " %llu\n", (unsigned long long)
+				(timed ? div64_u64(sum.ns, timed) : 0));
+	}
+
+	/* the timed calls by ns spent in the hook */
+	seq_puts(seq, "\nhook");
+	for (i = 0; i < HOOK_HIST_NR - 1; i++)
+		seq_printf(seq, " <%u", 1U << (i + HOOK_HIST_SHIFT));
+	seq_printf(seq, " >=%u\n", 1U << (i + HOOK_HIST_SHIFT - 1));
+	for (hook = 0; hook < NR_HOOKS; hook++) {
+		hook_stats_fold(hook_stats, hook, &sum);
+		seq_puts(seq, hook_name(hook));
+		for (i = 0; i < HOOK_HIST_NR; i++)
+			seq_printf(seq, " %llu",
+					(unsigned long long)sum.hist[i]);
+		seq_putc(seq, '\n');
+	}
+	return 0;
+}
+
+static int proc_overhead_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, overhead_seq_show, NULL);
+}
+
+static const proc_fops_t proc_overhead_fops =
+	PROC_FOPS_INIT(proc_overhead_open, seq_read, NULL,
+			seq_lseek, single_release, NULL);
 
 struct io_latency_proc_node {
 	char *name;
-	const struct file_operations *fops;
+	const proc_fops_t *fops;
 };
 
 static const struct io_latency_proc_node proc_node_list[] = {
+	{ "io_latency_us", &proc_io_latency_us_fops},
 	{ "io_latency_ms", &proc_io_latency_ms_fops},
 	{ "io_latency_s", &proc_io_latency_s_fops},
 
+	{ "read_io_latency_us", &proc_read_io_latency_us_fops},
 	{ "read_io_latency_ms", &proc_read_io_latency_ms_fops},
 	{ "read_io_latency_s", &proc_read_io_latency_s_fops},
 
+	{ "write_io_latency_us", &proc_write_io_latency_us_fops},
 	{ "write_io_latency_ms", &proc_write_io_latency_ms_fops},
 	{ "write_io_latency_s", &proc_write_io_latency_s_fops},
 
+	{ "soft_io_latency_us", &proc_soft_io_latency_us_fops},
 	{ "soft_io_latency_ms", &proc_soft_io_latency_ms_fops},
 	{ "soft_io_latency_s", &proc_soft_io_latency_s_fops},
 
+	{ "soft_read_io_latency_us", &proc_soft_read_io_latency_us_fops},
 	{ "soft_read_io_latency_ms", &proc_soft_read_io_latency_ms_fops},
 	{ "soft_read_io_latency_s", &proc_soft_read_io_latency_s_fops},
 
+	{ "soft_write_io_latency_us", &proc_soft_write_io_latency_us_fops},
 	{ "soft_write_io_latency_ms", &proc_soft_write_io_latency_ms_fops},
 	{ "soft_write_io_latency_s", &proc_soft_write_io_latency_s_fops},
 
 	{ "io_size", &proc_io_size_fops},
 	{ "io_read_size", &proc_io_read_size_fops},
 	{ "io_write_size", &proc_io_write_size_fops},
-#ifdef USE_US
-	{ "io_latency_us", &proc_io_latency_us_fops},
-	{ "read_io_latency_us", &proc_read_io_latency_us_fops},
-	{ "write_io_latency_us", &proc_write_io_latency_us_fops},
-	{ "soft_io_latency_us", &proc_soft_io_latency_us_fops},
-	{ "soft_read_io_latency_us", &proc_soft_read_io_latency_us_fops},
-	{ "soft_write_io_latency_us", &proc_soft_write_io_latency_us_fops},
-#endif
+
+	{ "percentiles", &proc_percentiles_fops},
+	{ "qd_latency", &proc_qd_latency_fops},
+	{ "stats.bin", &proc_stats_bin_fops},
+	{ "stats_reset.bin", &proc_stats_reset_bin_fops},
+	{ "stats.mmap", &proc_stats_mmap_fops},
+	{ "window_percentiles", &proc_window_percentiles_fops},
+	{ "windows.bin", &proc_windows_bin_fops},
+	{ "cgroups", &proc_cgroups_fops},
+	{ "top_offenders", &proc_top_offenders_fops},
+	{ "heatmap.bin", &proc_heatmap_bin_fops},
+	{ "size_latency.bin", &proc_size_latency_bin_fops},
+	{ "outliers.bin", &proc_outliers_bin_fops},
+	{ "outliers.mmap", &proc_outliers_mmap_fops},
+	{ "outlier_threshold_us", &proc_outlier_threshold_us_fops},
+	{ "sample_rate", &proc_sample_rate_fops},
+	{ "latency_unit", &proc_latency_unit_fops},
+
+	{ "io_stats_reset", &proc_io_stats_reset_fops},
+	{ "enable_latency", &proc_enable_latency_fops},
+	{ "enable_soft_latency", &proc_enable_soft_latency_fops},
 };
 
 #define PROC_NUM (sizeof(proc_node_list) / sizeof(struct io_latency_proc_node))
-#define DIR_PROC_NUM (MAX_REQUEST_QUEUE * (PROC_NUM + 3))
 
-static void add_proc_node(const char *name, struct proc_dir_entry *node,
-			struct proc_dir_entry *parent)
+/* undo insert_procfs(), also after it failed half way */
+static void remove_procfs(struct request_queue_aux *aux)
 {
-	if (nr_dir_proc < DIR_PROC_NUM) {
-		dir_proc_list[nr_dir_proc].entry = node;
-		dir_proc_list[nr_dir_proc].parent = parent;
-		strncpy(dir_proc_list[nr_dir_proc].name, name, 64);
-		nr_dir_proc++;
+	struct proc_dir_entry *proc_dir = aux->proc_dir;
+	int i;
+
+	if (!proc_dir)
+		return;
+	if (aux->cursor_dir) {
+		/* no cursor can be added once 'cursors' is gone */
+		remove_proc_entry("cursors", aux->cursor_dir);
+		del_all_cursors(aux);
+		remove_proc_entry("cursor", proc_dir);
+		aux->cursor_dir = NULL;
 	}
+	for (i = aux->nr_proc - 1; i >= 0; i--)
+		remove_proc_entry(proc_node_list[i].name, proc_dir);
+	aux->nr_proc = 0;
+	remove_proc_entry(aux->disk->disk_name, proc_io_latency);
+	aux->proc_dir = NULL;
 }
 
-static void delete_procfs(void);
-
-static int insert_procfs(struct scsi_disk *sd)
+/* called after insert_aux(), the proc files look the aux up by queue */
+static int insert_procfs(struct request_queue_aux *aux)
 {
-	struct proc_dir_entry *proc_node, *proc_dir;
-	int i;
+	struct gendisk *disk = aux->disk;
+	struct proc_dir_entry *proc_dir, *cursor_dir;
 
-	proc_dir = proc_mkdir(sd->disk->disk_name, proc_io_latency);
+	proc_dir = proc_mkdir(disk->disk_name, proc_io_latency);
 	if (!proc_dir)
 		goto err;
-	add_proc_node(sd->disk->disk_name, proc_dir, proc_io_latency);
+	aux->proc_dir = proc_dir;
 
-	for (i = 0; i < PROC_NUM; i++) {
-		proc_node = proc_create_data(proc_node_list[i].name,
+	for (; aux->nr_proc < PROC_NUM; aux->nr_proc++) {
+		if (!proc_create_data(proc_node_list[aux->nr_proc].name,
 					S_IFREG, proc_dir,
-					proc_node_list[i].fops,
-					sd->device->request_queue);
-		if (!proc_node)
+					proc_node_list[aux->nr_proc].fops,
+					disk->queue))
 			goto err;
-		add_proc_node(proc_node_list[i].name, proc_node,
-				proc_dir);
-	}
-	/* create io_stats_reset */
-	proc_node = proc_create_data("io_stats_reset", S_IFREG,
-				proc_dir, NULL,
-				sd->device->request_queue);
-	if (!proc_node)
+	}
+	/* create cursor/ and its control file */
+	cursor_dir = proc_mkdir("cursor", proc_dir);
+	if (!cursor_dir)
+		goto err;
+	if (!proc_create_data("cursors", S_IFREG, cursor_dir,
+				&proc_cursors_fops, disk->queue)) {
+		remove_proc_entry("cursor", proc_dir);
 		goto err;
-	proc_node->read_proc = show_io_stats_reset;
-	proc_node->write_proc = store_io_stats_reset;
-	add_proc_node("io_stats_reset", proc_node, proc_dir);
-	/* create enable_latency */
-	proc_node = proc_create_data("enable_latency", S_IFREG,
-				proc_dir, NULL,
-				sd->device->request_queue);
-	if (!proc_node)
+	}
+	aux->cursor_dir = cursor_dir;
+	return 0;
+err:
+	remove_procfs(aux);
+	return -ENOMEM;
+}
+
+static const struct io_latency_proc_node agg_node_list[] = {
+	{ "percentiles", &proc_dir_percentiles_fops},
+	{ "qd_latency", &proc_dir_qd_latency_fops},
+	{ "io_size", &proc_dir_io_size_fops},
+	{ "io_read_size", &proc_dir_io_read_size_fops},
+	{ "io_write_size", &proc_dir_io_write_size_fops},
+	{ "stats.bin", &proc_dir_stats_bin_fops},
+	{ "disks", &proc_agg_disks_fops},
+	{ "latency_unit", &proc_dir_latency_unit_fops},
+	{ "io_stats_reset", &proc_dir_io_stats_reset_fops},
+};
+
+#define AGG_PROC_NUM	ARRAY_SIZE(agg_node_list)
+
+static const struct io_latency_proc_node part_node_list[] = {
+	{ "percentiles", &proc_dir_percentiles_fops},
+	{ "qd_latency", &proc_dir_qd_latency_fops},
+	{ "io_size", &proc_dir_io_size_fops},
+	{ "io_read_size", &proc_dir_io_read_size_fops},
+	{ "io_write_size", &proc_dir_io_write_size_fops},
+	{ "stats.bin", &proc_dir_stats_bin_fops},
+	{ "io_stats_reset", &proc_dir_io_stats_reset_fops},
+};
+
+#define PART_PROC_NUM	ARRAY_SIZE(part_node_list)
+
+/* the hooks may still count into it after this */
+static void remove_lstats_dir(struct lstats_dir *dir,
+			const struct io_latency_proc_node *nodes)
+{
+	int i;
+
+	if (!dir->proc_dir)
+		return;
+	for (i = dir->nr_proc - 1; i >= 0; i--)
+		remove_proc_entry(nodes[i].name, dir->proc_dir);
+	dir->nr_proc = 0;
+	remove_proc_entry(dir->name, dir->parent);
+	dir->proc_dir = NULL;
+}
+
+/* undo create_lstats_dir(), also after it failed half way */
+static void destroy_lstats_dir(struct lstats_dir *dir,
+			const struct io_latency_proc_node *nodes)
+{
+	remove_lstats_dir(dir, nodes);
+	if (dir->lstats) {
+		destroy_latency_stats(dir->lstats);
+		dir->lstats = NULL;
+	}
+}
+
+/* 'dir->name' is set, creates its stats and <parent>/<name>/ */
+static int create_lstats_dir(struct lstats_dir *dir,
+			struct proc_dir_entry *parent,
+			const struct io_latency_proc_node *nodes, int nr)
+{
+	dir->lstats = create_latency_stats(soft_latency);
+	if (!dir->lstats)
 		goto err;
-	proc_node->read_proc = show_enable_latency;
-	proc_node->write_proc = store_enable_latency;
-	add_proc_node("enable_latency", proc_node, proc_dir);
-	/* create enable_soft_latency */
-	proc_node = proc_create_data("enable_soft_latency", S_IFREG,
-				proc_dir, NULL,
-				sd->device->request_queue);
-	if (!proc_node)
+	dir->parent = parent;
+	dir->proc_dir = proc_mkdir(dir->name, parent);
+	if (!dir->proc_dir)
 		goto err;
-	proc_node->read_proc = show_enable_soft_latency;
-	proc_node->write_proc = store_enable_soft_latency;
-	add_proc_node("enable_soft_latency", proc_node, proc_dir);
+	for (; dir->nr_proc < nr; dir->nr_proc++) {
+		if (!proc_create_data(nodes[dir->nr_proc].name, S_IFREG,
+					dir->proc_dir, nodes[dir->nr_proc].fops,
+					dir))
+			goto err;
+	}
 	return 0;
 err:
+	destroy_lstats_dir(dir, nodes);
+	return -ENOMEM;
+}
+
+static void destroy_agg(struct agg_stats *agg)
+{
+	destroy_lstats_dir(&agg->dir, agg_node_list);
+	kfree(agg);
+}
+
+static struct agg_stats *create_agg(int host)
+{
+	struct agg_stats *agg;
+
+	agg = kzalloc(sizeof(struct agg_stats), GFP_KERNEL);
+	if (!agg)
+		return NULL;
+	agg->host = host;
+	if (host == AGG_ALL)
+		strcpy(agg->dir.name, "all");
+	else
+		snprintf(agg->dir.name, LSTATS_DIR_NAME_LEN, "host%d", host);
+	agg->dir.latency_unit = TIME_UNIT_US;
+	agg->dir.unit = &agg->dir.latency_unit;
+	if (create_lstats_dir(&agg->dir, proc_io_latency, agg_node_list,
+				AGG_PROC_NUM)) {
+		kfree(agg);
+		return NULL;
+	}
+	return agg;
+}
+
+/* number of the Scsi_Host a disk hangs off, -1 if it is not SCSI */
+static int disk_scsi_host(struct gendisk *disk)
+{
+	struct device *dev;
+	unsigned int host;
+	char c;
+
+	for (dev = disk_to_dev(disk)->parent; dev; dev = dev->parent) {
+		if (sscanf(dev_name(dev), "host%u%c", &host, &c) == 1)
+			return host;
+	}
 	return -1;
 }
 
-static struct request_queue_aux *insert_aux(struct scsi_disk *sd)
+/* aggregate of the host of 'disk', created with its first disk */
+static struct agg_stats *get_host_agg(struct gendisk *disk)
+{
+	struct agg_stats *agg;
+	int host;
+
+	if (!aggregates)
+		return NULL;
+	host = disk_scsi_host(disk);
+	if (host < 0)
+		return NULL;
+
+	mutex_lock(&agg_mutex);
+	list_for_each_entry(agg, &agg_list, list) {
+		if (agg->host == host)
+			goto found;
+	}
+	agg = create_agg(host);
+	if (!agg)
+		goto out;
+	list_add_tail(&agg->list, &agg_list);
+found:
+	agg->nr_disks++;
+out:
+	mutex_unlock(&agg_mutex);
+	return agg;
+}
+
+/* no hook may use 'agg' through its disk any more */
+static void put_host_agg(struct agg_stats *agg)
+{
+	if (!agg)
+		return;
+	mutex_lock(&agg_mutex);
+	if (--agg->nr_disks == 0)
+		list_del(&agg->list);
+	else
+		agg = NULL;
+	mutex_unlock(&agg_mutex);
+	if (agg)
+		destroy_agg(agg);
+}
+
+/* wait until no hook can still be using an aux it looked up */
+static void wait_for_hooks(void)
+{
+#ifdef USE_TRACEPOINT
+	tracepoint_synchronize_unregister();
+#else
+	/* the hooks never sleep between get_aux() and the last use of it */
+	synchronize_sched();
+#endif
+}
+
+static void free_part(struct part_stats *part)
+{
+	destroy_lstats_dir(&part->dir, part_node_list);
+	kfree(part);
+}
+
+static void free_part_table_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct part_table, rcu));
+}
+
+/* the disk of 'info' if it is watched, NULL if skipped or not added */
+static struct request_queue_aux *part_aux(struct compat_part_info *info)
+{
+	struct request_queue_aux *aux;
+
+	if (!info->disk->queue)
+		return NULL;
+	aux = get_aux(info->disk->queue);
+	/* the queue may belong to another disk */
+	if (!aux || aux->disk != info->disk)
+		return NULL;
+	return aux;
+}
+
+/* the partition 'dev' was added, after its disk */
+static void insert_part(struct device *dev)
+{
+	struct compat_part_info info;
+	struct request_queue_aux *aux;
+	struct part_table *old, *table;
+	struct part_stats *part;
+	int partno, i, nr = 0;
+
+	if (!partitions)
+		return;
+	partno = compat_dev_to_part(dev, &info);
+	aux = part_aux(&info);
+	if (!partno || !info.nr_sects || !aux || !aux->proc_dir)
+		return;
+
+	part = kzalloc(sizeof(struct part_stats), GFP_KERNEL);
+	if (!part)
+		goto err;
+	part->partno = partno;
+	part->start = info.start;
+	part->end = info.start + info.nr_sects;
+	snprintf(part->dir.name, LSTATS_DIR_NAME_LEN, "%s", dev_name(dev));
+	/* the aux outlives its partitions, see remove_aux() */
+	part->dir.unit = &aux->latency_unit;
+	if (create_lstats_dir(&part->dir, aux->proc_dir, part_node_list,
+				PART_PROC_NUM)) {
+		kfree(part);
+		goto err;
+	}
+
+	old = aux->parts;
+	table = kmalloc(sizeof(struct part_table) + sizeof(part) *
+			((old ? old->nr : 0) + 1), GFP_KERNEL);
+	if (!table) {
+		free_part(part);
+		goto err;
+	}
+	for (i = 0; old && i < old->nr && old->parts[i]->start < part->start;
+			i++)
+		table->parts[nr++] = old->parts[i];
+	table->parts[nr++] = part;
+	for (; old && i < old->nr; i++)
+		table->parts[nr++] = old->parts[i];
+	table->nr = nr;
+	rcu_assign_pointer(aux->parts, table);
+	if (old)
+		call_rcu(&old->rcu, free_part_table_rcu);
+	return;
+err:
+	printk(KERN_ERR "io-latency: can't create /proc for %s\n",
+			dev_name(dev));
+}
+
+/* the partition 'dev' is going away, before its disk */
+static void remove_part(struct device *dev)
+{
+	struct compat_part_info info;
+	struct request_queue_aux *aux;
+	struct part_table *table;
+	struct part_stats *part;
+	int partno, i;
+
+	partno = compat_dev_to_part(dev, &info);
+	aux = part_aux(&info);
+	if (!partno || !aux)
+		return;
+	table = aux->parts;
+	for (i = 0; table && i < table->nr; i++) {
+		if (table->parts[i]->partno == partno)
+			break;
+	}
+	if (!table || i == table->nr)
+		return;
+	part = table->parts[i];
+	remove_lstats_dir(&part->dir, part_node_list);
+	/*
+	 * close the gap in place, a hook bisecting meanwhile may miss a
+	 * partition for one I/O but every entry it reads stays valid
+	 */
+	for (; i < table->nr - 1; i++)
+		ACCESS_ONCE(table->parts[i]) = table->parts[i + 1];
+	ACCESS_ONCE(table->nr) = table->nr - 1;
+	wait_for_hooks();
+	free_part(part);
+}
+
+/* the disk is going away, its partitions may not have been removed yet */
+static void remove_parts_procfs(struct request_queue_aux *aux)
+{
+	struct part_table *table = aux->parts;
+	int i;
+
+	for (i = 0; table && i < table->nr; i++)
+		remove_lstats_dir(&table->parts[i]->dir, part_node_list);
+}
+
+/* no hook may use the partitions any more */
+static void free_parts(struct request_queue_aux *aux)
+{
+	struct part_table *table = aux->parts;
+	int i;
+
+	if (!table)
+		return;
+	rcu_assign_pointer(aux->parts, NULL);
+	for (i = 0; i < table->nr; i++)
+		free_part(table->parts[i]);
+	call_rcu(&table->rcu, free_part_table_rcu);
+}
+
+static void free_aux(struct request_queue_aux *aux)
+{
+	free_parts(aux);
+	shared_stats_destroy(aux->shared);
+	lat_windows_destroy(aux->windows);
+	cg_stats_destroy(aux->cgroups);
+	put_host_agg(aux->host_agg);
+	top_n_destroy(aux->top);
+	lba_heatmap_destroy(aux->heatmap);
+	size_lat_destroy(aux->size_lat);
+	outlier_ring_destroy(aux->outliers);
+#ifdef USE_TRACEPOINT
+	if (aux->bio_based)
+		atomic_dec(&nr_bio_based);
+#endif
+#ifdef USE_HASH_TABLE
+	if (aux->hash_table)
+		destroy_hash_table(aux->hash_table);
+#endif
+	if (aux->lstats)
+		destroy_latency_stats(aux->lstats);
+	kmem_cache_free(request_table_aux_cache, aux);
+}
+
+static struct request_queue_aux *insert_aux(struct gendisk *disk)
 {
 	struct request_queue_aux *aux;
 	struct latency_stats __percpu *lstats;
@@ -764,12 +3422,12 @@ static struct request_queue_aux *insert_aux(struct scsi_disk *sd)
 	struct hash_table *request_table = NULL;
 #endif
 
-	lstats = create_latency_stats();
+	lstats = create_latency_stats(soft_latency);
 	if (!lstats)
 		goto err;
 
 #ifdef USE_HASH_TABLE
-	sprintf(table_name, "htable-%s", sd->disk->sdev_gendev->disk_name);
+	sprintf(table_name, "htable-%s", disk->disk_name);
 	request_table = create_hash_table(table_name, MAX_REQUESTS);
 	if (!request_table)
 		goto err;
@@ -785,14 +3443,55 @@ static struct request_queue_aux *insert_aux(struct scsi_disk *sd)
 			request_table_aux_cache, GFP_KERNEL);
 	if (!aux)
 		goto err;
-	sd->device->request_queue->pad = aux;
 #endif
 	aux->lstats = lstats;
+	aux->disk = disk;
+	mutex_init(&aux->base_lock);
+	INIT_LIST_HEAD(&aux->cursors);
+	aux->cgroups = cg_stats_create(max_cgroups, soft_latency);
+	aux->host_agg = get_host_agg(disk);
+	aux->top = top_n_create(top_n);
+	aux->heatmap = lba_heatmap_create(get_capacity(disk), heatmap_zone_mb);
+	if (size_latency)
+		aux->size_lat = size_lat_create();
+	aux->outlier_ns = (u64)OUTLIER_THRESHOLD_US * NSEC_PER_USEC;
+	aux->sample_rate = max(sample_rate, 1U);
+	aux->latency_unit = TIME_UNIT_US;
+#ifdef USE_TRACEPOINT
+	aux->start_ns = ktime_get_ns();
+	/* dm may make its queue request based later, it then stays counted */
+	aux->bio_based = compat_queue_is_bio_based(disk->queue);
+	if (aux->bio_based)
+		atomic_inc(&nr_bio_based);
+#endif
 	aux->enable_latency = 1;
-	aux->enable_soft_latency = 1;
-	hash_table_insert(request_queue_table,
-			(unsigned long)(sd->device->request_queue),
-			(unsigned long)aux);
+	aux->enable_soft_latency = soft_latency ? 1 : 0;
+	/* some drivers share one queue between several disks */
+	if (hash_table_insert(request_queue_table,
+			(unsigned long)disk->queue, (unsigned long)aux)) {
+		free_aux(aux);
+		return NULL;
+	}
+	mutex_lock(&aux_mutex);
+	list_add_tail(&aux->list, &aux_list);
+	mutex_unlock(&aux_mutex);
+#ifdef USE_TRACEPOINT
+	/*
+	 * blk-mq only stamps rq->io_start_time_ns while QUEUE_FLAG_STATS is
+	 * set.  Other stats users (wbt, iolatency) clear it when their last
+	 * callback goes unless accounting is enabled, which keeps it set for
+	 * good: there is no call to disable accounting again, so it stays
+	 * on after unload.  Without the symbol the flag is set directly and
+	 * may be cleared under us.
+	 */
+	if (p_blk_stat_enable_accounting)
+		p_blk_stat_enable_accounting(disk->queue);
+	else
+		blk_queue_flag_set(QUEUE_FLAG_STATS, disk->queue);
+#endif
+#ifndef AUX_IN_TABLE
+	disk->queue->pad = aux;
+#endif
 	return aux;
 err:
 	if (lstats)
@@ -800,116 +3499,198 @@ err:
 	return NULL;
 }
 
-static int create_procfs(void)
+static void remove_aux(struct request_queue_aux *aux)
 {
-	struct class_dev_iter iter;
-	struct device *dev;
-	struct scsi_disk *sd;
-	struct request_queue_aux *aux;
+	struct request_queue *q = aux->disk->queue;
+
+	remove_parts_procfs(aux);
+	remove_procfs(aux);
+	mutex_lock(&aux_mutex);
+	list_del(&aux->list);
+	mutex_unlock(&aux_mutex);
+	hash_table_remove(request_queue_table, (unsigned long)q);
+#ifndef AUX_IN_TABLE
+	q->pad = NULL;
+#endif
+	wait_for_hooks();
+	free_aux(aux);
+}
 
-	proc_io_latency = proc_mkdir("io-latency", NULL);
-	if (!proc_io_latency)
-		goto err;
+static int skip_disk(struct gendisk *disk)
+{
+	const char *p = skip_disks;
+	int len;
+
+	while (p && *p) {
+		len = strcspn(p, ",");
+		if (len && !strncmp(disk->disk_name, p, len))
+			return 1;
+		p += len;
+		if (*p)
+			p++;
+	}
+	return 0;
+}
 
-	/* proc_node in proc_node_list and
-	 * 'io_stats_reset' 'enable_latency' 'enable_soft_latency'
-	 */
-	dir_proc_list = kzalloc(sizeof(struct proc_entry_name) * DIR_PROC_NUM,
-			GFP_KERNEL);
-	if (!dir_proc_list)
-		goto err;
+/*
+ * hot-plug: the block class calls these for every disk and partition
+ * already registered, then for each one added or removed later
+ */
+static int io_latency_add_dev(CLASS_INTF_PARAMS)
+{
+	struct gendisk *disk = compat_dev_to_whole_disk(dev);
+	struct request_queue_aux *aux;
 
-	class_dev_iter_init(&iter, sd_disk_class, NULL, NULL);
-	while ((dev = class_dev_iter_next(&iter))) {
-		sd = container_of(dev, struct scsi_disk, dev);
-		if (insert_procfs(sd))
-			goto err;
-		aux = insert_aux(sd);
-		if (!aux)
-			goto err;
+	if (!disk) {
+		insert_part(dev);
+		return 0;
 	}
-	class_dev_iter_exit(&iter);
+	if (!disk->queue || skip_disk(disk))
+		return 0;
 
+	aux = insert_aux(disk);
+	if (!aux)
+		return 0;
+	if (insert_procfs(aux)) {
+		printk(KERN_ERR "io-latency: can't create /proc for %s\n",
+				disk->disk_name);
+		remove_aux(aux);
+		return -ENOMEM;
+	}
 	return 0;
-err:
-	delete_procfs();
-	return -ENOMEM;
 }
 
-static int free_aux(struct hash_node *nd)
+static void io_latency_remove_dev(CLASS_INTF_PARAMS)
 {
-	struct request_queue_aux *aux = (struct request_queue_aux *)(nd->value);
-	if (aux) {
-#ifdef USE_HASH_TABLE
-		if (aux->hash_table)
-			destroy_hash_table(aux->hash_table);
-#endif
-		if (aux->lstats)
-			destroy_latency_stats(aux->lstats);
-		kmem_cache_free(request_table_aux_cache, aux);
+	struct gendisk *disk = compat_dev_to_whole_disk(dev);
+	struct request_queue_aux *aux;
+
+	if (!disk) {
+		remove_part(dev);
+		return;
 	}
-	nd->value = 0;
-	return 0;
+	if (!disk->queue)
+		return;
+	aux = get_aux(disk->queue);
+	/* the queue may belong to another disk */
+	if (aux && aux->disk == disk)
+		remove_aux(aux);
 }
 
-static void delete_procfs(void)
+static struct class_interface io_latency_interface = {
+	.add_dev	= io_latency_add_dev,
+	.remove_dev	= io_latency_remove_dev,
+};
+
+static int create_procfs(void)
 {
-	struct proc_dir_entry *proc_node;
-	int i;
+	int res;
 
-	if (dir_proc_list) {
-		for (i = nr_dir_proc - 1; i >= 0; i--) {
-			proc_node = dir_proc_list[i].entry;
-			if (proc_node) {
-				remove_proc_entry(dir_proc_list[i].name,
-						dir_proc_list[i].parent);
-			}
+	proc_io_latency = proc_mkdir("io-latency", NULL);
+	if (!proc_io_latency)
+		return -ENOMEM;
+	if (!proc_create("overhead", S_IFREG, proc_io_latency,
+				&proc_overhead_fops)) {
+		res = -ENOMEM;
+		goto err;
+	}
+	/* before any disk is added */
+	if (aggregates) {
+		all_agg = create_agg(AGG_ALL);
+		if (!all_agg) {
+			res = -ENOMEM;
+			goto err_agg;
 		}
-		kfree(dir_proc_list);
-		dir_proc_list = NULL;
-		nr_dir_proc = 0;
 	}
-	if (proc_io_latency) {
-		remove_proc_entry("io-latency", NULL);
-		proc_io_latency = NULL;
+
+	io_latency_interface.class = disk_class;
+	res = class_interface_register(&io_latency_interface);
+	if (res)
+		goto err_interface;
+	return 0;
+err_interface:
+	if (all_agg) {
+		destroy_agg(all_agg);
+		all_agg = NULL;
+	}
+err_agg:
+	remove_proc_entry("overhead", proc_io_latency);
+err:
+	remove_proc_entry("io-latency", NULL);
+	proc_io_latency = NULL;
+	return res;
+}
+
+static void delete_procfs(void)
+{
+	/* calls io_latency_remove_dev() for every disk */
+	class_interface_unregister(&io_latency_interface);
+	if (all_agg) {
+		destroy_agg(all_agg);
+		all_agg = NULL;
 	}
-	if (request_queue_table)
-		call_for_each_hash_node(request_queue_table,
-				free_aux);
+	/* wait for the part_tables freed by insert_part() and free_parts() */
+	rcu_barrier();
+	remove_proc_entry("overhead", proc_io_latency);
+	remove_proc_entry("io-latency", NULL);
+	proc_io_latency = NULL;
 }
 
 static int __init io_latency_init(void)
 {
 	int res;
 
-	request_queue_table = create_hash_table("request-queue-table",
-						MAX_REQUEST_QUEUE);
-	if (!request_queue_table) {
+	request_queue_table = create_growing_hash_table("request-queue-table",
+						NR_REQUEST_QUEUE);
+	if (!request_queue_table)
+		return -ENOMEM;
+
+	submitter_table = create_hash_table("submitter-table", MAX_REQUESTS);
+	if (!submitter_table) {
 		res = -ENOMEM;
-		goto err;
+		goto err_submitter;
+	}
+
+	hook_stats = hook_stats_create(NR_HOOKS);
+	if (!hook_stats) {
+		res = -ENOMEM;
+		goto err_hook_stats;
 	}
 
 	request_table_aux_cache = kmem_cache_create("request-queue-aux",
 					sizeof(struct request_queue_aux),
 					0, 0, NULL);
+	if (!request_table_aux_cache) {
+		res = -ENOMEM;
+		goto err_cache;
+	}
 
-	sd_disk_class = (struct class *)ali_get_symbol_address("sd_disk_class");
-	if (!sd_disk_class) {
+	disk_class = (struct class *)ali_get_symbol_address("block_class");
+	if (!disk_class) {
 		res = -EINVAL;
-		goto err;
+		goto err_class;
 	}
 
+#ifdef USE_TRACEPOINT
+	/* before create_procfs() adds the disks */
+	p_blk_stat_enable_accounting = (void (*)(struct request_queue *))
+		ali_get_symbol_address("blk_stat_enable_accounting");
+#endif
+
 	res = init_latency_stats();
 	if (res)
-		goto err;
+		goto err_class;
 
 	/* create /proc/io-latency/ */
 	res = create_procfs();
-	if (res) {
-		exit_latency_stats();
-		goto err;
-	}
+	if (res)
+		goto err_procfs;
 
+#ifdef USE_TRACEPOINT
+	res = register_tracepoints();
+	if (res)
+		goto hotfix_err;
+#else
 	if (ali_get_symbol_address_list(io_latency_sym_addr_list, &res)) {
 		printk(KERN_ERR "Can't get address of %s\n",
 				io_latency_sym_addr_list[res].name);
@@ -928,22 +3709,43 @@ static int __init io_latency_init(void)
 		res = -ENODEV;
 		goto hotfix_err;
 	}
+#endif
 
+	schedule_delayed_work(&fold_work,
+			msecs_to_jiffies(get_fold_interval()));
+	schedule_delayed_work(&window_work, HZ);
 	return 0;
 
+	/* undone in the reverse order, like io_latency_exit() */
 hotfix_err:
 	delete_procfs();
+err_procfs:
 	exit_latency_stats();
-err:
+err_class:
+	kmem_cache_destroy(request_table_aux_cache);
+err_cache:
+	hook_stats_destroy(hook_stats);
+err_hook_stats:
+	destroy_hash_table(submitter_table);
+err_submitter:
+	destroy_hash_table(request_queue_table);
 	return res;
 }
 
 static void __exit io_latency_exit(void)
 {
+	cancel_delayed_work_sync(&fold_work);
+	cancel_delayed_work_sync(&window_work);
+#ifdef USE_TRACEPOINT
+	unregister_tracepoints();
+#else
 	ali_hotfix_unregister_list(io_latency_hotfix_list);
+#endif
 	delete_procfs();
 	exit_latency_stats();
 	kmem_cache_destroy(request_table_aux_cache);
+	hook_stats_destroy(hook_stats);
+	destroy_hash_table(submitter_table);
 	destroy_hash_table(request_queue_table);
 }
 
@@ -0,0 +1,198 @@
+#ifndef _IO_LATENCY_ABI_H_
+#define _IO_LATENCY_ABI_H_
+
+/*
+ * Binary layout of /proc/io-latency/<dev>/stats.bin, shared with userspace
+ * collectors.  All fields are little endian as written by the host.
+ *
+ * A snapshot is a header followed by 'nr_sections' sections.  Every
+ * section is a struct io_latency_section followed by 'nr' __u64 values,
+ * so readers can skip section types they do not know.  Counters are
+ * already added up over all CPUs.
+ *
+ * Latency sections hold 'lat_nr' bucket counters, then the sum and the
+ * maximum of all samples in ns.  Bucket i covers the latencies whose
+ * value in units of 2^lat_unit_shift ns is:
+ *	i				if i < 2^lat_sub_bits
+ *	[s << e, (s + 1) << e)		otherwise, where
+ *		e = (i >> (lat_sub_bits - 1)) - 1
+ *		s = i - (e << (lat_sub_bits - 1))
+ * and the last bucket also collects everything slower.
+ *
+ * Size sections hold 'size_nr' counters, bucket i counts I/Os of
+ * [i * size_grain, (i + 1) * size_grain) bytes.
+ *
+ * When 'sample_rate' is above 1 only about one I/O in that many was
+ * counted: counters and sums have to be multiplied by it, percentiles
+ * and maxima are estimates.  Older versions of the header end before it,
+ * readers should take 1 when 'header_size' does not cover it.
+ */
+
+#include <linux/types.h>
+
+#define IO_LATENCY_SNAPSHOT_MAGIC	0x534c4f49	/* "IOLS" */
+#define IO_LATENCY_SNAPSHOT_VERSION	1
+#define IO_LATENCY_DISK_NAME_LEN	32
+
+struct io_latency_snapshot_header {
+	__u32 magic;
+	__u16 version;
+	__u16 header_size;	/* sections start at this offset */
+	__u32 total_size;	/* header and all sections */
+	__u32 nr_sections;
+	__u64 realtime_ns;	/* wall clock when the snapshot was taken */
+	__u64 monotonic_ns;	/* CLOCK_MONOTONIC, for computing rates */
+	__u32 major;		/* device the stats belong to */
+	__u32 minor;
+	char disk_name[IO_LATENCY_DISK_NAME_LEN];
+	/* bucket layout */
+	__u16 lat_sub_bits;
+	__u16 lat_unit_shift;
+	__u32 lat_nr;
+	__u32 size_grain;
+	__u32 size_nr;
+	__u32 sample_rate;	/* when the snapshot was taken */
+	__u32 reserved;
+} __attribute__((packed));
+
+enum {
+	IO_LATENCY_SECT_LATENCY_READ = 1,
+	IO_LATENCY_SECT_LATENCY_WRITE,
+	IO_LATENCY_SECT_SOFT_LATENCY_READ,
+	IO_LATENCY_SECT_SOFT_LATENCY_WRITE,
+	IO_LATENCY_SECT_SIZE_READ,
+	IO_LATENCY_SECT_SIZE_WRITE,
+	/* windows.bin, id is the length of the window in seconds */
+	IO_LATENCY_SECT_WINDOW_LATENCY,
+	IO_LATENCY_SECT_WINDOW_SOFT_LATENCY,
+	/*
+	 * heatmap.bin: the layout is zone size in sectors, number of zones,
+	 * latency buckets per zone and the unit of the buckets as log2 ns.
+	 * The heatmap then holds the buckets of zone 0, of zone 1 ...;
+	 * bucket 0 counts latencies below one unit, bucket i of
+	 * [2^(i-1), 2^i) units and the last one also everything slower.
+	 */
+	IO_LATENCY_SECT_HEATMAP_LAYOUT,
+	IO_LATENCY_SECT_HEATMAP,
+	/*
+	 * outliers.bin: the records logged since the previous read, every
+	 * record is a struct io_latency_outlier taking 8 values, and the
+	 * number of records overwritten before they could be read.
+	 */
+	IO_LATENCY_SECT_OUTLIERS,
+	IO_LATENCY_SECT_OUTLIERS_DROPPED,
+	/*
+	 * hardware latency by queue depth: id i counts the requests issued
+	 * while [2^i, 2^(i+1)) requests were in flight, the last id also
+	 * deeper ones.  The values are log2 latency buckets laid out like
+	 * the ones of the heatmap, 2^10 ns units, then the sum in ns.
+	 */
+	IO_LATENCY_SECT_QD_LATENCY,
+	/*
+	 * hardware latency of a kind of request, id is one of
+	 * IO_LATENCY_OP_*.  Flushes, FUA writes and discards are not in the
+	 * read and write sections, sync and meta requests are.
+	 */
+	IO_LATENCY_SECT_OP_LATENCY,
+	/*
+	 * size_latency.bin: hardware latency by I/O size.  Id 0 counts the
+	 * I/Os below 4KiB, id i of [2^(i+11), 2^(i+12)) bytes and the last
+	 * id also larger ones; the values are log2 latency buckets like the
+	 * ones of the heatmap.
+	 */
+	IO_LATENCY_SECT_SIZE_LATENCY_READ,
+	IO_LATENCY_SECT_SIZE_LATENCY_WRITE,
+};
+
+enum {
+	IO_LATENCY_OP_FLUSH,
+	IO_LATENCY_OP_FUA,
+	IO_LATENCY_OP_DISCARD,
+	IO_LATENCY_OP_SYNC,
+	IO_LATENCY_OP_META,
+};
+
+/*
+ * /proc/io-latency/<dev>/stats.mmap can be mmap()ed read-only.  It starts
+ * with struct io_latency_mmap_header and holds a stats.bin snapshot at
+ * 'snapshot_offset', refreshed in place every 'fold_interval_ms'.  'seq' is
+ * odd while the kernel rewrites the snapshot, so readers copy it with:
+ *
+ *	do {
+ *		seq = hdr->seq;
+ *		rmb();
+ *		memcpy(buf, (char *)hdr + hdr->snapshot_offset, size);
+ *		rmb();
+ *	} while ((seq & 1) || seq != hdr->seq);
+ */
+struct io_latency_mmap_header {
+	__u32 seq;
+	__u32 snapshot_offset;
+	__u32 region_size;
+	__u32 fold_interval_ms;
+} __attribute__((packed));
+
+/*
+ * An I/O slower than the outlier threshold of the device.  Times are
+ * CLOCK_MONOTONIC ns, on 2.6.32 ns of the kernel's local_clock() the
+ * latency is measured with, which may drift a little from it.  Fields the
+ * backend does not know are 0: the queue time on 2.6.32, and the size
+ * there too since the request is already completed when it is logged.
+ */
+struct io_latency_outlier {
+	__u64 seq;		/* see io_latency_outlier_ring */
+	__u64 sector;
+	__u64 queue_ns;		/* request allocated / bio queued */
+	__u64 dispatch_ns;	/* handed to the driver */
+	__u64 complete_ns;
+	__u64 latency_ns;	/* complete_ns - dispatch_ns */
+	__u32 bytes;
+	__u32 cmd_flags;	/* rq->cmd_flags or bio->bi_opf as is */
+	__s32 pid;		/* tgid of the submitter */
+	__u16 cpu;		/* that completed it */
+	__u8 rw;		/* 1 for writes */
+	__u8 reserved;
+} __attribute__((packed));
+
+/*
+ * /proc/io-latency/<dev>/outliers.mmap maps the outlier rings read-only:
+ * this header, then 'nr_cpus' rings, ring i at ring_offset + i *
+ * ring_stride.  A ring is struct io_latency_outlier_ring followed by
+ * 'ring_size' records.  'head' counts the records ever written to it,
+ * record n is kept at n % ring_size and its seq is n + 1 once complete.
+ * A reader with its own 'tail' copies the records with:
+ *
+ *	head = ring->head;
+ *	rmb();
+ *	if (head - tail > ring_size)
+ *		dropped += head - ring_size - tail, tail = head - ring_size;
+ *	for (n = tail; n < head; n++) {
+ *		seq = rec[n % ring_size].seq;
+ *		rmb();
+ *		copy rec[n % ring_size];
+ *		rmb();
+ *		if (seq != n + 1 || rec[n % ring_size].seq != n + 1)
+ *			dropped++;	(overwritten meanwhile)
+ *	}
+ *	tail = head;
+ */
+struct io_latency_outlier_header {
+	__u32 nr_cpus;
+	__u32 ring_size;
+	__u32 record_size;
+	__u32 ring_offset;
+	__u32 ring_stride;
+} __attribute__((packed));
+
+struct io_latency_outlier_ring {
+	__u64 head;
+	__u64 reserved[7];
+} __attribute__((packed));
+
+struct io_latency_section {
+	__u16 type;		/* IO_LATENCY_SECT_* */
+	__u16 id;		/* instance, 0 unless the type says otherwise */
+	__u32 nr;		/* number of __u64 following this header */
+} __attribute__((packed));
+
+#endif
@@ -17,38 +17,23 @@
  *
  */
 
-#include <asm-generic/div64.h>
 #include <linux/slab.h>
 #include <linux/clocksource.h>
 #include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
 
 #include "latency_stats.h"
 
 static struct kmem_cache *latency_stats_cache;
 
-static unsigned long long us2msecs(unsigned long long usec)
-{
-	usec += 500;
-	do_div(usec, 1000);
-	return usec;
-}
-
-static unsigned long long us2secs(unsigned long long usec)
-{
-	usec += 500;
-	do_div(usec, 1000);
-	usec += 500;
-	do_div(usec, 1000);
-	return usec;
-}
-
-/*
-static unsigned long long ms2secs(unsigned long long msec)
-{
-	msec += 500;
-	do_div(msec, 1000);
-	return msec;
-}*/
+const char * const lat_op_names[LAT_OP_NR] = {
+	[LAT_OP_FLUSH] = "flush",
+	[LAT_OP_FUA] = "fua",
+	[LAT_OP_DISCARD] = "discard",
+	[LAT_OP_SYNC] = "sync",
+	[LAT_OP_META] = "meta",
+};
 
 int init_latency_stats(void)
 {
@@ -67,114 +52,457 @@ void exit_latency_stats(void)
 	}
 }
 
-void reset_latency_stats(struct latency_stats __percpu *lstats)
+/*
+ * per-cpu counters of a device, without the soft latency histograms
+ * unless 'soft' is set: they cannot be added later
+ */
+struct latency_stats __percpu *create_latency_stats(int soft)
 {
-	int r, cpu;
+	struct latency_stats_shared *shared;
+	struct latency_stats __percpu *lstats;
 	struct latency_stats *pstats;
+	size_t size, nr;
+	int cpu;
 
+	size = soft ? sizeof(struct latency_stats) :
+		offsetof(struct latency_stats, soft_latency_read);
+	/* one spill for every u32 of the struct, the few others are unused */
+	nr = size / sizeof(u32);
+	shared = kzalloc(sizeof(struct latency_stats_shared), GFP_KERNEL);
+	if (!shared)
+		return NULL;
+	shared->spill = vmalloc(sizeof(atomic64_t) * nr * 2);
+	if (!shared->spill)
+		goto free_shared;
+	memset(shared->spill, 0, sizeof(atomic64_t) * nr * 2);
+	spin_lock_init(&shared->lock);
+	shared->retired = shared->spill + nr;
+	lstats = __alloc_percpu(size, __alignof__(struct latency_stats));
+	if (!lstats)
+		goto free_spill;
 	for_each_possible_cpu(cpu) {
 		pstats = per_cpu_ptr(lstats, cpu);
-		/* reset latency stats buckets */
-		for (r = 0; r < IO_LATENCY_STATS_S_NR; r++) {
-			pstats->latency_stats_s[r] = 0;
-			pstats->latency_read_stats_s[r] = 0;
-			pstats->latency_write_stats_s[r] = 0;
-			pstats->soft_latency_stats_s[r] = 0;
-			pstats->soft_latency_read_stats_s[r] = 0;
-			pstats->soft_latency_write_stats_s[r] = 0;
-		}
-		for (r = 0; r < IO_LATENCY_STATS_MS_NR; r++) {
-			pstats->latency_stats_ms[r] = 0;
-			pstats->latency_read_stats_ms[r] = 0;
-			pstats->latency_write_stats_ms[r] = 0;
-			pstats->soft_latency_stats_ms[r] = 0;
-			pstats->soft_latency_read_stats_ms[r] = 0;
-			pstats->soft_latency_write_stats_ms[r] = 0;
-		}
-		for (r = 0; r < IO_LATENCY_STATS_US_NR; r++) {
-			pstats->latency_stats_us[r] = 0;
-			pstats->latency_read_stats_us[r] = 0;
-			pstats->latency_write_stats_us[r] = 0;
-			pstats->soft_latency_stats_us[r] = 0;
-			pstats->soft_latency_read_stats_us[r] = 0;
-			pstats->soft_latency_write_stats_us[r] = 0;
-		}
-		for (r = 0; r < IO_SIZE_STATS_NR; r++) {
-			pstats->io_size_stats[r] = 0;
-			pstats->io_read_size_stats[r] = 0;
-			pstats->io_write_size_stats[r] = 0;
-		}
-	}
-}
-
-struct latency_stats __percpu *create_latency_stats(void)
-{
-	return alloc_percpu(struct latency_stats);
+		pstats->shared = shared;
+		pstats->has_soft = soft;
+	}
+	return lstats;
+
+free_spill:
+	vfree(shared->spill);
+free_shared:
+	kfree(shared);
+	return NULL;
 }
 
 void destroy_latency_stats(struct latency_stats __percpu *lstats)
 {
-	if (lstats)
+	struct latency_stats_shared *shared;
+	int cpu;
+
+	if (lstats) {
+		cpu = cpumask_first(cpu_possible_mask);
+		shared = per_cpu_ptr(lstats, cpu)->shared;
+		vfree(shared->spill);
+		kfree(shared);
 		free_percpu(lstats);
+	}
 }
 
-#define INC_LATENCY(lstats, idx, soft, rw, grain)			\
-do {									\
-									\
-if (soft) {								\
-	lstats->soft_latency_stats_##grain[idx]++;			\
-	if (rw)								\
-		lstats->soft_latency_write_stats_##grain[idx]++;	\
-	else								\
-		lstats->soft_latency_read_stats_##grain[idx]++;		\
-} else {								\
-	lstats->latency_stats_##grain[idx]++;				\
-	if (rw)								\
-		lstats->latency_write_stats_##grain[idx]++;		\
-	else								\
-		lstats->latency_read_stats_##grain[idx]++;		\
-}									\
-									\
-} while (0)
-
-void update_latency_stats(struct latency_stats *lstats, unsigned long stime,
-			unsigned long now, int soft, int rw)
-{
-	unsigned long latency;
-	int idx;
+/*
+ * A spill entry packs the generation of its last spill with how many
+ * spills happened before that generation and in it, all in units of
+ * LAT_COUNT_SPILL.  2^20 spills are 2^51 I/Os in one bucket.
+ */
+#define SPILL_NR_BITS		20
+#define SPILL_NR_MASK		((1ULL << SPILL_NR_BITS) - 1)
+#define SPILL_GEN_SHIFT		(2 * SPILL_NR_BITS)
+#define SPILL_GEN_MASK		((1U << (64 - SPILL_GEN_SHIFT)) - 1)
+
+/* index of the shared entries of the counter at 'field' */
+static inline size_t lat_shared_index(const struct latency_stats *lstats,
+				const void *field)
+{
+	return (const u32 *)field - (const u32 *)lstats;
+}
+
+static void lat_count_spill(struct latency_stats *lstats,
+				u32 *count)
+{
+	atomic64_t *spill;
+	u64 gen = lstats->gen & SPILL_GEN_MASK;
+	u64 old, new;
+
+	spill = &lstats->shared->spill[lat_shared_index(lstats, count)];
+	do {
+		old = atomic64_read(spill);
+		if (old >> SPILL_GEN_SHIFT == gen)
+			new = old + 1;
+		else
+			new = (gen << SPILL_GEN_SHIFT) | 1 |
+				(((old >> SPILL_NR_BITS) + old) & SPILL_NR_MASK)
+				<< SPILL_NR_BITS;
+	} while (atomic64_cmpxchg(spill, old, new) != old);
+}
+
+static inline void lat_count_inc(struct latency_stats *lstats, u32 *count)
+{
+	if (unlikely(++*count == LAT_COUNT_SPILL)) {
+		*count = 0;
+		lat_count_spill(lstats, count);
+	}
+}
+
+/*
+ * What a fold adds up: everything ever counted, what was counted since
+ * the last reset or what was counted before it.
+ */
+enum {
+	LAT_FOLD_ALL,
+	LAT_FOLD_CURRENT,
+	LAT_FOLD_BASE,
+};
+
+/*
+ * what the shared entries of the counter at 'field' add to a fold of
+ * 'what' at generation 'gen': the spills, and the retired counts which
+ * all predate it
+ */
+static u64 lat_shared_count(const struct latency_stats *lstats,
+			const void *field, int what, unsigned int gen)
+{
+	size_t idx = lat_shared_index(lstats, field);
+	u64 spill = atomic64_read(&lstats->shared->spill[idx]);
+	u64 cur = spill & SPILL_NR_MASK;
+	u64 old = (spill >> SPILL_NR_BITS) & SPILL_NR_MASK;
+
+	if (spill >> SPILL_GEN_SHIFT != (gen & SPILL_GEN_MASK)) {
+		old += cur;
+		cur = 0;
+	}
+	if (what == LAT_FOLD_CURRENT)
+		return cur * LAT_COUNT_SPILL;
+	if (what == LAT_FOLD_BASE)
+		cur = 0;
+	return (old + cur) * LAT_COUNT_SPILL +
+		atomic64_read(&lstats->shared->retired[idx]);
+}
+
+static void lat_hist_add(struct latency_stats *lstats, struct lat_hist *hist,
+			u64 ns)
+{
+	lat_count_inc(lstats, &hist->buckets[lat_hist_index(ns)]);
+	hist->sum += ns;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+static void lat_hist_fold_shared(struct lat_hist_sum *sum,
+			const struct latency_stats *lstats,
+			const struct lat_hist *hist, int what, unsigned int gen)
+{
+	int i;
+
+	for (i = 0; i < LAT_HIST_NR; i++)
+		sum->buckets[i] += lat_shared_count(lstats, &hist->buckets[i],
+				what, gen);
+	sum->sum += lat_shared_count(lstats, &hist->sum, what, gen);
+}
+
+/* too big for the stack with HIST_DIGITS=2, callers are never hot */
+struct latency_stats_sum *create_latency_stats_sum(void)
+{
+	struct latency_stats_sum *sum;
+
+	sum = vmalloc(sizeof(struct latency_stats_sum));
+	if (sum)
+		memset(sum, 0, sizeof(struct latency_stats_sum));
+	return sum;
+}
+
+void destroy_latency_stats_sum(struct latency_stats_sum *sum)
+{
+	vfree(sum);
+}
+
+/* the shared entries of 'pstats', of any CPU, into 'sum' */
+static void fold_latency_shared(const struct latency_stats *pstats,
+			struct latency_stats_sum *sum, int what,
+			unsigned int gen)
+{
+	int r, i;
+
+	lat_hist_fold_shared(&sum->latency_read, pstats,
+			&pstats->latency_read, what, gen);
+	lat_hist_fold_shared(&sum->latency_write, pstats,
+			&pstats->latency_write, what, gen);
+	for (r = 0; r < LAT_OP_NR; r++)
+		lat_hist_fold_shared(&sum->op_latency[r], pstats,
+				&pstats->op_latency[r], what, gen);
+	for (r = 0; r < IO_SIZE_STATS_NR; r++) {
+		sum->io_read_size_stats[r] += lat_shared_count(pstats,
+				&pstats->io_read_size_stats[r], what, gen);
+		sum->io_write_size_stats[r] += lat_shared_count(pstats,
+				&pstats->io_write_size_stats[r], what, gen);
+	}
+	for (r = 0; r < QD_HIST_NR; r++) {
+		for (i = 0; i < LAT_LOG2_NR; i++)
+			sum->qd_latency[r][i] += lat_shared_count(pstats,
+					&pstats->qd_latency[r][i], what, gen);
+		sum->qd_latency_sum[r] += lat_shared_count(pstats,
+				&pstats->qd_latency_sum[r], what, gen);
+	}
+	if (pstats->has_soft) {
+		lat_hist_fold_shared(&sum->soft_latency_read, pstats,
+				&pstats->soft_latency_read, what, gen);
+		lat_hist_fold_shared(&sum->soft_latency_write, pstats,
+				&pstats->soft_latency_write, what, gen);
+	}
+}
+
+/* the counters of one CPU into 'sum' */
+static void fold_latency_cpu(const struct latency_stats *pstats,
+			struct latency_stats_sum *sum)
+{
+	int r, i;
+
+	lat_hist_fold(&sum->latency_read, &pstats->latency_read);
+	lat_hist_fold(&sum->latency_write, &pstats->latency_write);
+	for (r = 0; r < LAT_OP_NR; r++)
+		lat_hist_fold(&sum->op_latency[r], &pstats->op_latency[r]);
+	for (r = 0; r < IO_SIZE_STATS_NR; r++) {
+		sum->io_read_size_stats[r] += pstats->io_read_size_stats[r];
+		sum->io_write_size_stats[r] += pstats->io_write_size_stats[r];
+	}
+	for (r = 0; r < QD_HIST_NR; r++) {
+		for (i = 0; i < LAT_LOG2_NR; i++)
+			sum->qd_latency[r][i] += pstats->qd_latency[r][i];
+		sum->qd_latency_sum[r] += pstats->qd_latency_sum[r];
+	}
+	if (pstats->has_soft) {
+		lat_hist_fold(&sum->soft_latency_read,
+				&pstats->soft_latency_read);
+		lat_hist_fold(&sum->soft_latency_write,
+				&pstats->soft_latency_write);
+	}
+}
+
+/*
+ * Folds overwrite 'sum'.  They start over when a CPU retires its
+ * counters meanwhile, which only happens once per CPU and reset.
+ */
+static void __fold_latency_stats(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum, int what)
+{
+	struct latency_stats_shared *shared;
+	struct latency_stats *pstats;
+	unsigned int gen, seq;
+	int r, cpu;
+
+	pstats = per_cpu_ptr(lstats, cpumask_first(cpu_possible_mask));
+	shared = pstats->shared;
+retry:
+	seq = ACCESS_ONCE(shared->seq);
+	smp_rmb();
+	if (seq & 1) {
+		cpu_relax();
+		goto retry;
+	}
+	gen = ACCESS_ONCE(shared->gen);
+	memset(sum, 0, sizeof(struct latency_stats_sum));
+
+	fold_latency_shared(pstats, sum, what, gen);
+	for_each_possible_cpu(cpu) {
+		pstats = per_cpu_ptr(lstats, cpu);
+		if (what == LAT_FOLD_CURRENT && pstats->gen != gen)
+			continue;
+		if (what == LAT_FOLD_BASE && pstats->gen == gen)
+			continue;
+		fold_latency_cpu(pstats, sum);
+	}
+	smp_rmb();
+	if (ACCESS_ONCE(shared->seq) != seq)
+		goto retry;
+
+	for (r = 0; r < IO_SIZE_STATS_NR; r++)
+		sum->io_size_stats[r] = sum->io_read_size_stats[r] +
+			sum->io_write_size_stats[r];
+}
+
+/*
+ * everything the counters of every possible CPU ever counted.  A fold
+ * racing with a spill may be off by LAT_COUNT_SPILL in that bucket, once
+ * every 2^31 I/Os of it on a CPU.  The max is only kept since the last
+ * reset.
+ */
+void fold_latency_stats(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum)
+{
+	__fold_latency_stats(lstats, sum, LAT_FOLD_ALL);
+}
+
+/* what was counted since the last reset_latency_stats() */
+void fold_latency_stats_current(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum)
+{
+	__fold_latency_stats(lstats, sum, LAT_FOLD_CURRENT);
+}
+
+/*
+ * what was counted before the last reset_latency_stats(), it does not
+ * change until the next one however the CPUs retire.  No max.
+ */
+void fold_latency_stats_base(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum)
+{
+	__fold_latency_stats(lstats, sum, LAT_FOLD_BASE);
+}
+
+/*
+ * Start counting over from zero for every view but fold_latency_stats().
+ * Nothing is cleared here, see retire_latency_stats().
+ */
+void reset_latency_stats(struct latency_stats __percpu *lstats)
+{
+	struct latency_stats_shared *shared;
+
+	shared = per_cpu_ptr(lstats, cpumask_first(cpu_possible_mask))->shared;
+	ACCESS_ONCE(shared->gen) = shared->gen + 1;
+}
+
+/*
+ * take 'base' out of 'sum', what fold_latency_stats() returns only ever
+ * grows so a reader can get its own deltas by remembering where it was
+ */
+void sub_latency_stats(struct latency_stats_sum *sum,
+			const struct latency_stats_sum *base)
+{
+	int r, i;
 
-	/*
-	 * if now <= io->start_time_usec, it means counter
-	 * in ktime_get() over flows, just ignore this I/O
-	*/
-	if (unlikely(now <= stime))
-		return;
-
-	latency = now - stime;
-#ifndef USE_US
-	latency *= 1000;
-#endif
-	if (latency < 1000) {
-		/* microseconds */
-		idx = latency/IO_LATENCY_STATS_US_GRAINSIZE;
-		if (idx > (IO_LATENCY_STATS_US_NR - 1))
-			idx = IO_LATENCY_STATS_US_NR - 1;
-		INC_LATENCY(lstats, idx, soft, rw, us);
-	} else if (latency < 1000000) {
-		/* milliseconds */
-		idx = us2msecs(latency)/IO_LATENCY_STATS_MS_GRAINSIZE;
-		if (idx > (IO_LATENCY_STATS_MS_NR - 1))
-			idx = IO_LATENCY_STATS_MS_NR - 1;
-		INC_LATENCY(lstats, idx, soft, rw, ms);
+	lat_hist_sub(&sum->latency_read, &base->latency_read);
+	lat_hist_sub(&sum->latency_write, &base->latency_write);
+	lat_hist_sub(&sum->soft_latency_read, &base->soft_latency_read);
+	lat_hist_sub(&sum->soft_latency_write, &base->soft_latency_write);
+	for (r = 0; r < LAT_OP_NR; r++)
+		lat_hist_sub(&sum->op_latency[r], &base->op_latency[r]);
+	for (r = 0; r < IO_SIZE_STATS_NR; r++) {
+		sum->io_size_stats[r] -= base->io_size_stats[r];
+		sum->io_read_size_stats[r] -= base->io_read_size_stats[r];
+		sum->io_write_size_stats[r] -= base->io_write_size_stats[r];
+	}
+	for (r = 0; r < QD_HIST_NR; r++) {
+		for (i = 0; i < LAT_LOG2_NR; i++)
+			sum->qd_latency[r][i] -= base->qd_latency[r][i];
+		sum->qd_latency_sum[r] -= base->qd_latency_sum[r];
+	}
+}
+
+static inline void lat_retire(struct latency_stats *lstats,
+			const void *field, u64 val)
+{
+	if (val)
+		atomic64_add(val, &lstats->shared->retired[
+				lat_shared_index(lstats, field)]);
+}
+
+static void lat_hist_retire(struct latency_stats *lstats,
+			const struct lat_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < LAT_HIST_NR; i++)
+		lat_retire(lstats, &hist->buckets[i], hist->buckets[i]);
+	lat_retire(lstats, &hist->sum, hist->sum);
+}
+
+/*
+ * Move the counters of this CPU, which all predate the last reset, into
+ * 'retired' and clear them.  Once per CPU and reset, on the first update
+ * after it; the lock is only ever contended by other CPUs retiring.
+ */
+void retire_latency_stats(struct latency_stats *lstats)
+{
+	struct latency_stats_shared *shared = lstats->shared;
+	unsigned long flags;
+	size_t size;
+	int r, i;
+
+	spin_lock_irqsave(&shared->lock, flags);
+	if (lstats->gen == shared->gen)
+		goto unlock;
+	ACCESS_ONCE(shared->seq) = shared->seq + 1;
+	smp_wmb();
+
+	lat_hist_retire(lstats, &lstats->latency_read);
+	lat_hist_retire(lstats, &lstats->latency_write);
+	for (r = 0; r < LAT_OP_NR; r++)
+		lat_hist_retire(lstats, &lstats->op_latency[r]);
+	for (r = 0; r < IO_SIZE_STATS_NR; r++) {
+		lat_retire(lstats, &lstats->io_read_size_stats[r],
+				lstats->io_read_size_stats[r]);
+		lat_retire(lstats, &lstats->io_write_size_stats[r],
+				lstats->io_write_size_stats[r]);
+	}
+	for (r = 0; r < QD_HIST_NR; r++) {
+		for (i = 0; i < LAT_LOG2_NR; i++)
+			lat_retire(lstats, &lstats->qd_latency[r][i],
+					lstats->qd_latency[r][i]);
+		lat_retire(lstats, &lstats->qd_latency_sum[r],
+				lstats->qd_latency_sum[r]);
+	}
+	if (lstats->has_soft) {
+		lat_hist_retire(lstats, &lstats->soft_latency_read);
+		lat_hist_retire(lstats, &lstats->soft_latency_write);
+	}
+	size = lstats->has_soft ? sizeof(struct latency_stats) :
+		offsetof(struct latency_stats, soft_latency_read);
+	memset(&lstats->latency_read, 0,
+			size - offsetof(struct latency_stats, latency_read));
+	lstats->gen = shared->gen;
+
+	smp_wmb();
+	ACCESS_ONCE(shared->seq) = shared->seq + 1;
+unlock:
+	spin_unlock_irqrestore(&shared->lock, flags);
+}
+
+/* account one latency of 'ns' nanoseconds */
+void add_latency_stats(struct latency_stats *lstats, u64 ns, int soft, int rw)
+{
+	if (soft) {
+		if (!lstats->has_soft)
+			return;
+		if (rw)
+			lat_hist_add(lstats, &lstats->soft_latency_write, ns);
+		else
+			lat_hist_add(lstats, &lstats->soft_latency_read, ns);
 	} else {
-		/* seconds */
-		idx = us2secs(latency)/IO_LATENCY_STATS_S_GRAINSIZE;
-		if (idx > (IO_LATENCY_STATS_S_NR - 1))
-			idx = IO_LATENCY_STATS_S_NR - 1;
-		INC_LATENCY(lstats, idx, soft, rw, s);
+		if (rw)
+			lat_hist_add(lstats, &lstats->latency_write, ns);
+		else
+			lat_hist_add(lstats, &lstats->latency_read, ns);
 	}
 }
 
+/* account one latency into every LAT_OP_* bit set in 'ops' */
+void add_op_latency_stats(struct latency_stats *lstats, u64 ns,
+			unsigned int ops)
+{
+	int i;
+
+	for (i = 0; ops; i++, ops >>= 1) {
+		if (ops & 1)
+			lat_hist_add(lstats, &lstats->op_latency[i], ns);
+	}
+}
+
+/* account the latency of a request issued at queue depth bucket 'qd' */
+void add_qd_latency_stats(struct latency_stats *lstats, unsigned int qd,
+			u64 ns)
+{
+	lat_count_inc(lstats, &lstats->qd_latency[qd][lat_log2_index(ns)]);
+	lstats->qd_latency_sum[qd] += ns;
+}
+
 void update_io_size_stats(struct latency_stats *lstats, unsigned long size,
 				int rw)
 {
@@ -184,10 +512,11 @@ void update_io_size_stats(struct latency_stats *lstats, unsigned long size,
 		idx = size/IO_SIZE_STATS_GRAINSIZE;
 		if (idx > (IO_SIZE_STATS_NR - 1))
 			idx = IO_SIZE_STATS_NR - 1;
-		lstats->io_size_stats[idx]++;
 		if (rw)
-			lstats->io_write_size_stats[idx]++;
+			lat_count_inc(lstats,
+					&lstats->io_write_size_stats[idx]);
 		else
-			lstats->io_read_size_stats[idx]++;
+			lat_count_inc(lstats,
+					&lstats->io_read_size_stats[idx]);
 	}
 }
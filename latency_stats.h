@@ -2,8 +2,12 @@
 #define _IO_LATENCY_STATS_H_
 
 #include <linux/types.h>
+#include <linux/spinlock.h>
+#include <asm/atomic.h>
 
 #include "config.h"
+#include "histogram.h"
+
 /* for 2.6.32.36xen */
 #ifdef USE_HASH_TABLE
 	#ifndef __percpu
@@ -11,54 +15,143 @@
 	#endif
 #endif
 
-/* 300s is max disk I/O latency which application may accept */
-#define IO_LATENCY_STATS_S_NR		100
-#define IO_LATENCY_STATS_S_GRAINSIZE	(1000/IO_LATENCY_STATS_S_NR)
-#define IO_LATENCY_STATS_MS_NR		100
-#define IO_LATENCY_STATS_MS_GRAINSIZE	(1000/IO_LATENCY_STATS_MS_NR)
-#define IO_LATENCY_STATS_US_NR		100
-#define IO_LATENCY_STATS_US_GRAINSIZE	(1000/IO_LATENCY_STATS_S_NR)
-
 #define IO_SIZE_MAX			(1024 * 1024)
 #define IO_SIZE_STATS_GRAINSIZE		4096
 #define IO_SIZE_STATS_NR		(IO_SIZE_MAX / IO_SIZE_STATS_GRAINSIZE)
 
+/*
+ * Kinds of requests with a latency profile of their own.  Flushes, FUA
+ * writes and discards only go into their own histogram, sync and meta
+ * requests are counted as reads or writes too.
+ */
+enum {
+	LAT_OP_FLUSH,
+	LAT_OP_FUA,
+	LAT_OP_DISCARD,
+	LAT_OP_SYNC,
+	LAT_OP_META,
+	LAT_OP_NR,
+};
+
+#define LAT_OP_EXCLUSIVE	((1 << LAT_OP_FLUSH) | (1 << LAT_OP_FUA) | \
+				(1 << LAT_OP_DISCARD))
+
+extern const char * const lat_op_names[LAT_OP_NR];
+
+/*
+ * requests in flight on the device when a request was issued, itself
+ * included: bucket i counts depths of [2^i, 2^(i+1)), the last one also
+ * everything deeper
+ */
+#define QD_HIST_NR			12
+
+static inline unsigned int qd_hist_index(unsigned int depth)
+{
+	int idx = fls(depth) - 1;
+
+	if (idx < 0)
+		return 0;
+	return idx < QD_HIST_NR ? idx : QD_HIST_NR - 1;
+}
+
+/*
+ * Every device (and cgroup slot) has one of these per possible CPU, so
+ * the counters are only 32 bit.  A counter that reaches LAT_COUNT_SPILL
+ * moves that much into the 64 bit 'spill' of its device, at the index of
+ * its u32 offset in the struct; folds add the spill once.
+ *
+ * The soft latency histograms come last: they are not allocated at all
+ * for stats created without them, see create_latency_stats().
+ */
+#define LAT_COUNT_SPILL			(1U << 31)
+
+/*
+ * What the CPUs of a device share.  A reset only bumps 'gen'.  The
+ * counters of a CPU still on an older generation all predate the reset:
+ * that CPU moves them into 'retired' at its next update, see
+ * sync_latency_stats(), under 'lock' and inside the 'seq' count folds
+ * retry on.  Both arrays have an entry for every u32 of struct
+ * latency_stats.
+ */
+struct latency_stats_shared {
+	unsigned int gen;
+	unsigned int seq;
+	spinlock_t lock;
+	atomic64_t *spill;
+	atomic64_t *retired;
+};
+
 struct latency_stats {
-	/* latency statistic buckets */
-	unsigned long latency_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long latency_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long latency_stats_us[IO_LATENCY_STATS_US_NR];
-	unsigned long latency_read_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long latency_read_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long latency_read_stats_us[IO_LATENCY_STATS_US_NR];
-	unsigned long latency_write_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long latency_write_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long latency_write_stats_us[IO_LATENCY_STATS_US_NR];
-	/* latency statistic for block-layer buckets */
-	unsigned long soft_latency_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long soft_latency_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long soft_latency_stats_us[IO_LATENCY_STATS_US_NR];
-	unsigned long soft_latency_read_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long soft_latency_read_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long soft_latency_read_stats_us[IO_LATENCY_STATS_US_NR];
-	unsigned long soft_latency_write_stats_s[IO_LATENCY_STATS_S_NR];
-	unsigned long soft_latency_write_stats_ms[IO_LATENCY_STATS_MS_NR];
-	unsigned long soft_latency_write_stats_us[IO_LATENCY_STATS_US_NR];
-	/* io size statistic buckets */
-	unsigned long io_size_stats[IO_SIZE_STATS_NR];
-	unsigned long io_read_size_stats[IO_SIZE_STATS_NR];
-	unsigned long io_write_size_stats[IO_SIZE_STATS_NR];
+	/* the same for every CPU */
+	struct latency_stats_shared *shared;
+	/* generation the counters of this CPU count since */
+	unsigned int gen;
+	int has_soft;
+	/*
+	 * latency statistic buckets, the read and write histograms add up
+	 * to the total so it is not kept separately
+	 */
+	struct lat_hist latency_read;
+	struct lat_hist latency_write;
+	/* latency of every LAT_OP_* kind of request */
+	struct lat_hist op_latency[LAT_OP_NR];
+	/* io size statistic buckets, the total is their sum */
+	u32 io_read_size_stats[IO_SIZE_STATS_NR];
+	u32 io_write_size_stats[IO_SIZE_STATS_NR];
+	/* log2 latency by queue depth, and the latency sum of every depth */
+	u32 qd_latency[QD_HIST_NR][LAT_LOG2_NR];
+	u64 qd_latency_sum[QD_HIST_NR];
+	/* latency statistic for block-layer buckets, if 'has_soft' */
+	struct lat_hist soft_latency_read;
+	struct lat_hist soft_latency_write;
+};
+
+/* latency_stats of every CPU added up */
+struct latency_stats_sum {
+	struct lat_hist_sum latency_read;
+	struct lat_hist_sum latency_write;
+	struct lat_hist_sum soft_latency_read;
+	struct lat_hist_sum soft_latency_write;
+	struct lat_hist_sum op_latency[LAT_OP_NR];
+	u64 io_size_stats[IO_SIZE_STATS_NR];
+	u64 io_read_size_stats[IO_SIZE_STATS_NR];
+	u64 io_write_size_stats[IO_SIZE_STATS_NR];
+	u64 qd_latency[QD_HIST_NR][LAT_LOG2_NR];
+	u64 qd_latency_sum[QD_HIST_NR];
 };
 
 int init_latency_stats(void);
 void exit_latency_stats(void);
 
-struct latency_stats __percpu *create_latency_stats(void);
+struct latency_stats __percpu *create_latency_stats(int soft);
 void destroy_latency_stats(struct latency_stats __percpu *lstats);
 
-void update_latency_stats(struct latency_stats *lstats, unsigned long stime,
-			unsigned long now, int soft, int rw);
+void reset_latency_stats(struct latency_stats __percpu *lstats);
+void retire_latency_stats(struct latency_stats *lstats);
+
+/* call on the counters of this CPU before updating them */
+static inline void sync_latency_stats(struct latency_stats *lstats)
+{
+	if (unlikely(lstats->gen != ACCESS_ONCE(lstats->shared->gen)))
+		retire_latency_stats(lstats);
+}
+
+void add_latency_stats(struct latency_stats *lstats, u64 ns, int soft, int rw);
+void add_op_latency_stats(struct latency_stats *lstats, u64 ns,
+			unsigned int ops);
+void add_qd_latency_stats(struct latency_stats *lstats, unsigned int qd,
+			u64 ns);
 void update_io_size_stats(struct latency_stats *lstats, unsigned long size,
 			int rw);
-void reset_latency_stats(struct latency_stats __percpu *lstats);
+
+struct latency_stats_sum *create_latency_stats_sum(void);
+void destroy_latency_stats_sum(struct latency_stats_sum *sum);
+void fold_latency_stats(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum);
+void fold_latency_stats_current(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum);
+void fold_latency_stats_base(struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *sum);
+void sub_latency_stats(struct latency_stats_sum *sum,
+			const struct latency_stats_sum *base);
 #endif
@@ -0,0 +1,220 @@
+/*
+ * latency_window.c
+ *
+ * IO latency of the last seconds and minutes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+
+#include "latency_window.h"
+
+static const struct {
+	unsigned int first;		/* index into lat_windows.slots */
+	unsigned int nr;
+	unsigned int ticks;		/* seconds covered by one slot */
+} tiers[LAT_WINDOW_TIERS] = {
+	{ 0, 10, 1 },
+	{ 10, 6, 10 },
+	{ 16, 10, 60 },
+};
+
+const unsigned int lat_window_seconds[LAT_WINDOW_NR] = { 1, 10, 60, 600 };
+
+static const struct {
+	int tier;
+	unsigned int nr;
+} windows[LAT_WINDOW_NR] = {
+	{ 0, 1 },
+	{ 0, 10 },
+	{ 1, 6 },
+	{ 2, 10 },
+};
+
+static void fold_cumulative(struct lat_hist_sum *latency,
+			struct lat_hist_sum *soft_latency,
+			struct latency_stats __percpu *lstats,
+			struct latency_stats_sum *cur)
+{
+	int i;
+
+	memset(cur, 0, sizeof(struct latency_stats_sum));
+	fold_latency_stats(lstats, cur);
+	for (i = 0; i < LAT_HIST_NR; i++) {
+		latency->buckets[i] = cur->latency_read.buckets[i] +
+			cur->latency_write.buckets[i];
+		soft_latency->buckets[i] = cur->soft_latency_read.buckets[i] +
+			cur->soft_latency_write.buckets[i];
+	}
+	latency->sum = cur->latency_read.sum + cur->latency_write.sum;
+	soft_latency->sum = cur->soft_latency_read.sum +
+		cur->soft_latency_write.sum;
+}
+
+struct lat_windows *lat_windows_create(struct latency_stats __percpu *lstats)
+{
+	struct lat_windows *win;
+
+	win = vmalloc(sizeof(struct lat_windows));
+	if (!win)
+		return NULL;
+	memset(win, 0, sizeof(struct lat_windows));
+	mutex_init(&win->lock);
+
+	win->cur = create_latency_stats_sum();
+	if (!win->cur) {
+		vfree(win);
+		return NULL;
+	}
+	/* the first slot only gets what happens from now on */
+	fold_cumulative(&win->prev_latency, &win->prev_soft_latency,
+			lstats, win->cur);
+	return win;
+}
+
+void lat_windows_destroy(struct lat_windows *win)
+{
+	if (win) {
+		destroy_latency_stats_sum(win->cur);
+		vfree(win);
+	}
+}
+
+/* a counter going backwards means the stats were reset in between */
+static inline u32 delta(u64 cur, u64 prev)
+{
+	return cur >= prev ? cur - prev : cur;
+}
+
+/* the slot of 'tier' written 'back' ticks of that tier ago, 0 is latest */
+static struct lat_window_slot *tier_slot(struct lat_windows *win, int tier,
+					unsigned int back)
+{
+	unsigned int nr = tiers[tier].nr;
+
+	return win->slots + tiers[tier].first +
+		(win->head[tier] + nr - 1 - back) % nr;
+}
+
+static struct lat_window_slot *next_slot(struct lat_windows *win, int tier)
+{
+	struct lat_window_slot *slot;
+
+	slot = win->slots + tiers[tier].first + win->head[tier];
+	win->head[tier] = (win->head[tier] + 1) % tiers[tier].nr;
+	return slot;
+}
+
+/* sum up all slots of 'tier' into the next slot of 'tier + 1' */
+static void promote_tier(struct lat_windows *win, int tier)
+{
+	struct lat_window_slot *dst, *src;
+	unsigned int s;
+	int i;
+
+	dst = next_slot(win, tier + 1);
+	memset(dst, 0, sizeof(struct lat_window_slot));
+	for (s = 0; s < tiers[tier].nr; s++) {
+		src = win->slots + tiers[tier].first + s;
+		for (i = 0; i < LAT_HIST_NR; i++) {
+			dst->latency[i] += src->latency[i];
+			dst->soft_latency[i] += src->soft_latency[i];
+		}
+		dst->latency_sum += src->latency_sum;
+		dst->soft_latency_sum += src->soft_latency_sum;
+	}
+}
+
+void lat_windows_tick(struct lat_windows *win,
+			struct latency_stats __percpu *lstats)
+{
+	struct lat_hist_sum *prev = &win->prev_latency;
+	struct lat_hist_sum *prev_soft = &win->prev_soft_latency;
+	struct latency_stats_sum *cur = win->cur;
+	struct lat_window_slot *slot;
+	u64 v;
+	int i, t;
+
+	mutex_lock(&win->lock);
+	memset(cur, 0, sizeof(struct latency_stats_sum));
+	fold_latency_stats(lstats, cur);
+
+	slot = next_slot(win, 0);
+	for (i = 0; i < LAT_HIST_NR; i++) {
+		v = cur->latency_read.buckets[i] +
+			cur->latency_write.buckets[i];
+		slot->latency[i] = delta(v, prev->buckets[i]);
+		prev->buckets[i] = v;
+
+		v = cur->soft_latency_read.buckets[i] +
+			cur->soft_latency_write.buckets[i];
+		slot->soft_latency[i] = delta(v, prev_soft->buckets[i]);
+		prev_soft->buckets[i] = v;
+	}
+	v = cur->latency_read.sum + cur->latency_write.sum;
+	slot->latency_sum = v >= prev->sum ? v - prev->sum : v;
+	prev->sum = v;
+	v = cur->soft_latency_read.sum + cur->soft_latency_write.sum;
+	slot->soft_latency_sum = v >= prev_soft->sum ? v - prev_soft->sum : v;
+	prev_soft->sum = v;
+
+	win->ticks++;
+	for (t = 0; t < LAT_WINDOW_TIERS - 1; t++) {
+		if (win->ticks % tiers[t + 1].ticks)
+			break;
+		promote_tier(win, t);
+	}
+	mutex_unlock(&win->lock);
+}
+
+/* highest non-empty bucket stands in for the max, slots do not keep it */
+static void set_max(struct lat_hist_sum *hist)
+{
+	int i;
+
+	hist->max = 0;
+	for (i = LAT_HIST_NR - 1; i >= 0; i--) {
+		if (hist->buckets[i]) {
+			hist->max = lat_hist_bucket_high(i);
+			break;
+		}
+	}
+}
+
+/* latency of the last lat_window_seconds[window] seconds */
+void lat_windows_sum(struct lat_windows *win, int window,
+			struct lat_hist_sum *latency,
+			struct lat_hist_sum *soft_latency)
+{
+	struct lat_window_slot *slot;
+	unsigned int s;
+	int i;
+
+	memset(latency, 0, sizeof(struct lat_hist_sum));
+	memset(soft_latency, 0, sizeof(struct lat_hist_sum));
+
+	mutex_lock(&win->lock);
+	for (s = 0; s < windows[window].nr; s++) {
+		slot = tier_slot(win, windows[window].tier, s);
+		for (i = 0; i < LAT_HIST_NR; i++) {
+			latency->buckets[i] += slot->latency[i];
+			soft_latency->buckets[i] += slot->soft_latency[i];
+		}
+		latency->sum += slot->latency_sum;
+		soft_latency->sum += slot->soft_latency_sum;
+	}
+	mutex_unlock(&win->lock);
+
+	set_max(latency);
+	set_max(soft_latency);
+}
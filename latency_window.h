@@ -0,0 +1,49 @@
+#ifndef _IO_LATENCY_WINDOW_H_
+#define _IO_LATENCY_WINDOW_H_
+
+#include <linux/mutex.h>
+
+#include "latency_stats.h"
+
+/*
+ * Latency of the last 1s / 10s / 60s / 10min, without resetting anything.
+ *
+ * Every second lat_windows_tick() folds the per-cpu counters and stores
+ * the difference to the previous fold in a 1s slot.  Every 10s the ten 1s
+ * slots are added up into a 10s slot, every 60s the six 10s slots into a
+ * 60s slot.  A window is the sum of the latest slots of one tier, so the
+ * 60s and 10min windows move in steps of 10s and 60s.
+ */
+#define LAT_WINDOW_TIERS	3
+#define LAT_WINDOW_SLOTS	(10 + 6 + 10)
+#define LAT_WINDOW_NR		4
+
+struct lat_window_slot {
+	u32 latency[LAT_HIST_NR];
+	u32 soft_latency[LAT_HIST_NR];
+	u64 latency_sum;
+	u64 soft_latency_sum;
+};
+
+struct lat_windows {
+	struct mutex lock;
+	unsigned long ticks;
+	unsigned int head[LAT_WINDOW_TIERS];
+	struct lat_window_slot slots[LAT_WINDOW_SLOTS];
+	/* cumulative counters at the previous tick */
+	struct lat_hist_sum prev_latency;
+	struct lat_hist_sum prev_soft_latency;
+	struct latency_stats_sum *cur;
+};
+
+extern const unsigned int lat_window_seconds[LAT_WINDOW_NR];
+
+struct lat_windows *lat_windows_create(struct latency_stats __percpu *lstats);
+void lat_windows_destroy(struct lat_windows *win);
+void lat_windows_tick(struct lat_windows *win,
+			struct latency_stats __percpu *lstats);
+void lat_windows_sum(struct lat_windows *win, int window,
+			struct lat_hist_sum *latency,
+			struct lat_hist_sum *soft_latency);
+
+#endif
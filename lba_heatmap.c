@@ -0,0 +1,96 @@
+/*
+ * lba_heatmap.c
+ *
+ * IO latency by LBA zone
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+
+#include "lba_heatmap.h"
+
+/* zones of 'zone_mb' MiB, 0 means no heatmap */
+struct lba_heatmap *lba_heatmap_create(sector_t capacity,
+				unsigned int zone_mb)
+{
+	struct lba_heatmap *hm;
+	size_t size;
+	u64 nr_zones;
+	int cpu;
+
+	if (!zone_mb)
+		return NULL;
+	hm = kzalloc(sizeof(struct lba_heatmap), GFP_KERNEL);
+	if (!hm)
+		return NULL;
+
+	/* a MiB is 2^11 sectors */
+	hm->zone_shift = ilog2(roundup_pow_of_two(zone_mb)) + 11;
+	for (;;) {
+		nr_zones = ((u64)capacity + (1ULL << hm->zone_shift) - 1) >>
+				hm->zone_shift;
+		if (nr_zones <= HEATMAP_MAX_ZONES)
+			break;
+		hm->zone_shift++;
+	}
+	hm->nr_zones = max_t(unsigned int, nr_zones, 1);
+
+	hm->counts = kzalloc(sizeof(unsigned long *) * nr_cpu_ids,
+			GFP_KERNEL);
+	if (!hm->counts)
+		goto err;
+	/* too big for alloc_percpu() on 2.6.32 */
+	size = sizeof(unsigned long) * hm->nr_zones * LAT_LOG2_NR;
+	for_each_possible_cpu(cpu) {
+		hm->counts[cpu] = vmalloc(size);
+		if (!hm->counts[cpu])
+			goto err;
+		memset(hm->counts[cpu], 0, size);
+	}
+	return hm;
+err:
+	lba_heatmap_destroy(hm);
+	return NULL;
+}
+
+void lba_heatmap_destroy(struct lba_heatmap *hm)
+{
+	int cpu;
+
+	if (!hm)
+		return;
+	if (hm->counts) {
+		for_each_possible_cpu(cpu)
+			vfree(hm->counts[cpu]);
+		kfree(hm->counts);
+	}
+	kfree(hm);
+}
+
+/* add up the counters of every CPU into 'counts', zone after zone */
+void lba_heatmap_fold(struct lba_heatmap *hm, u64 *counts)
+{
+	unsigned int i, nr = hm->nr_zones * LAT_LOG2_NR;
+	unsigned long *pcounts;
+	int cpu;
+
+	memset(counts, 0, sizeof(u64) * nr);
+	for_each_possible_cpu(cpu) {
+		pcounts = hm->counts[cpu];
+		for (i = 0; i < nr; i++)
+			counts[i] += pcounts[i];
+	}
+}
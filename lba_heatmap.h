@@ -0,0 +1,45 @@
+#ifndef _IO_LATENCY_LBA_HEATMAP_H_
+#define _IO_LATENCY_LBA_HEATMAP_H_
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+
+#include "histogram.h"
+
+/*
+ * Latency by LBA zone of a device.
+ *
+ * The disk is cut into 'nr_zones' zones of 2^zone_shift sectors, every
+ * zone has LAT_LOG2_NR log2 latency buckets.  The zone size asked for is
+ * doubled until the disk fits into HEATMAP_MAX_ZONES zones, which bounds
+ * the memory to HEATMAP_MAX_ZONES * LAT_LOG2_NR counters per CPU.
+ */
+#define HEATMAP_MAX_ZONES	512
+
+struct lba_heatmap {
+	unsigned int zone_shift;
+	unsigned int nr_zones;
+	/* nr_zones * LAT_LOG2_NR counters of every possible CPU */
+	unsigned long **counts;
+};
+
+/* called from the hooks of the device, never sleeps */
+static inline void lba_heatmap_add(struct lba_heatmap *hm, sector_t sector,
+				u64 ns)
+{
+	u64 zone;
+
+	if (!hm)
+		return;
+	/* the disk may have grown since, count that into the last zone */
+	zone = min_t(u64, (u64)sector >> hm->zone_shift, hm->nr_zones - 1);
+	hm->counts[smp_processor_id()]
+		[zone * LAT_LOG2_NR + lat_log2_index(ns)]++;
+}
+
+struct lba_heatmap *lba_heatmap_create(sector_t capacity,
+				unsigned int zone_mb);
+void lba_heatmap_destroy(struct lba_heatmap *hm);
+void lba_heatmap_fold(struct lba_heatmap *hm, u64 *counts);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * outlier_ring.c
+ *
+ * per-cpu rings of the slowest I/Os
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+
+#include "compat.h"
+#include "outlier_ring.h"
+
+/* leave room for the header to grow, rings start on a cache line */
+#define OUTLIER_RING_OFFSET	64
+
+static struct io_latency_outlier_ring *get_ring(struct outlier_ring *ring,
+						int cpu)
+{
+	struct io_latency_outlier_header *hdr = ring->region;
+
+	return ring->region + hdr->ring_offset + cpu * hdr->ring_stride;
+}
+
+static struct io_latency_outlier *get_record(
+		struct io_latency_outlier_ring *r, unsigned int ring_size,
+		u64 n)
+{
+	return (struct io_latency_outlier *)(r + 1) + (n & (ring_size - 1));
+}
+
+/* 'ring_size' records per CPU, rounded up to a power of two */
+struct outlier_ring *outlier_ring_create(unsigned int ring_size)
+{
+	struct io_latency_outlier_header *hdr;
+	struct outlier_ring *ring;
+	size_t stride;
+
+	if (!ring_size)
+		return NULL;
+	ring = kzalloc(sizeof(struct outlier_ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+	ring->ring_size = roundup_pow_of_two(min_t(unsigned int, ring_size,
+				OUTLIER_RING_SIZE_MAX));
+	mutex_init(&ring->lock);
+	ring->tail = kzalloc(sizeof(u64) * nr_cpu_ids, GFP_KERNEL);
+	if (!ring->tail)
+		goto err;
+
+	stride = sizeof(struct io_latency_outlier_ring) +
+		sizeof(struct io_latency_outlier) * ring->ring_size;
+	ring->size = PAGE_ALIGN(OUTLIER_RING_OFFSET + stride * nr_cpu_ids);
+	/* zeroed and allowed to be mapped by remap_vmalloc_range() */
+	ring->region = vmalloc_user(ring->size);
+	if (!ring->region)
+		goto err;
+
+	hdr = ring->region;
+	hdr->nr_cpus = nr_cpu_ids;
+	hdr->ring_size = ring->ring_size;
+	hdr->record_size = sizeof(struct io_latency_outlier);
+	hdr->ring_offset = OUTLIER_RING_OFFSET;
+	hdr->ring_stride = stride;
+	return ring;
+err:
+	outlier_ring_destroy(ring);
+	return NULL;
+}
+
+void outlier_ring_destroy(struct outlier_ring *ring)
+{
+	if (!ring)
+		return;
+	vfree(ring->region);
+	kfree(ring->tail);
+	kfree(ring);
+}
+
+/*
+ * log 'rec' on this CPU, its seq is filled in here.  Interrupts are off
+ * so that a completion interrupting another one cannot take its record.
+ */
+void outlier_ring_add(struct outlier_ring *ring,
+			struct io_latency_outlier *rec)
+{
+	struct io_latency_outlier_ring *r;
+	struct io_latency_outlier *e;
+	unsigned long flags;
+	u64 n;
+
+	local_irq_save(flags);
+	r = get_ring(ring, smp_processor_id());
+	n = r->head;
+	e = get_record(r, ring->ring_size, n);
+
+	/* readers of the old record see it change under them */
+	ACCESS_ONCE(e->seq) = 0;
+	smp_wmb();
+	memcpy((char *)e + sizeof(e->seq), (char *)rec + sizeof(rec->seq),
+			sizeof(struct io_latency_outlier) - sizeof(e->seq));
+	smp_wmb();
+	ACCESS_ONCE(e->seq) = n + 1;
+	smp_wmb();
+	ACCESS_ONCE(r->head) = n + 1;
+	local_irq_restore(flags);
+}
+
+/*
+ * copy the records of every CPU logged since the previous call into
+ * 'out', which has room for all rings, and add the records that were
+ * overwritten before they could be copied to '*dropped'.  Returns the
+ * number of records copied.
+ */
+int outlier_ring_consume(struct outlier_ring *ring,
+			struct io_latency_outlier *out, u64 *dropped)
+{
+	struct io_latency_outlier_ring *r;
+	struct io_latency_outlier *e;
+	u64 head, tail, seq;
+	int cpu, nr = 0;
+
+	mutex_lock(&ring->lock);
+	for_each_possible_cpu(cpu) {
+		r = get_ring(ring, cpu);
+		head = ACCESS_ONCE(r->head);
+		smp_rmb();
+		tail = ring->tail[cpu];
+		if (head - tail > ring->ring_size) {
+			*dropped += head - ring->ring_size - tail;
+			tail = head - ring->ring_size;
+		}
+		for (; tail < head; tail++) {
+			e = get_record(r, ring->ring_size, tail);
+			seq = ACCESS_ONCE(e->seq);
+			smp_rmb();
+			memcpy(out + nr, e, sizeof(struct io_latency_outlier));
+			smp_rmb();
+			if (seq != tail + 1 || ACCESS_ONCE(e->seq) != seq)
+				(*dropped)++;
+			else
+				nr++;
+		}
+		ring->tail[cpu] = head;
+	}
+	mutex_unlock(&ring->lock);
+	return nr;
+}
@@ -0,0 +1,35 @@
+#ifndef _IO_LATENCY_OUTLIER_RING_H_
+#define _IO_LATENCY_OUTLIER_RING_H_
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+
+#include "io_latency_abi.h"
+
+/*
+ * The I/Os of a device that were slower than its outlier threshold.
+ *
+ * Every CPU logs the completions it sees into its own ring and never
+ * waits for a reader: the oldest records are overwritten and readers
+ * count them as dropped.  All rings live in one region that can be
+ * mmap()ed, the layout is described in io_latency_abi.h.
+ */
+#define OUTLIER_RING_SIZE_MAX	65536
+
+struct outlier_ring {
+	void *region;
+	size_t size;
+	unsigned int ring_size;
+	/* next record of every CPU outliers.bin returns, under 'lock' */
+	u64 *tail;
+	struct mutex lock;
+};
+
+struct outlier_ring *outlier_ring_create(unsigned int ring_size);
+void outlier_ring_destroy(struct outlier_ring *ring);
+void outlier_ring_add(struct outlier_ring *ring,
+			struct io_latency_outlier *rec);
+int outlier_ring_consume(struct outlier_ring *ring,
+			struct io_latency_outlier *out, u64 *dropped);
+
+#endif
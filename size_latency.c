@@ -0,0 +1,66 @@
+/*
+ * size_latency.c
+ *
+ * IO latency by IO size
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "size_latency.h"
+
+struct size_lat *size_lat_create(void)
+{
+	struct size_lat *sl;
+
+	sl = kzalloc(sizeof(struct size_lat), GFP_KERNEL);
+	if (!sl)
+		return NULL;
+	sl->counts = alloc_percpu(struct size_lat_counts);
+	if (!sl->counts) {
+		kfree(sl);
+		return NULL;
+	}
+	return sl;
+}
+
+void size_lat_destroy(struct size_lat *sl)
+{
+	if (!sl)
+		return;
+	free_percpu(sl->counts);
+	kfree(sl);
+}
+
+/*
+ * add up the counters of direction 'rw'.  A fold racing with a spill may
+ * be off by SIZE_LAT_SPILL for that bucket, once every 2^31 I/Os of it.
+ */
+void size_lat_fold(struct size_lat *sl, int rw,
+			u64 counts[SIZE_LOG2_NR][LAT_LOG2_NR])
+{
+	struct size_lat_counts *pc;
+	int s, l, cpu;
+
+	for (s = 0; s < SIZE_LOG2_NR; s++) {
+		for (l = 0; l < LAT_LOG2_NR; l++)
+			counts[s][l] = atomic64_read(&sl->spill[rw][s][l]);
+	}
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(sl->counts, cpu);
+		for (s = 0; s < SIZE_LOG2_NR; s++) {
+			for (l = 0; l < LAT_LOG2_NR; l++)
+				counts[s][l] += pc->c[rw][s][l];
+		}
+	}
+}
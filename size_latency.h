@@ -0,0 +1,62 @@
+#ifndef _IO_LATENCY_SIZE_LATENCY_H_
+#define _IO_LATENCY_SIZE_LATENCY_H_
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <asm/atomic.h>
+
+#include "histogram.h"
+#include "latency_stats.h"
+
+/*
+ * Hardware latency by I/O size, per direction.
+ *
+ * Size bucket 0 counts I/Os below 4KiB, bucket i > 0 the ones of
+ * [2^(i+11), 2^(i+12)) bytes and the last one also everything larger;
+ * latencies use the log2 buckets of histogram.h.  To fit many disks the
+ * per-cpu counters are only 32 bit: a counter that reaches
+ * SIZE_LAT_SPILL is moved into the shared 64 bit total of its bucket.
+ */
+#define SIZE_LOG2_NR		10
+#define SIZE_LOG2_SHIFT		12
+#define SIZE_LAT_SPILL		(1U << 31)
+
+struct size_lat_counts {
+	u32 c[2][SIZE_LOG2_NR][LAT_LOG2_NR];
+};
+
+struct size_lat {
+	struct size_lat_counts __percpu *counts;
+	atomic64_t spill[2][SIZE_LOG2_NR][LAT_LOG2_NR];
+};
+
+static inline unsigned int size_log2_index(unsigned int bytes)
+{
+	unsigned int idx = fls(bytes >> SIZE_LOG2_SHIFT);
+
+	return idx < SIZE_LOG2_NR ? idx : SIZE_LOG2_NR - 1;
+}
+
+/* called from the hooks of the device, never sleeps */
+static inline void size_lat_add(struct size_lat *sl, int rw,
+				unsigned int size_idx, u64 ns)
+{
+	unsigned int lat = lat_log2_index(ns);
+	u32 *c;
+
+	if (!sl)
+		return;
+	c = &per_cpu_ptr(sl->counts, smp_processor_id())->c[rw][size_idx][lat];
+	if (unlikely(++*c == SIZE_LAT_SPILL)) {
+		*c = 0;
+		atomic64_add(SIZE_LAT_SPILL, &sl->spill[rw][size_idx][lat]);
+	}
+}
+
+struct size_lat *size_lat_create(void);
+void size_lat_destroy(struct size_lat *sl);
+void size_lat_fold(struct size_lat *sl, int rw,
+			u64 counts[SIZE_LOG2_NR][LAT_LOG2_NR]);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * snapshot.c
+ *
+ * versioned binary snapshots of the statistics of a device
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+
+#include "snapshot.h"
+
+/* bytes needed by snapshot_add_latency_stats() plus the header */
+size_t latency_stats_snapshot_size(void)
+{
+	return sizeof(struct io_latency_snapshot_header) +
+		(4 + LAT_OP_NR) * SNAPSHOT_LAT_HIST_SIZE +
+		2 * SNAPSHOT_SECTION_SIZE(IO_SIZE_STATS_NR) +
+		QD_HIST_NR * SNAPSHOT_SECTION_SIZE(LAT_LOG2_NR + 1);
+}
+
+void snapshot_init(struct snapshot_buf *sb, void *data, size_t size,
+			struct gendisk *disk)
+{
+	struct io_latency_snapshot_header *hdr = data;
+
+	memset(data, 0, size);
+	sb->data = data;
+	sb->size = size;
+	sb->len = sizeof(struct io_latency_snapshot_header);
+
+	hdr->magic = IO_LATENCY_SNAPSHOT_MAGIC;
+	hdr->version = IO_LATENCY_SNAPSHOT_VERSION;
+	hdr->header_size = sizeof(struct io_latency_snapshot_header);
+	hdr->total_size = sb->len;
+	hdr->realtime_ns = ktime_to_ns(ktime_get_real());
+	hdr->monotonic_ns = ktime_to_ns(ktime_get());
+	if (disk) {
+		hdr->major = MAJOR(disk_devt(disk));
+		hdr->minor = MINOR(disk_devt(disk));
+		strncpy(hdr->disk_name, disk->disk_name,
+				IO_LATENCY_DISK_NAME_LEN - 1);
+	}
+	hdr->lat_sub_bits = LAT_HIST_SUB_BITS;
+	hdr->lat_unit_shift = LAT_HIST_UNIT_SHIFT;
+	hdr->lat_nr = LAT_HIST_NR;
+	hdr->size_grain = IO_SIZE_STATS_GRAINSIZE;
+	hdr->size_nr = IO_SIZE_STATS_NR;
+	hdr->sample_rate = 1;
+}
+
+struct snapshot_buf *snapshot_create(size_t size, struct gendisk *disk)
+{
+	struct snapshot_buf *sb;
+	void *data;
+
+	sb = kzalloc(sizeof(struct snapshot_buf), GFP_KERNEL);
+	if (!sb)
+		return NULL;
+	data = vmalloc(size);
+	if (!data) {
+		kfree(sb);
+		return NULL;
+	}
+	snapshot_init(sb, data, size, disk);
+	return sb;
+}
+
+void snapshot_destroy(struct snapshot_buf *sb)
+{
+	if (sb) {
+		vfree(sb->data);
+		kfree(sb);
+	}
+}
+
+/* append a section header and return where its 'nr' values go */
+u64 *snapshot_add_section(struct snapshot_buf *sb, u16 type, u16 id, u32 nr)
+{
+	struct io_latency_snapshot_header *hdr = sb->data;
+	struct io_latency_section *sect;
+
+	if (sb->len + SNAPSHOT_SECTION_SIZE(nr) > sb->size) {
+		WARN_ON_ONCE(1);
+		return NULL;
+	}
+	sect = sb->data + sb->len;
+	sect->type = type;
+	sect->id = id;
+	sect->nr = nr;
+	sb->len += SNAPSHOT_SECTION_SIZE(nr);
+	hdr->total_size = sb->len;
+	hdr->nr_sections++;
+	return (u64 *)(sect + 1);
+}
+
+void snapshot_add_lat_hist(struct snapshot_buf *sb, u16 type, u16 id,
+			const struct lat_hist_sum *hist)
+{
+	u64 *val;
+
+	val = snapshot_add_section(sb, type, id, LAT_HIST_NR + 2);
+	if (!val)
+		return;
+	memcpy(val, hist->buckets, sizeof(u64) * LAT_HIST_NR);
+	val[LAT_HIST_NR] = hist->sum;
+	val[LAT_HIST_NR + 1] = hist->max;
+}
+
+void snapshot_add_latency_stats(struct snapshot_buf *sb,
+			const struct latency_stats_sum *sum)
+{
+	u64 *val;
+	int i;
+
+	snapshot_add_lat_hist(sb, IO_LATENCY_SECT_LATENCY_READ, 0,
+			&sum->latency_read);
+	snapshot_add_lat_hist(sb, IO_LATENCY_SECT_LATENCY_WRITE, 0,
+			&sum->latency_write);
+	snapshot_add_lat_hist(sb, IO_LATENCY_SECT_SOFT_LATENCY_READ, 0,
+			&sum->soft_latency_read);
+	snapshot_add_lat_hist(sb, IO_LATENCY_SECT_SOFT_LATENCY_WRITE, 0,
+			&sum->soft_latency_write);
+	/* LAT_OP_* are the IO_LATENCY_OP_* of the ABI */
+	for (i = 0; i < LAT_OP_NR; i++)
+		snapshot_add_lat_hist(sb, IO_LATENCY_SECT_OP_LATENCY, i,
+				&sum->op_latency[i]);
+
+	val = snapshot_add_section(sb, IO_LATENCY_SECT_SIZE_READ, 0,
+			IO_SIZE_STATS_NR);
+	if (val)
+		memcpy(val, sum->io_read_size_stats,
+				sizeof(u64) * IO_SIZE_STATS_NR);
+	val = snapshot_add_section(sb, IO_LATENCY_SECT_SIZE_WRITE, 0,
+			IO_SIZE_STATS_NR);
+	if (val)
+		memcpy(val, sum->io_write_size_stats,
+				sizeof(u64) * IO_SIZE_STATS_NR);
+
+	for (i = 0; i < QD_HIST_NR; i++) {
+		val = snapshot_add_section(sb, IO_LATENCY_SECT_QD_LATENCY, i,
+				LAT_LOG2_NR + 1);
+		if (!val)
+			break;
+		memcpy(val, sum->qd_latency[i], sizeof(u64) * LAT_LOG2_NR);
+		val[LAT_LOG2_NR] = sum->qd_latency_sum[i];
+	}
+}
+
+/* keep the snapshot cache line aligned behind the mmap header */
+#define SHARED_SNAPSHOT_OFFSET	64
+
+struct shared_stats *shared_stats_create(struct gendisk *disk)
+{
+	struct io_latency_mmap_header *hdr;
+	struct shared_stats *ss;
+
+	ss = kzalloc(sizeof(struct shared_stats), GFP_KERNEL);
+	if (!ss)
+		return NULL;
+	ss->disk = disk;
+	ss->size = PAGE_ALIGN(SHARED_SNAPSHOT_OFFSET +
+			latency_stats_snapshot_size());
+	/* zeroed and allowed to be mapped by remap_vmalloc_range() */
+	ss->region = vmalloc_user(ss->size);
+	if (!ss->region)
+		goto err;
+	ss->sum = create_latency_stats_sum();
+	if (!ss->sum)
+		goto err;
+
+	hdr = ss->region;
+	hdr->snapshot_offset = SHARED_SNAPSHOT_OFFSET;
+	hdr->region_size = ss->size;
+	return ss;
+err:
+	shared_stats_destroy(ss);
+	return NULL;
+}
+
+void shared_stats_destroy(struct shared_stats *ss)
+{
+	if (ss) {
+		destroy_latency_stats_sum(ss->sum);
+		vfree(ss->region);
+		kfree(ss);
+	}
+}
+
+/*
+ * fold the per-cpu counters since the last reset outside of the write
+ * side of the seqcount, then copy them in, so readers only retry for the
+ * time of a memcpy
+ */
+void shared_stats_update(struct shared_stats *ss,
+			struct latency_stats __percpu *lstats,
+			unsigned int interval_ms, unsigned int sample_rate)
+{
+	struct io_latency_mmap_header *hdr = ss->region;
+	struct snapshot_buf sb;
+
+	fold_latency_stats_current(lstats, ss->sum);
+
+	ACCESS_ONCE(hdr->seq) = hdr->seq + 1;
+	smp_wmb();
+	hdr->fold_interval_ms = interval_ms;
+	snapshot_init(&sb, ss->region + SHARED_SNAPSHOT_OFFSET,
+			ss->size - SHARED_SNAPSHOT_OFFSET, ss->disk);
+	snapshot_set_sample_rate(&sb, sample_rate);
+	snapshot_add_latency_stats(&sb, ss->sum);
+	smp_wmb();
+	ACCESS_ONCE(hdr->seq) = hdr->seq + 1;
+}
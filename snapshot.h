@@ -0,0 +1,64 @@
+#ifndef _IO_LATENCY_SNAPSHOT_H_
+#define _IO_LATENCY_SNAPSHOT_H_
+
+#include <linux/genhd.h>
+
+#include "io_latency_abi.h"
+#include "latency_stats.h"
+
+/* a binary snapshot being built, see io_latency_abi.h for the layout */
+struct snapshot_buf {
+	void *data;
+	size_t size;
+	size_t len;
+};
+
+#define SNAPSHOT_SECTION_SIZE(nr)	\
+	(sizeof(struct io_latency_section) + sizeof(u64) * (nr))
+#define SNAPSHOT_LAT_HIST_SIZE		SNAPSHOT_SECTION_SIZE(LAT_HIST_NR + 2)
+
+size_t latency_stats_snapshot_size(void);
+
+/* region shared with userspace through mmap, see io_latency_abi.h */
+struct shared_stats {
+	void *region;
+	size_t size;
+	struct latency_stats_sum *sum;
+	struct gendisk *disk;
+};
+
+void snapshot_init(struct snapshot_buf *sb, void *data, size_t size,
+			struct gendisk *disk);
+struct snapshot_buf *snapshot_create(size_t size, struct gendisk *disk);
+void snapshot_destroy(struct snapshot_buf *sb);
+
+static inline void snapshot_set_sample_rate(struct snapshot_buf *sb,
+					unsigned int rate)
+{
+	struct io_latency_snapshot_header *hdr = sb->data;
+
+	hdr->sample_rate = rate;
+}
+
+/* for snapshots of something else than a disk */
+static inline void snapshot_set_name(struct snapshot_buf *sb,
+				const char *name)
+{
+	struct io_latency_snapshot_header *hdr = sb->data;
+
+	strncpy(hdr->disk_name, name, IO_LATENCY_DISK_NAME_LEN - 1);
+}
+
+u64 *snapshot_add_section(struct snapshot_buf *sb, u16 type, u16 id, u32 nr);
+void snapshot_add_lat_hist(struct snapshot_buf *sb, u16 type, u16 id,
+			const struct lat_hist_sum *hist);
+void snapshot_add_latency_stats(struct snapshot_buf *sb,
+			const struct latency_stats_sum *sum);
+
+struct shared_stats *shared_stats_create(struct gendisk *disk);
+void shared_stats_destroy(struct shared_stats *ss);
+void shared_stats_update(struct shared_stats *ss,
+			struct latency_stats __percpu *lstats,
+			unsigned int interval_ms, unsigned int sample_rate);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * hash_table_bench.c
+ *
+ * measure how hash_table_find() scales with the number of CPUs doing
+ * lookups at the same time, results are printed to the kernel log:
+ *
+ *	make bench && insmod hash-table-bench.ko && rmmod hash-table-bench
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "../hash_table.h"
+
+static int nr_keys = 4096;
+module_param(nr_keys, int, 0444);
+MODULE_PARM_DESC(nr_keys, "number of keys in the table");
+
+static int nr_ops = 1000000;
+module_param(nr_ops, int, 0444);
+MODULE_PARM_DESC(nr_ops, "lookups done by every thread");
+
+static int update_pct;
+module_param(update_pct, int, 0444);
+MODULE_PARM_DESC(update_pct, "percent of operations doing set+remove");
+
+static struct hash_table *bench_table;
+static atomic_t bench_ready;
+static atomic_t bench_running;
+static struct completion bench_start;
+static struct completion bench_done;
+
+/* looks like the request pointers the module really hashes */
+static unsigned long bench_key(unsigned int i)
+{
+	return 0xffff880000000000UL + (unsigned long)i * 256;
+}
+
+static int bench_thread(void *data)
+{
+	unsigned int seed = (unsigned long)data * 2654435761U + 1;
+	unsigned long key, value;
+	int i;
+
+	atomic_inc(&bench_ready);
+	wait_for_completion(&bench_start);
+
+	for (i = 0; i < nr_ops; i++) {
+		seed = seed * 1103515245 + 12345;
+		key = bench_key((seed >> 8) % nr_keys);
+		if (update_pct && (seed >> 24) % 100 < update_pct) {
+			/* remove then set back, like dispatch/finish do */
+			hash_table_find_and_remove(bench_table, key, &value);
+			hash_table_set(bench_table, key, key);
+		} else
+			hash_table_find(bench_table, key, &value);
+	}
+
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+	return 0;
+}
+
+static int run_bench(int nr_threads)
+{
+	struct task_struct *task;
+	ktime_t start;
+	s64 ns;
+	int cpu, n = 0;
+
+	atomic_set(&bench_ready, 0);
+	init_completion(&bench_start);
+	init_completion(&bench_done);
+
+	for_each_online_cpu(cpu) {
+		if (n == nr_threads)
+			break;
+		task = kthread_create(bench_thread, (void *)(long)n,
+				"ht-bench/%d", cpu);
+		if (IS_ERR(task))
+			break;
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		n++;
+	}
+	if (!n)
+		return -ENOMEM;
+	/* threads only finish after bench_start, safe to set it late */
+	atomic_set(&bench_running, n);
+
+	while (atomic_read(&bench_ready) != n)
+		schedule_timeout_uninterruptible(1);
+
+	start = ktime_get();
+	complete_all(&bench_start);
+	wait_for_completion(&bench_done);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	printk(KERN_INFO "hash-table-bench: cpus %3d  %8lld ns total  "
+			"%5lld ns/op  %6llu kops/s\n",
+			n, ns, div_s64(ns, nr_ops),
+			div64_u64((u64)nr_ops * n * 1000000, ns ? ns : 1));
+	return 0;
+}
+
+static int __init hash_table_bench_init(void)
+{
+	int i, cpus, res = 0;
+
+	bench_table = create_hash_table("hash-table-bench", nr_keys);
+	if (!bench_table)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_keys; i++) {
+		res = hash_table_insert(bench_table, bench_key(i), i);
+		if (res)
+			goto out;
+	}
+
+	printk(KERN_INFO "hash-table-bench: %d keys, %d buckets, "
+			"%d ops/thread, %d%% updates\n",
+			nr_keys, bench_table->buckets->nr_ent, nr_ops,
+			update_pct);
+	for (cpus = 1; ; cpus *= 2) {
+		if (cpus > num_online_cpus())
+			cpus = num_online_cpus();
+		res = run_bench(cpus);
+		if (res || cpus == num_online_cpus())
+			break;
+	}
+out:
+	destroy_hash_table(bench_table);
+	return res;
+}
+
+static void __exit hash_table_bench_exit(void)
+{
+}
+
+module_init(hash_table_bench_init)
+module_exit(hash_table_bench_exit)
+MODULE_DESCRIPTION("Scalability benchmark for io-latency hash table");
+MODULE_LICENSE("GPL");
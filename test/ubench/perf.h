@@ -0,0 +1,14 @@
+#ifndef _IO_LATENCY_UBENCH_PERF_H_
+#define _IO_LATENCY_UBENCH_PERF_H_
+
+/*
+ * cache misses of the calling thread in user mode, built apart from the
+ * shim since it needs the real uapi headers.  A negative fd means perf
+ * events are not available, the others then do nothing.
+ */
+int cache_misses_open(void);
+void cache_misses_start(int fd);
+/* 0 and the count in 'misses' on success, closes 'fd' */
+int cache_misses_stop(int fd, unsigned long long *misses);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * ubench.c
+ *
+ * microbenchmarks of the hot paths of io-latency in userspace: the
+ * accounting of latency_stats.c and the request table of hash_table.c,
+ * built unmodified against ushim.h.  Every thread plays one CPU, is
+ * pinned to it when possible and reports ns per operation and, where
+ * perf events are allowed, cache misses per operation:
+ *
+ *	make ubench && test/ubench/ubench [-n ops] [-t threads] [-q depth]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "latency_stats.h"
+#include "hash_table.h"
+#include "perf.h"
+
+/* samples every thread cycles through, drawn before timing starts */
+#define NR_SAMPLES		4096
+
+static int nr_ops = 2000000;
+static int max_threads;
+static int queue_depth = 32;
+
+static struct latency_stats __percpu *bench_lstats;
+static struct hash_table *bench_table;
+
+struct bench_thread {
+	pthread_t tid;
+	int cpu;
+	u64 lat[NR_SAMPLES];
+	unsigned int size[NR_SAMPLES];
+	u64 ns;
+	unsigned long long misses;
+	int has_misses;
+};
+
+struct bench {
+	const char *name;
+	const char *what;
+	void (*fn)(struct bench_thread *t);
+	/* only run with one thread */
+	int single;
+};
+
+static pthread_barrier_t bench_barrier;
+static struct bench *bench_cur;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u32 xorshift(u32 *seed)
+{
+	u32 x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static double uniform(u32 *seed)
+{
+	return (xorshift(seed) + 1.0) / 4294967297.0;
+}
+
+/* lognormal around 'median' ns */
+static u64 lognormal(u32 *seed, double median, double sigma)
+{
+	double z = sqrt(-2 * log(uniform(seed))) *
+		cos(2 * M_PI * uniform(seed));
+
+	return (u64)(median * exp(sigma * z));
+}
+
+/*
+ * a flash disk: most I/Os around 80us, some queued behind others around
+ * 1ms and a tail of slow ones around 20ms
+ */
+static u64 draw_latency(u32 *seed)
+{
+	u32 p = xorshift(seed) % 100;
+
+	if (p < 80)
+		return lognormal(seed, 80000, 0.5);
+	if (p < 95)
+		return lognormal(seed, 1000000, 0.8);
+	return lognormal(seed, 20000000, 1.0);
+}
+
+/* mostly 4K, then 8K, 16K-64K, 128K and 512K-1M */
+static unsigned int draw_size(u32 *seed)
+{
+	u32 p = xorshift(seed) % 100;
+
+	if (p < 60)
+		return 4096;
+	if (p < 75)
+		return 8192;
+	if (p < 85)
+		return 16384 << (xorshift(seed) % 3);
+	if (p < 95)
+		return 131072;
+	return 524288 << (xorshift(seed) % 2);
+}
+
+/* completion of a request: hardware and soft latency, then its size */
+static void bench_latency(struct bench_thread *t)
+{
+	struct latency_stats *lstats;
+	int i, s;
+
+	for (i = 0; i < nr_ops; i++) {
+		s = i & (NR_SAMPLES - 1);
+		lstats = this_cpu_ptr(bench_lstats);
+		add_latency_stats(lstats, t->lat[s], 0, i & 1);
+	}
+}
+
+static void bench_soft_latency(struct bench_thread *t)
+{
+	struct latency_stats *lstats;
+	int i, s;
+
+	for (i = 0; i < nr_ops; i++) {
+		s = i & (NR_SAMPLES - 1);
+		lstats = this_cpu_ptr(bench_lstats);
+		add_latency_stats(lstats, t->lat[s] >> 4, 1, i & 1);
+	}
+}
+
+static void bench_io_size(struct bench_thread *t)
+{
+	struct latency_stats *lstats;
+	int i;
+
+	for (i = 0; i < nr_ops; i++) {
+		lstats = this_cpu_ptr(bench_lstats);
+		update_io_size_stats(lstats, t->size[i & (NR_SAMPLES - 1)],
+				i & 1);
+	}
+}
+
+static void bench_qd_latency(struct bench_thread *t)
+{
+	struct latency_stats *lstats;
+	int i, s;
+
+	for (i = 0; i < nr_ops; i++) {
+		s = i & (NR_SAMPLES - 1);
+		lstats = this_cpu_ptr(bench_lstats);
+		add_qd_latency_stats(lstats, qd_hist_index(t->size[s] >> 12),
+				t->lat[s]);
+	}
+}
+
+/* request pointers from a per-cpu pool, like a mempool hands them out */
+static unsigned long request_key(struct bench_thread *t, int i)
+{
+	return 0xffff890000000000UL + ((unsigned long)t->cpu << 24) +
+		(unsigned long)(i % (4 * queue_depth)) * 256;
+}
+
+/*
+ * what the hooks do to the request table with USE_HASH_TABLE:
+ * get_request_wait sets the stamp, blk_start_request swaps in the
+ * dispatch time, blk_finish_request takes it out.  'queue_depth'
+ * requests of every thread are in flight; one operation is one request.
+ */
+static void bench_request_table(struct bench_thread *t)
+{
+	unsigned long value;
+	int i;
+
+	for (i = 0; i < nr_ops + queue_depth; i++) {
+		if (i >= queue_depth)
+			hash_table_find_and_remove(bench_table,
+					request_key(t, i - queue_depth),
+					&value);
+		if (i >= queue_depth / 2 && i < nr_ops + queue_depth / 2)
+			hash_table_exchange(bench_table,
+					request_key(t, i - queue_depth / 2),
+					i, NULL);
+		if (i < nr_ops)
+			hash_table_set(bench_table, request_key(t, i), i);
+		if (!(i & 1023))
+			ushim_quiescent();
+	}
+}
+
+/* lookups alone, of keys some other thread inserted */
+static void bench_find(struct bench_thread *t)
+{
+	unsigned long value;
+	u32 seed = t->cpu + 1;
+	int i;
+
+	for (i = 0; i < nr_ops; i++)
+		hash_table_find(bench_table, 0xffff880000000000UL +
+				(unsigned long)(xorshift(&seed) % 8192) * 256,
+				&value);
+}
+
+/* what a reader of stats.bin or percentiles pays, per fold */
+static void bench_fold(struct bench_thread *t)
+{
+	struct latency_stats_sum *sum;
+	int i;
+
+	sum = create_latency_stats_sum();
+	for (i = 0; i < nr_ops; i++) {
+		memset(sum, 0, sizeof(*sum));
+		fold_latency_stats(bench_lstats, sum);
+	}
+	destroy_latency_stats_sum(sum);
+}
+
+/*
+ * a reset, then the first update after it on this CPU, which retires
+ * what the CPU counted before
+ */
+static void bench_reset(struct bench_thread *t)
+{
+	struct latency_stats *lstats;
+	int i, s;
+
+	for (i = 0; i < nr_ops; i++) {
+		s = i & (NR_SAMPLES - 1);
+		reset_latency_stats(bench_lstats);
+		lstats = this_cpu_ptr(bench_lstats);
+		sync_latency_stats(lstats);
+		add_latency_stats(lstats, t->lat[s], 0, i & 1);
+	}
+}
+
+static struct bench benches[] = {
+	{ "latency", "add_latency_stats()", bench_latency },
+	{ "soft_latency", "add_latency_stats(soft)", bench_soft_latency },
+	{ "io_size", "update_io_size_stats()", bench_io_size },
+	{ "qd_latency", "add_qd_latency_stats()", bench_qd_latency },
+	{ "request_table", "set+exchange+find_and_remove", bench_request_table },
+	{ "find", "hash_table_find()", bench_find },
+	{ "fold", "fold_latency_stats()", bench_fold, 1 },
+	{ "reset", "reset_latency_stats()+sync", bench_reset, 1 },
+};
+
+static void *bench_thread_fn(void *data)
+{
+	struct bench_thread *t = data;
+	cpu_set_t set;
+	u64 start;
+	int fd;
+
+	ushim_cpu = t->cpu;
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	ushim_thread_start();
+
+	fd = cache_misses_open();
+	pthread_barrier_wait(&bench_barrier);
+	cache_misses_start(fd);
+	start = now_ns();
+	bench_cur->fn(t);
+	t->ns = now_ns() - start;
+	t->has_misses = !cache_misses_stop(fd, &t->misses);
+	ushim_thread_stop();
+	return NULL;
+}
+
+static void run(struct bench *b, struct bench_thread *threads, int nr)
+{
+	unsigned long long misses = 0;
+	u64 ns = 0;
+	int i, has_misses = 1;
+	/* the fold is slow, keep it to a few thousand */
+	int ops = b->single ? nr_ops / 1000 + 1 : nr_ops;
+	int saved = nr_ops;
+
+	nr_ops = ops;
+	bench_cur = b;
+	pthread_barrier_init(&bench_barrier, NULL, nr);
+	for (i = 0; i < nr; i++)
+		pthread_create(&threads[i].tid, NULL, bench_thread_fn,
+				&threads[i]);
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ns += threads[i].ns;
+		misses += threads[i].misses;
+		has_misses &= threads[i].has_misses;
+	}
+	pthread_barrier_destroy(&bench_barrier);
+	nr_ops = saved;
+
+	printf("%-14s %7d %10.1f", b->name, nr, (double)ns / nr / ops);
+	if (has_misses)
+		printf(" %10.2f", (double)misses / nr / ops);
+	else
+		printf(" %10s", "-");
+	printf("   %s\n", b->what);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n ops per thread] [-t max threads] "
+			"[-q requests in flight per thread]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread *threads;
+	unsigned int b;
+	u32 seed = 1;
+	int opt, i, nr;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "n:t:q:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_ops = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_ops <= 0 || max_threads <= 0 || queue_depth < 2)
+		usage(argv[0]);
+
+	ushim_init(max_threads);
+	bench_lstats = create_latency_stats(1);
+	bench_table = create_hash_table("ubench", 8192);
+	threads = calloc(max_threads, sizeof(*threads));
+	if (!bench_lstats || !bench_table || !threads) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < max_threads; i++) {
+		threads[i].cpu = i;
+		for (nr = 0; nr < NR_SAMPLES; nr++) {
+			threads[i].lat[nr] = draw_latency(&seed);
+			threads[i].size[nr] = draw_size(&seed);
+		}
+	}
+	/* what bench_find looks up, and some history for the fold */
+	for (i = 0; i < 8192; i++)
+		hash_table_insert(bench_table, 0xffff880000000000UL +
+				(unsigned long)i * 256, i);
+
+	printf("sizeof(struct latency_stats) %zu, %d buckets, %d ops\n",
+			sizeof(struct latency_stats), LAT_HIST_NR, nr_ops);
+	printf("%-14s %7s %10s %10s\n", "bench", "threads", "ns/op",
+			"misses/op");
+	for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+		for (nr = 1; ; nr *= 2) {
+			if (nr > max_threads)
+				nr = max_threads;
+			run(&benches[b], threads, nr);
+			if (nr == max_threads || benches[b].single)
+				break;
+		}
+	}
+
+	destroy_hash_table(bench_table);
+	destroy_latency_stats(bench_lstats);
+	free(threads);
+	return 0;
+}
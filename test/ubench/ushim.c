@@ -0,0 +1,140 @@
+/*
+ * ushim.c
+ *
+ * per-cpu memory and RCU for the userspace build, see ushim.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ */
+
+#include <limits.h>
+
+#include "ushim.h"
+
+#define USHIM_MAX_CPUS		1024
+#define USHIM_CACHE_LINE	64
+
+int ushim_nr_cpus = 1;
+__thread int ushim_cpu;
+
+struct percpu_area {
+	size_t unit;
+	/* keeps 'data' cache line aligned */
+	char pad[USHIM_CACHE_LINE - sizeof(size_t)];
+	char data[];
+};
+
+void *ushim_alloc_percpu(size_t size)
+{
+	struct percpu_area *area;
+	size_t unit = (size + USHIM_CACHE_LINE - 1) & ~(USHIM_CACHE_LINE - 1);
+
+	if (posix_memalign((void **)&area, USHIM_CACHE_LINE,
+				sizeof(*area) + unit * ushim_nr_cpus))
+		return NULL;
+	memset(area, 0, sizeof(*area) + unit * ushim_nr_cpus);
+	area->unit = unit;
+	return area->data;
+}
+
+void ushim_free_percpu(void *p)
+{
+	if (p)
+		free(container_of(p, struct percpu_area, data));
+}
+
+size_t ushim_percpu_unit(const void *p)
+{
+	return container_of(p, struct percpu_area, data)->unit;
+}
+
+/*
+ * Quiescent state based RCU.  A callback queued while the grace period
+ * counter was 'gp' runs once every thread taking part has reported a
+ * quiescent state numbered above it, each thread runs its own.
+ */
+static unsigned long rcu_gp;
+static unsigned long rcu_seen[USHIM_MAX_CPUS];
+static __thread struct rcu_head *rcu_pending;
+/* callbacks of threads that are gone, run by rcu_barrier() */
+static struct rcu_head *rcu_orphans;
+static spinlock_t rcu_orphans_lock;
+
+void ushim_init(int nr_cpus)
+{
+	int cpu;
+
+	ushim_nr_cpus = nr_cpus;
+	for (cpu = 0; cpu < USHIM_MAX_CPUS; cpu++)
+		rcu_seen[cpu] = ULONG_MAX;
+}
+
+void ushim_thread_start(void)
+{
+	__atomic_store_n(&rcu_seen[ushim_cpu],
+			__atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+}
+
+void ushim_thread_stop(void)
+{
+	struct rcu_head *head;
+
+	__atomic_store_n(&rcu_seen[ushim_cpu], ULONG_MAX, __ATOMIC_SEQ_CST);
+	spin_lock(&rcu_orphans_lock);
+	while ((head = rcu_pending)) {
+		rcu_pending = head->next;
+		head->next = rcu_orphans;
+		rcu_orphans = head;
+	}
+	spin_unlock(&rcu_orphans_lock);
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	head->func = func;
+	head->gp = __atomic_load_n(&rcu_gp, __ATOMIC_SEQ_CST);
+	head->next = rcu_pending;
+	rcu_pending = head;
+}
+
+static void run_callbacks(unsigned long before)
+{
+	struct rcu_head **link = &rcu_pending, *head;
+
+	while ((head = *link)) {
+		if (head->gp < before) {
+			*link = head->next;
+			head->func(head);
+		} else
+			link = &head->next;
+	}
+}
+
+void ushim_quiescent(void)
+{
+	unsigned long oldest = ULONG_MAX, seen;
+	int cpu;
+
+	__atomic_store_n(&rcu_seen[ushim_cpu],
+			__atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+	if (!rcu_pending)
+		return;
+	for (cpu = 0; cpu < ushim_nr_cpus; cpu++) {
+		seen = __atomic_load_n(&rcu_seen[cpu], __ATOMIC_SEQ_CST);
+		if (seen < oldest)
+			oldest = seen;
+	}
+	run_callbacks(oldest);
+}
+
+/* only called once no other thread uses the structures any more */
+void rcu_barrier(void)
+{
+	ushim_thread_stop();
+	rcu_pending = rcu_orphans;
+	rcu_orphans = NULL;
+	run_callbacks(ULONG_MAX);
+}
@@ -0,0 +1,382 @@
+/*
+ * ushim.h
+ *
+ * just enough of the kernel API to build latency_stats.c, histogram.c
+ * and hash_table.c unmodified as a userspace program, see ubench.c.
+ * 'make ubench' points every kernel header they include at this file.
+ *
+ * Per-cpu data is indexed by the thread's 'ushim_cpu', RCU readers are
+ * free and call_rcu() callbacks run once every benchmark thread went
+ * through ushim_quiescent(), spinlocks spin.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ */
+
+#ifndef _IO_LATENCY_USHIM_H_
+#define _IO_LATENCY_USHIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef int pid_t;
+typedef u64 sector_t;
+
+#define LINUX_VERSION_CODE		KERNEL_VERSION(3, 10, 0)
+#define KERNEL_VERSION(a, b, c)		(((a) << 16) + ((b) << 8) + (c))
+
+#define BITS_PER_LONG			(8 * (int)sizeof(long))
+#define NSEC_PER_USEC			1000L
+
+#define __percpu
+#define __maybe_unused			__attribute__((unused))
+#define likely(x)			__builtin_expect(!!(x), 1)
+#define unlikely(x)			__builtin_expect(!!(x), 0)
+#define ACCESS_ONCE(x)			(*(volatile __typeof__(x) *)&(x))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min_t(type, a, b)	((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b)	((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+
+#define WARN_ON_ONCE(x)		(x)
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline int ilog2(unsigned long x)
+{
+	return BITS_PER_LONG - 1 - __builtin_clzl(x);
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long x)
+{
+	return x <= 1 ? 1 : 1UL << (BITS_PER_LONG - __builtin_clzl(x - 1));
+}
+
+static inline u64 div_u64(u64 a, u32 b)
+{
+	return a / b;
+}
+
+static inline u64 div64_u64(u64 a, u64 b)
+{
+	return a / b;
+}
+
+/* multiplicative hash of newer kernels */
+static inline unsigned long hash_long(unsigned long val, unsigned int bits)
+{
+	return (u64)val * 0x61C8864680B583EBULL >> (64 - bits);
+}
+
+/* clock */
+static inline u64 local_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* memory */
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		0
+#define GFP_NOWAIT		0
+
+static inline void *kmalloc(size_t size, int gfp)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int gfp)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+#define vmalloc(size)		malloc(size)
+#define vfree(p)		free(p)
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+		size_t size, size_t align, unsigned long flags, void *ctor)
+{
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache)
+		cache->size = size;
+	return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, int gfp)
+{
+	return malloc(cache->size);
+}
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *cache, int gfp)
+{
+	return calloc(1, cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *p)
+{
+	free(p);
+}
+
+/* per-cpu: one cache line aligned copy per benchmark thread */
+extern int ushim_nr_cpus;
+extern __thread int ushim_cpu;
+
+void *ushim_alloc_percpu(size_t size);
+void ushim_free_percpu(void *p);
+size_t ushim_percpu_unit(const void *p);
+
+#define cpu_possible_mask		NULL
+#define cpumask_first(mask)		0
+#define num_possible_cpus()		ushim_nr_cpus
+#define for_each_possible_cpu(cpu)	\
+	for ((cpu) = 0; (cpu) < ushim_nr_cpus; (cpu)++)
+#define smp_processor_id()		ushim_cpu
+#define raw_smp_processor_id()		ushim_cpu
+
+#define alloc_percpu(type)	((type *)ushim_alloc_percpu(sizeof(type)))
+#define __alloc_percpu(size, align)	ushim_alloc_percpu(size)
+#define free_percpu(p)		ushim_free_percpu(p)
+#define per_cpu_ptr(p, cpu)	\
+	((__typeof__(p))((char *)(p) + (cpu) * ushim_percpu_unit(p)))
+#define this_cpu_ptr(p)		per_cpu_ptr(p, ushim_cpu)
+
+/* atomics */
+typedef struct {
+	long counter;
+} atomic64_t;
+
+#define atomic64_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_add(i, v)	\
+	__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED)
+
+static inline long atomic64_cmpxchg(atomic64_t *v, long old, long new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	return old;
+}
+
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__builtin_ia32_pause()
+#else
+#define cpu_relax()		__atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/* spinlocks, interrupts do not exist here */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+	lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define spin_lock_irqsave(lock, flags)	\
+	do { (flags) = 0; spin_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags)	\
+	do { (void)(flags); spin_unlock(lock); } while (0)
+
+struct mutex {
+	pthread_mutex_t lock;
+};
+
+#define DEFINE_MUTEX(name)	struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+
+static inline void mutex_lock(struct mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+}
+
+static inline void mutex_unlock(struct mutex *m)
+{
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* RCU */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+	unsigned long gp;
+};
+
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define synchronize_sched()	do { } while (0)
+#define rcu_dereference(p)	__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)	\
+	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+/* the calling thread holds no RCU protected pointer right now */
+void ushim_quiescent(void);
+/* 'nr_cpus' threads at most take part in the benchmark */
+void ushim_init(int nr_cpus);
+/* the calling thread (ushim_cpu) takes part in, or leaves, grace periods */
+void ushim_thread_start(void);
+void ushim_thread_stop(void);
+
+/* hlist, the variants of 3.9 and later */
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+static inline void hlist_add_head_rcu(struct hlist_node *n,
+				struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	if (first)
+		first->pprev = &n->next;
+	__atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+}
+
+static inline void hlist_del_rcu(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+
+	*n->pprev = next;
+	if (next)
+		next->pprev = n->pprev;
+	n->pprev = NULL;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (n->pprev)
+		hlist_del_rcu(n);
+	n->next = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) ({				\
+	__typeof__(ptr) ____ptr = (ptr);				\
+	____ptr ? container_of(____ptr, type, member) : NULL;		\
+})
+
+#define hlist_for_each_entry_rcu(pos, head, member)			\
+	for (pos = hlist_entry_safe(__atomic_load_n(&(head)->first,	\
+				__ATOMIC_CONSUME), __typeof__(*(pos)), member); \
+	     pos;							\
+	     pos = hlist_entry_safe(__atomic_load_n(&(pos)->member.next, \
+				__ATOMIC_CONSUME), __typeof__(*(pos)), member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member)		\
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+	     pos && ({ n = pos->member.next; 1; });			\
+	     pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+/* what compat.h refers to, never called by the benchmark */
+struct inode;
+struct file {
+	struct {
+		struct dentry *dentry;
+	} f_path;
+};
+struct dentry {
+	struct inode *d_inode;
+};
+struct vm_area_struct {
+	unsigned long vm_flags;
+};
+struct device;
+struct gendisk;
+struct hd_struct {
+	sector_t start_sect;
+	sector_t nr_sects;
+	int partno;
+};
+struct class_interface;
+struct file_operations;
+
+static inline void *PDE_DATA(const struct inode *inode)
+{
+	return NULL;
+}
+
+static inline struct hd_struct *dev_to_part(struct device *dev)
+{
+	return NULL;
+}
+
+static inline struct gendisk *dev_to_disk(struct device *dev)
+{
+	return NULL;
+}
+
+static inline struct gendisk *part_to_disk(struct hd_struct *part)
+{
+	return NULL;
+}
+
+static inline sector_t part_nr_sects_read(struct hd_struct *part)
+{
+	return part->nr_sects;
+}
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * top_n.c
+ *
+ * processes with the slowest I/O on a device
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/rcupdate.h>
+
+#include "top_n.h"
+
+struct top_n *top_n_create(unsigned int n)
+{
+	struct top_n *top;
+	int cpu;
+
+	if (!n)
+		return NULL;
+	top = kzalloc(sizeof(struct top_n), GFP_KERNEL);
+	if (!top)
+		return NULL;
+	top->n = min_t(unsigned int, n, TOP_N_MAX);
+	top->heaps = alloc_percpu(struct top_heap);
+	if (!top->heaps) {
+		kfree(top);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(top->heaps, cpu)->lock);
+	return top;
+}
+
+void top_n_destroy(struct top_n *top)
+{
+	if (!top)
+		return;
+	free_percpu(top->heaps);
+	kfree(top);
+}
+
+static void sift_up(struct top_heap *h, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (h->e[parent].sum <= h->e[i].sum)
+			break;
+		swap(h->e[parent], h->e[i]);
+		i = parent;
+	}
+}
+
+static void sift_down(struct top_heap *h, int i)
+{
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= h->nr)
+			break;
+		if (child + 1 < h->nr &&
+				h->e[child + 1].sum < h->e[child].sum)
+			child++;
+		if (h->e[i].sum <= h->e[child].sum)
+			break;
+		swap(h->e[i], h->e[child]);
+		i = child;
+	}
+}
+
+/* the submitter may have exited, its name is only looked up once */
+static void get_comm(pid_t pid, char *comm)
+{
+	struct task_struct *task;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+	if (task) {
+		memcpy(comm, task->comm, TASK_COMM_LEN);
+		comm[TASK_COMM_LEN - 1] = '\0';
+	} else
+		strcpy(comm, "-");
+	rcu_read_unlock();
+}
+
+static void top_heap_add(struct top_heap *h, int n, pid_t pid, u64 ns)
+{
+	struct top_entry *e;
+	int i;
+
+	for (i = 0; i < h->nr; i++) {
+		e = h->e + i;
+		if (e->pid == pid) {
+			e->count++;
+			e->sum += ns;
+			if (ns > e->max)
+				e->max = ns;
+			sift_down(h, i);
+			return;
+		}
+	}
+
+	if (h->nr < n)
+		i = h->nr++;
+	else if (ns > h->e[0].sum)
+		i = 0;
+	else
+		return;
+	e = h->e + i;
+	e->pid = pid;
+	get_comm(pid, e->comm);
+	e->count = 1;
+	e->sum = ns;
+	e->max = ns;
+	if (i)
+		sift_up(h, i);
+	else
+		sift_down(h, 0);
+}
+
+/* account one I/O of 'pid' that took 'ns' */
+void top_n_add(struct top_n *top, pid_t pid, u64 ns)
+{
+	struct top_heap *h;
+	unsigned long flags;
+
+	if (!top || !pid || !ns)
+		return;
+	/* completions may interrupt each other on a CPU */
+	local_irq_save(flags);
+	h = per_cpu_ptr(top->heaps, smp_processor_id());
+	spin_lock(&h->lock);
+	top_heap_add(h, top->n, pid, ns);
+	spin_unlock(&h->lock);
+	local_irq_restore(flags);
+}
+
+void top_n_clear(struct top_n *top)
+{
+	struct top_heap *h;
+	unsigned long flags;
+	int cpu;
+
+	if (!top)
+		return;
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(top->heaps, cpu);
+		spin_lock_irqsave(&h->lock, flags);
+		h->nr = 0;
+		spin_unlock_irqrestore(&h->lock, flags);
+	}
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	const struct top_entry *ea = a, *eb = b;
+
+	return ea->pid - eb->pid;
+}
+
+static int cmp_sum_desc(const void *a, const void *b)
+{
+	const struct top_entry *ea = a, *eb = b;
+
+	if (ea->sum == eb->sum)
+		return 0;
+	return ea->sum < eb->sum ? 1 : -1;
+}
+
+/*
+ * merge the heaps of all CPUs into 'out', which has room for top->n
+ * entries, slowest process first.  Returns the number of entries.
+ */
+int top_n_read(struct top_n *top, struct top_entry *out)
+{
+	struct top_entry *all;
+	struct top_heap *h;
+	unsigned long flags;
+	int cpu, i, nr = 0, merged = 0;
+
+	if (!top)
+		return 0;
+	all = vmalloc(sizeof(struct top_entry) * top->n *
+			num_possible_cpus());
+	if (!all)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(top->heaps, cpu);
+		spin_lock_irqsave(&h->lock, flags);
+		memcpy(all + nr, h->e, sizeof(struct top_entry) * h->nr);
+		nr += h->nr;
+		spin_unlock_irqrestore(&h->lock, flags);
+	}
+
+	/* add up the CPUs of every process */
+	sort(all, nr, sizeof(struct top_entry), cmp_pid, NULL);
+	for (i = 0; i < nr; i++) {
+		if (merged && all[merged - 1].pid == all[i].pid) {
+			all[merged - 1].count += all[i].count;
+			all[merged - 1].sum += all[i].sum;
+			all[merged - 1].max = max(all[merged - 1].max,
+						all[i].max);
+		} else
+			all[merged++] = all[i];
+	}
+	sort(all, merged, sizeof(struct top_entry), cmp_sum_desc, NULL);
+
+	nr = min(merged, top->n);
+	memcpy(out, all, sizeof(struct top_entry) * nr);
+	vfree(all);
+	return nr;
+}
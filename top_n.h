@@ -0,0 +1,45 @@
+#ifndef _IO_LATENCY_TOP_N_H_
+#define _IO_LATENCY_TOP_N_H_
+
+#include <linux/types.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+
+/*
+ * The processes whose I/O took the longest on a device.
+ *
+ * Every CPU keeps a min-heap of at most 'n' processes ordered by their
+ * latency sum.  A completion updates the process if it is in the heap of
+ * its CPU, otherwise it takes the place of the root when its latency
+ * alone is larger than the root's sum.  Readers merge the heaps of all
+ * CPUs, so a process may be missing from the result only if it never
+ * made it into the top of any CPU.
+ */
+#define TOP_N_MAX		32
+
+struct top_entry {
+	pid_t pid;			/* tgid of the submitter */
+	char comm[TASK_COMM_LEN];
+	u64 count;
+	u64 sum;			/* ns */
+	u64 max;			/* ns */
+};
+
+struct top_heap {
+	spinlock_t lock;
+	int nr;
+	struct top_entry e[TOP_N_MAX];
+};
+
+struct top_n {
+	struct top_heap __percpu *heaps;
+	int n;
+};
+
+struct top_n *top_n_create(unsigned int n);
+void top_n_destroy(struct top_n *top);
+void top_n_add(struct top_n *top, pid_t pid, u64 ns);
+void top_n_clear(struct top_n *top);
+int top_n_read(struct top_n *top, struct top_entry *out);
+
+#endif